@@ -425,6 +425,7 @@ int main() {
 
     float bg_color[4] = {1, 1, 1, 1};
 
+    UI_CreateContext();
     UI_DX11BackendInit(d3d_device, d3d_context);
     
     bool wireframe_mode = false;
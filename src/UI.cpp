@@ -1,7 +1,6 @@
-// TODO: Pack some icons, and font textures into a texture atlas (and a single white pixel for rectangles?)
+// TODO: Pack some icons into the glyph atlas (and a single white pixel for rectangles?)
 // TODO: Shapes like rounded rectangles and circles
 // TODO: Think up a way to specify widget attributes (push/pop?)
-// TODO: Hash the widgets and identify with key
 
 #ifdef _MSC_VER
 #define _CRT_SECURE_NO_WARNINGS
@@ -15,12 +14,77 @@
 #include <assert.h>
 #include <stdarg.h>
 
+#define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
 
-UI_State ui_state;
+#if !defined(UI_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define UI_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// NOTE: Enabled by /arch:AVX or /arch:AVX2
+#if defined(UI_SSE2) && defined(__AVX__)
+#define UI_AVX 1
+#include <immintrin.h>
+#endif
+
+#if defined(UI_AVX) && defined(__AVX2__)
+#define UI_AVX2 1
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+thread_local UI_Context *ui_context;
+
+UI_Context *UI_CreateContext() {
+    UI_Resources *resources = UI_CreateResources();
+    UI_Context *context = UI_CreateSharedContext(resources);
+    UI_ReleaseResources(resources);
+    return context;
+}
+
+UI_Context *UI_CreateSharedContext(UI_Resources *resources) {
+    UI_Context *context = new UI_Context();
+    context->wake_event = CreateEventA(NULL, FALSE, FALSE, NULL);
+    context->next_frame_time = INFINITY;
+    context->image_cache.stats.budget = UI_IMAGE_CACHE_BUDGET;
+    UI_Viewport *viewport = new UI_Viewport();
+    context->viewports[0] = viewport;
+    context->viewport = viewport;
+    context->mouse_viewport = viewport;
+
+    UI_AcquireResources(resources);
+    context->resources = resources;
+    {
+        std::lock_guard<std::mutex> lock(resources->mutex);
+        std::lock_guard<std::mutex> atlas_lock(resources->atlas_mutex);
+        std::lock_guard<std::mutex> image_lock(resources->image_mutex);
+        resources->contexts.push_back(context);
+        // NOTE: The first upload is the whole atlases
+        context->atlas_dirty = true;
+        if (resources->image_atlas.bitmap) {
+            context->image_dirty = UI_DirtyRect{0, 0, UI_IMAGE_ATLAS_SIZE, UI_IMAGE_ATLAS_SIZE};
+        }
+    }
+
+    if (!ui_context) {
+        ui_context = context;
+    }
+    return context;
+}
+
+void UI_SetCurrentContext(UI_Context *context) {
+    ui_context = context;
+}
+
+UI_Context *UI_GetCurrentContext() {
+    return ui_context;
+}
 
 bool UI_InRect(int x, int y, UI_Rect rect) {
     if (x >= rect.x && x <= (rect.x + rect.width) &&
@@ -32,23 +96,20 @@ bool UI_InRect(int x, int y, UI_Rect rect) {
 
 void UI_BorderColor(float r, float g, float b, float a) {
     UI_Vec4 color = {r, g, b, a};
-    ui_state.border_color_stack.push(color);
+    ui_context->border_color_stack.push(color);
 }
 
 void UI_BorderColorPop() {
-    ui_state.border_color_stack.pop();
+    ui_context->border_color_stack.pop();
 }
 
-UI_Widget *active_widget = nullptr;
-
 bool UI_AnyActive() {
-    return active_widget != nullptr;
+    return ui_context->active_key != 0;
 }
 
 bool UI_IsActive(UI_Widget *widget) {
     assert(widget->label != nullptr);
-    if (!active_widget) return false;
-    return strcmp(active_widget->label, widget->label) == 0;
+    return ui_context->active_key != 0 && ui_context->active_key == widget->key;
 }
 const UI_Vec4 RED  =   {1.0f, 0.0f, 0.0f, 1.0f};
 const UI_Vec4 GREEN  = {0.0f, 1.0f, 0.0f, 1.0f};
@@ -60,54 +121,603 @@ const UI_Vec4 DARKGRAY  = {0.5f, 0.5, 0.5, 1.0f};
 const UI_Vec4 GRAY  = {0.86f, 0.86f, 0.86f, 1.0f};
 const UI_Vec4 LIGHTGRAY  = {0.93f, 0.93f, 0.93f, 1.0f};
 
-bool UI_Win32WindowProc(HWND window, UINT message, WPARAM wparam, LPARAM lparam) {
-    switch (message) {
-    case WM_CHAR: {
-        ui_state.key = (char)(wparam);
-        return true;
+static void UI_MouseMotionAdd(UI_Event *event) {
+    UI_MouseMotion *motion = &ui_context->mouse_motion;
+    if (motion->last_x >= 0) {
+        float dx = (float)(event->x - motion->last_x);
+        float dy = (float)(event->y - motion->last_y);
+        motion->delta.x += dx;
+        motion->delta.y += dy;
+        motion->path_length += sqrtf(dx * dx + dy * dy);
     }
-    case WM_KEYUP:
-    case WM_KEYDOWN: {
-        ui_state.key_down = (message == WM_KEYDOWN);
-        return true;
+    motion->last_x = event->x;
+    motion->last_y = event->y;
+
+    if (motion->keep_samples) {
+        int *count = &motion->sample_count[motion->pending];
+        // NOTE: Past capacity the last sample is replaced so the path still ends at the mouse
+        if (*count == UI_MOUSE_SAMPLE_CAPACITY) {
+            (*count)--;
+        }
+        UI_MouseSample sample = {event->x, event->y, event->time};
+        motion->samples[motion->pending][(*count)++] = sample;
     }
-    case WM_LBUTTONUP:
-    case WM_LBUTTONDOWN:
-        ui_state.mouse_pressed = ui_state.mouse_down && (message == WM_LBUTTONUP);
-        ui_state.mouse_down = (message == WM_LBUTTONDOWN);
-        return true;
-    case WM_MOUSEMOVE: {
-        int x = GET_X_LPARAM(lparam);
-        int y = GET_Y_LPARAM(lparam);
-        float dx = (float)(x - ui_state.mouse_x);
-        float dy =(float) (y - ui_state.mouse_y);
-        ui_state.mouse_x = x;
-        ui_state.mouse_y = y;
-        ui_state.mouse_delta = {dx, dy};
-        ui_state.dragging = (wparam & MK_LBUTTON);
-        return true;
+}
+
+bool UI_PushEvent(UI_Event event) {
+    UI_EventQueue *queue = &ui_context->events;
+    if (event.type == UI_EventType_MouseMove) {
+        UI_MouseMotionAdd(&event);
+        // NOTE: A move right after another move not yet seen by a frame replaces it
+        if (queue->tail != queue->frame_end) {
+            UI_Event *last = &queue->events[(queue->tail - 1) & (UI_EVENT_QUEUE_SIZE - 1)];
+            if (last->type == UI_EventType_MouseMove) {
+                *last = event;
+                last->consumed = false;
+                return true;
+            }
+        }
+    }
+
+    if (queue->tail - queue->head == UI_EVENT_QUEUE_SIZE) {
+        queue->dropped++;
+        return false;
+    }
+    event.consumed = false;
+    queue->events[queue->tail & (UI_EVENT_QUEUE_SIZE - 1)] = event;
+    queue->tail++;
+    return true;
+}
+
+static UI_Event *UI_FindEvent(uint32_t position) {
+    UI_EventQueue *queue = &ui_context->events;
+    for (; position != queue->frame_end; position++) {
+        UI_Event *event = &queue->events[position & (UI_EVENT_QUEUE_SIZE - 1)];
+        if (!event->consumed) {
+            return event;
+        }
+    }
+    return nullptr;
+}
+
+// NOTE: Events of the current frame in the order they arrived, consumed ones are skipped
+UI_Event *UI_FirstEvent() {
+    return UI_FindEvent(ui_context->events.head);
+}
+
+UI_Event *UI_NextEvent(UI_Event *event) {
+    UI_EventQueue *queue = &ui_context->events;
+    uint32_t slot = (uint32_t)(event - queue->events);
+    uint32_t position = queue->head + ((slot - queue->head) & (UI_EVENT_QUEUE_SIZE - 1));
+    return UI_FindEvent(position + 1);
+}
+
+void UI_ConsumeEvent(UI_Event *event) {
+    event->consumed = true;
+}
+
+// NOTE: Takes the events queued since the last frame and folds the mouse ones into the mouse state.
+// The samples of the finished frame stay readable until the next frame begins.
+void UI_BeginEvents() {
+    ui_context->events.frame_end = ui_context->events.tail;
+
+    UI_MouseMotion *motion = &ui_context->mouse_motion;
+    ui_context->mouse_delta = motion->delta;
+    ui_context->mouse_path_length = motion->path_length;
+    ui_context->mouse_samples = motion->samples[motion->pending];
+    ui_context->mouse_sample_count = motion->sample_count[motion->pending];
+    motion->pending ^= 1;
+    motion->sample_count[motion->pending] = 0;
+    motion->delta = {};
+    motion->path_length = 0.0f;
+
+    // NOTE: Input can change what the next frame shows, so it gets one more frame to settle
+    if (ui_context->events.frame_end != ui_context->events.head) {
+        UI_RequestFrame(0.0);
+    }
+
+    ui_context->mouse_pressed = false;
+    for (UI_Event *event = UI_FirstEvent(); event; event = UI_NextEvent(event)) {
+        switch (event->type) {
+        case UI_EventType_KeyDown:
+        case UI_EventType_Char:
+            ui_context->caret_blink_start = ui_context->time;
+            break;
+        case UI_EventType_MouseMove:
+            ui_context->mouse_x = event->x;
+            ui_context->mouse_y = event->y;
+            if (ui_context->viewports[event->viewport]) {
+                ui_context->mouse_viewport = ui_context->viewports[event->viewport];
+            }
+            break;
+        case UI_EventType_MouseDown:
+            if (event->key == UI_MouseButton_Left) {
+                ui_context->mouse_down = true;
+            }
+            ui_context->caret_blink_start = ui_context->time;
+            break;
+        case UI_EventType_MouseUp:
+            if (event->key == UI_MouseButton_Left) {
+                ui_context->mouse_pressed |= ui_context->mouse_down;
+                ui_context->mouse_down = false;
+            }
+            break;
+        }
+    }
+    ui_context->dragging = ui_context->mouse_down;
+}
+
+void UI_EndEvents() {
+    // NOTE: Whatever the frame didn't consume is dropped, later events wait for the next frame
+    ui_context->events.head = ui_context->events.frame_end;
+}
+
+// NOTE: Frame scheduling
+
+static double UI_TimerFrequency() {
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    return (double)frequency.QuadPart;
+}
+
+double UI_GetTime() {
+    static double frequency = UI_TimerFrequency();
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / frequency;
+}
+
+// NOTE: Asks for a frame within delay seconds, from the UI thread
+void UI_RequestFrame(double delay) {
+    ui_context->next_frame_time = UI_MIN(ui_context->next_frame_time, UI_GetTime() + delay);
+}
+
+// NOTE: Wakes the host of context blocked in UI_WaitForEvents, safe to call from any thread
+void UI_PostWakeup(UI_Context *context) {
+    SetEvent(context->wake_event);
+}
+
+// NOTE: Blocks until there is input, a wake-up was posted or a requested frame is due
+void UI_WaitForEvents() {
+    if (ui_context->events.tail != ui_context->events.head) {
+        return;
+    }
+    DWORD timeout = INFINITE;
+    if (ui_context->next_frame_time < INFINITY) {
+        double wait = ui_context->next_frame_time - UI_GetTime();
+        if (wait <= 0.0) {
+            return;
+        }
+        timeout = (DWORD)ceil(wait * 1000.0);
     }
+    MsgWaitForMultipleObjectsEx(1, &ui_context->wake_event, timeout, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+}
+
+// NOTE: Whether the caret is shown this frame, asks for a frame for its next toggle
+bool UI_CaretVisible() {
+    double elapsed = ui_context->time - ui_context->caret_blink_start;
+    double phase = floor(elapsed / UI_CARET_BLINK_PERIOD);
+    UI_RequestFrame((phase + 1.0) * UI_CARET_BLINK_PERIOD - elapsed);
+    return fmod(phase, 2.0) == 0.0;
+}
+
+// NOTE: Job system
+
+static thread_local UI_JobSystem *ui_job_owner;
+static thread_local int ui_job_queue;
+
+// NOTE: Newest job from our own deque, or the oldest from someone else's
+static bool UI_JobPop(UI_JobSystem *system, int own, UI_Job *job) {
+    {
+        UI_JobQueue *queue = &system->queues[own];
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        if (!queue->jobs.empty()) {
+            *job = queue->jobs.back();
+            queue->jobs.pop_back();
+            system->queued.fetch_sub(1);
+            return true;
+        }
+    }
+    for (int i = 1; i < system->queue_count; i++) {
+        UI_JobQueue *queue = &system->queues[(own + i) % system->queue_count];
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        if (!queue->jobs.empty()) {
+            *job = queue->jobs.front();
+            queue->jobs.pop_front();
+            system->queued.fetch_sub(1);
+            return true;
+        }
     }
     return false;
 }
 
+static void UI_JobRun(UI_JobSystem *system, UI_Job *job) {
+    UI_Context *previous = ui_context;
+    ui_context = job->context;
+    job->func(job->data, job->index);
+    ui_context = previous;
+    if (job->group->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        // NOTE: Wakes threads sleeping in UI_JobWait. The group may be gone once pending is 0,
+        // so it isn't touched past this point.
+        std::lock_guard<std::mutex> lock(system->sleep_mutex);
+        system->wake.notify_all();
+    }
+}
+
+static void UI_JobWorker(UI_JobSystem *system, int queue) {
+    ui_job_owner = system;
+    ui_job_queue = queue;
+    for (;;) {
+        UI_Job job;
+        if (UI_JobPop(system, queue, &job)) {
+            UI_JobRun(system, &job);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(system->sleep_mutex);
+        system->wake.wait(lock, [&] { return system->quit || system->queued.load() > 0; });
+        if (system->quit) {
+            return;
+        }
+    }
+}
+
+static UI_JobSystem *UI_GetJobSystem() {
+    UI_Context *context = ui_context;
+    if (context->jobs) {
+        return context->jobs;
+    }
+    UI_Resources *resources = context->resources;
+    std::lock_guard<std::mutex> lock(resources->mutex);
+    if (!resources->jobs) {
+        UI_JobSystem *system = new UI_JobSystem();
+        system->thread_count = context->job_threads > 0 ? context->job_threads : UI_MAX((int)std::thread::hardware_concurrency(), 1);
+        int worker_count = UI_MAX(system->thread_count - 1, 1);
+        system->queue_count = worker_count + 1;
+        system->queues = new UI_JobQueue[system->queue_count];
+        for (int i = 1; i < system->queue_count; i++) {
+            system->threads.push_back(std::thread(UI_JobWorker, system, i));
+        }
+        resources->jobs = system;
+    }
+    context->jobs = resources->jobs;
+    return context->jobs;
+}
+
+static void UI_JobSystemDestroy(UI_JobSystem *system) {
+    {
+        std::lock_guard<std::mutex> lock(system->sleep_mutex);
+        system->quit = true;
+    }
+    system->wake.notify_all();
+    for (int i = 0; i < (int)system->threads.size(); i++) {
+        system->threads[i].join();
+    }
+    delete[] system->queues;
+    delete system;
+}
+
+// NOTE: Only takes effect before the first job is spawned by any context of the resources
+void UI_SetJobThreads(int count) {
+    ui_context->job_threads = count;
+}
+
+int UI_JobThreadCount() {
+    return UI_GetJobSystem()->thread_count;
+}
+
+void UI_JobSpawn(UI_JobGroup *group, UI_JobFunc *func, void *data, int index) {
+    UI_JobSystem *system = UI_GetJobSystem();
+    group->pending.fetch_add(1, std::memory_order_relaxed);
+    UI_Job job = {ui_context, func, data, index, group};
+    UI_JobQueue *queue = &system->queues[ui_job_owner == system ? ui_job_queue : 0];
+    {
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        queue->jobs.push_back(job);
+    }
+    system->queued.fetch_add(1);
+    {
+        // NOTE: Taking the lock orders this push against a worker about to sleep
+        std::lock_guard<std::mutex> lock(system->sleep_mutex);
+    }
+    system->wake.notify_one();
+}
+
+// NOTE: Runs queued jobs, ours first, until everything in the group has finished
+void UI_JobWait(UI_JobGroup *group) {
+    UI_JobSystem *system = ui_context->jobs;
+    if (!system) {
+        // NOTE: Nothing was ever spawned from this context
+        assert(group->pending.load() == 0);
+        return;
+    }
+    int own = ui_job_owner == system ? ui_job_queue : 0;
+    while (group->pending.load(std::memory_order_acquire) > 0) {
+        UI_Job job;
+        if (UI_JobPop(system, own, &job)) {
+            UI_JobRun(system, &job);
+            continue;
+        }
+        // NOTE: The group's last job notifies under the lock, so its finish can't slip in
+        // between the check and the wait
+        std::unique_lock<std::mutex> lock(system->sleep_mutex);
+        system->wake.wait(lock, [&] {
+            return group->pending.load(std::memory_order_acquire) == 0 || system->queued.load() > 0;
+        });
+    }
+}
+
+// NOTE: Calls func(data, i) for i in [0, count) across the job system and waits for all of them
+void UI_ParallelFor(int count, UI_JobFunc *func, void *data) {
+    UI_JobGroup group;
+    group.pending = 0;
+    for (int i = 0; i < count; i++) {
+        UI_JobSpawn(&group, func, data, i);
+    }
+    UI_JobWait(&group);
+}
+
+UI_JobGroup *UI_FrameJobs() {
+    return &ui_context->frame_jobs;
+}
+
+// NOTE: Lock-free rings
+
+UI_Ring *UI_RingCreate(int element_size, int capacity) {
+    assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+    UI_Ring *ring = new UI_Ring();
+    ring->context = ui_context;
+    ring->element_size = element_size;
+    ring->capacity = (uint32_t)capacity;
+    ring->sequences = new std::atomic<uint64_t>[capacity];
+    for (int i = 0; i < capacity; i++) {
+        ring->sequences[i].store((uint64_t)i, std::memory_order_relaxed);
+    }
+    ring->elements = (char *)malloc((size_t)element_size * capacity);
+    ring->tail = 0;
+    ring->head = 0;
+    ring->wake_pending = false;
+    ring->dropped = 0;
+    return ring;
+}
+
+void UI_RingDestroy(UI_Ring *ring) {
+    delete[] ring->sequences;
+    free(ring->elements);
+    delete ring;
+}
+
+// NOTE: Safe from any thread, returns false and counts the element as dropped if the ring is full
+bool UI_RingPush(UI_Ring *ring, void *element) {
+    uint32_t mask = ring->capacity - 1;
+    uint64_t position = ring->tail.load(std::memory_order_relaxed);
+    for (;;) {
+        uint64_t sequence = ring->sequences[position & mask].load(std::memory_order_acquire);
+        int64_t diff = (int64_t)(sequence - position);
+        if (diff == 0) {
+            if (ring->tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // NOTE: The cell still holds an element the UI hasn't popped
+            ring->dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        } else {
+            position = ring->tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    memcpy(ring->elements + (position & mask) * ring->element_size, element, ring->element_size);
+    ring->sequences[position & mask].store(position + 1, std::memory_order_release);
+    if (!ring->wake_pending.exchange(true)) {
+        UI_PostWakeup(ring->context);
+    }
+    return true;
+}
+
+// NOTE: UI thread only. Pops up to max_count elements into out in push order.
+int UI_RingPop(UI_Ring *ring, void *out, int max_count) {
+    // NOTE: Cleared before reading, so a push that lands after the last pop wakes the UI again
+    ring->wake_pending.exchange(false);
+    uint32_t mask = ring->capacity - 1;
+    int count = 0;
+    while (count < max_count) {
+        std::atomic<uint64_t> *sequence = &ring->sequences[ring->head & mask];
+        if (sequence->load(std::memory_order_acquire) != ring->head + 1) {
+            break;
+        }
+        memcpy((char *)out + count * ring->element_size, ring->elements + (ring->head & mask) * ring->element_size, ring->element_size);
+        sequence->store(ring->head + ring->capacity, std::memory_order_release);
+        ring->head++;
+        count++;
+    }
+    return count;
+}
+
+static int UI_Win32Modifiers() {
+    int modifiers = 0;
+    if (GetKeyState(VK_SHIFT) < 0) modifiers |= UI_Modifier_Shift;
+    if (GetKeyState(VK_CONTROL) < 0) modifiers |= UI_Modifier_Ctrl;
+    if (GetKeyState(VK_MENU) < 0) modifiers |= UI_Modifier_Alt;
+    return modifiers;
+}
+
+// NOTE: Windows that aren't a viewport's go to the main viewport
+static int UI_ViewportIndex(HWND window) {
+    for (int i = 1; i < UI_MAX_VIEWPORTS; i++) {
+        if (ui_context->viewports[i] && ui_context->viewports[i]->window == window) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+bool UI_Win32WindowProc(HWND window, UINT message, WPARAM wparam, LPARAM lparam) {
+    // NOTE: Windows send messages while being created, possibly before there is a context
+    if (!ui_context) {
+        return false;
+    }
+    UI_Event event{};
+    event.viewport = UI_ViewportIndex(window);
+    event.time = (uint32_t)GetMessageTime();
+    event.modifiers = UI_Win32Modifiers();
+    event.x = GET_X_LPARAM(lparam);
+    event.y = GET_Y_LPARAM(lparam);
+    switch (message) {
+    case WM_CHAR:
+        event.type = UI_EventType_Char;
+        event.character = (uint32_t)wparam;
+        break;
+    case WM_KEYDOWN:
+    case WM_KEYUP:
+        event.type = message == WM_KEYDOWN ? UI_EventType_KeyDown : UI_EventType_KeyUp;
+        event.key = (int)wparam;
+        break;
+    case WM_LBUTTONDOWN:
+    case WM_LBUTTONUP:
+        event.type = message == WM_LBUTTONDOWN ? UI_EventType_MouseDown : UI_EventType_MouseUp;
+        event.key = UI_MouseButton_Left;
+        break;
+    case WM_RBUTTONDOWN:
+    case WM_RBUTTONUP:
+        event.type = message == WM_RBUTTONDOWN ? UI_EventType_MouseDown : UI_EventType_MouseUp;
+        event.key = UI_MouseButton_Right;
+        break;
+    case WM_MBUTTONDOWN:
+    case WM_MBUTTONUP:
+        event.type = message == WM_MBUTTONDOWN ? UI_EventType_MouseDown : UI_EventType_MouseUp;
+        event.key = UI_MouseButton_Middle;
+        break;
+    case WM_MOUSEMOVE:
+        event.type = UI_EventType_MouseMove;
+        break;
+    case WM_SIZE:
+        UI_RequestFrame(0.0);
+        return false;
+    case WM_MOUSEWHEEL:
+        // NOTE: Wheel messages carry screen coordinates, the mouse position is kept from moves
+        event.type = UI_EventType_MouseWheel;
+        event.wheel = (float)GET_WHEEL_DELTA_WPARAM(wparam) / (float)WHEEL_DELTA;
+        event.x = ui_context->mouse_x;
+        event.y = ui_context->mouse_y;
+        break;
+    default:
+        return false;
+    }
+    UI_PushEvent(event);
+    return true;
+}
+
 void UI_DX11BackendInit(ID3D11Device *device, ID3D11DeviceContext *device_context) {
-    DX11_Backend_Data *bd = &ui_state.backend_data;
+    DX11_Backend_Data *bd = &ui_context->backend_data;
     bd->device = device;
     bd->device_context = device_context;
 }
 
 void *UI_GetBackendData() {
-    return (void *)&ui_state.backend_data;
+    return (void *)&ui_context->backend_data;
+}
+
+void UI_DX11UploadAtlas(DX11_Backend_Data *bd, unsigned char *bitmap) {
+    UI_TextureAtlas *atlas = &ui_context->resources->atlas;
+    if (!bd->font_texture) {
+        D3D11_TEXTURE2D_DESC desc{};
+        desc.Width = atlas->width;
+        desc.Height = atlas->height;
+        desc.MipLevels = 1;
+        desc.ArraySize = 1;
+        desc.Format = DXGI_FORMAT_R8_UNORM;
+        desc.SampleDesc.Count = 1;
+        desc.SampleDesc.Quality = 0;
+        desc.Usage = D3D11_USAGE_DEFAULT;
+        desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+        desc.CPUAccessFlags = 0;
+        HRESULT hr = bd->device->CreateTexture2D(&desc, nullptr, &bd->font_texture);
+        assert(SUCCEEDED(hr));
+        assert(bd->font_texture != nullptr);
+        hr = bd->device->CreateShaderResourceView(bd->font_texture, nullptr, &bd->font_texture_view);
+        assert(SUCCEEDED(hr));
+    }
+
+    // NOTE: Fonts can be loaded at any time, so the whole atlas is re-uploaded when it changes
+    bd->device_context->UpdateSubresource(bd->font_texture, 0, nullptr, bitmap, atlas->width, 0);
+}
+
+// NOTE: Uploads the texels in rect, bitmap is the whole image atlas
+void UI_DX11UploadImageAtlas(DX11_Backend_Data *bd, uint32_t *bitmap, UI_DirtyRect rect) {
+    UINT pitch = UI_IMAGE_ATLAS_SIZE * sizeof(uint32_t);
+    if (!bd->image_texture) {
+        D3D11_TEXTURE2D_DESC desc{};
+        desc.Width = UI_IMAGE_ATLAS_SIZE;
+        desc.Height = UI_IMAGE_ATLAS_SIZE;
+        desc.MipLevels = 1;
+        desc.ArraySize = 1;
+        desc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+        desc.SampleDesc.Count = 1;
+        desc.SampleDesc.Quality = 0;
+        desc.Usage = D3D11_USAGE_DEFAULT;
+        desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+        desc.CPUAccessFlags = 0;
+        // NOTE: Texels outside of rect were never written, so the texture starts from the whole bitmap
+        D3D11_SUBRESOURCE_DATA data{};
+        data.pSysMem = bitmap;
+        data.SysMemPitch = pitch;
+        HRESULT hr = bd->device->CreateTexture2D(&desc, &data, &bd->image_texture);
+        assert(SUCCEEDED(hr));
+        assert(bd->image_texture != nullptr);
+        hr = bd->device->CreateShaderResourceView(bd->image_texture, nullptr, &bd->image_texture_view);
+        assert(SUCCEEDED(hr));
+        return;
+    }
+
+    D3D11_BOX box{};
+    box.left = rect.x0;
+    box.top = rect.y0;
+    box.right = rect.x1;
+    box.bottom = rect.y1;
+    box.front = 0;
+    box.back = 1;
+    bd->device_context->UpdateSubresource(bd->image_texture, 0, &box, bitmap + (size_t)rect.y0 * UI_IMAGE_ATLAS_SIZE + rect.x0, pitch, 0);
 }
 
+// NOTE: Draws the main viewport into the bound target
 void UI_Render() {
+    UI_RenderViewport(ui_context->viewports[0]);
+}
+
+// NOTE: Draws a viewport's last frame into the bound target, without a render thread
+void UI_RenderViewport(UI_Viewport *viewport) {
     DX11_Backend_Data *backend = (DX11_Backend_Data *)UI_GetBackendData();
-    UI_Draw_Data *draw_data = &ui_state.draw_data;
+    UI_Resources *resources = ui_context->resources;
+    if (backend->device) {
+        std::lock_guard<std::mutex> lock(resources->atlas_mutex);
+        if (ui_context->atlas_dirty) {
+            UI_DX11UploadAtlas(backend, resources->atlas.bitmap);
+            ui_context->atlas_dirty = false;
+        }
+    }
+    if (backend->device) {
+        std::lock_guard<std::mutex> lock(resources->image_mutex);
+        UI_DirtyRect dirty = ui_context->image_dirty;
+        if (dirty.x0 < dirty.x1) {
+            UI_DX11UploadImageAtlas(backend, resources->image_atlas.bitmap, dirty);
+            ui_context->image_dirty = UI_DirtyRect{};
+        }
+    }
+    UI_RenderDrawData(&viewport->draw_data);
+}
 
+// NOTE: Draws a finished frame, on the render thread if there is one. The atlases are uploaded
+// separately since they are shared by every frame.
+void UI_RenderDrawData(UI_Draw_Data *draw_data) {
+    DX11_Backend_Data *backend = (DX11_Backend_Data *)UI_GetBackendData();
     ID3D11Device *device = backend->device;
     ID3D11DeviceContext *context = backend->device_context;
 
+    // NOTE: Headless, e.g. replaying a recording without a backend
+    if (!device) {
+        return;
+    }
+
     if (!backend->vertex_buffer || backend->vertex_buffer_size < draw_data->vertex_count) {
         if (backend->vertex_buffer) {
             backend->vertex_buffer->Release();
@@ -189,8 +799,10 @@ void UI_Render() {
     context->VSSetShader(backend->vertex_shader, 0, 0);
 
     context->PSSetShader(backend->pixel_shader, 0, 0);
-    context->PSSetSamplers(0, 1, &backend->font_sampler);
-    context->PSSetShaderResources(0, 1, &backend->font_texture_view);
+    ID3D11SamplerState *samplers[2] = {backend->font_sampler, backend->image_sampler};
+    ID3D11ShaderResourceView *views[2] = {backend->font_texture_view, backend->image_texture_view};
+    context->PSSetSamplers(0, 2, samplers);
+    context->PSSetShaderResources(0, 2, views);
 
     context->RSSetState(backend->rasterizer_state);
     context->RSSetViewports(1, &viewport);
@@ -233,9 +845,13 @@ void UI_DX11CreateDeviceObjects(DX11_Backend_Data *bd) {
             "float2 uv : TEXCOORD0;\n"
             "};\n"
             "Texture2D texture0 : register(t0);\n"
+            "Texture2D texture1 : register(t1);\n"
             "sampler sampler0 : register(s0);\n"
+            "sampler sampler1 : register(s1);\n"
             "float4 PS(PS_INPUT input) : SV_TARGET {\n"
-            "return texture0.Sample(sampler0, input.uv).r * input.color;\n"
+            "float4 glyph = texture0.Sample(sampler0, input.uv).r * input.color;\n"
+            "float4 image = texture1.Sample(sampler1, input.uv - float2(2.0, 0.0)) * input.color;\n"
+            "return input.uv.x >= 2.0 ? image : float4(glyph.rgb * glyph.a, glyph.a);\n"
             "}\n";
 
         UINT flags = D3DCOMPILE_ENABLE_STRICTNESS;
@@ -300,11 +916,13 @@ void UI_DX11CreateDeviceObjects(DX11_Backend_Data *bd) {
     }
 
     // BLEND STATE
+    // NOTE: Premultiplied alpha, images are stored premultiplied so filtering doesn't bleed
+    // the color of transparent texels
     {
         D3D11_BLEND_DESC desc{};
         desc.AlphaToCoverageEnable = false;
         desc.RenderTarget[0].BlendEnable = true;
-        desc.RenderTarget[0].SrcBlend = D3D11_BLEND_SRC_ALPHA;
+        desc.RenderTarget[0].SrcBlend = D3D11_BLEND_ONE;
         desc.RenderTarget[0].DestBlend = D3D11_BLEND_INV_SRC_ALPHA;
         desc.RenderTarget[0].BlendOp = D3D11_BLEND_OP_ADD;
         desc.RenderTarget[0].SrcBlendAlpha = D3D11_BLEND_ONE;
@@ -324,127 +942,6 @@ void UI_DX11CreateDeviceObjects(DX11_Backend_Data *bd) {
         bd->device->CreateRasterizerState(&desc, &bd->rasterizer_state);
     }
 
-    // FONT TEXTURE VIEW
-    const char *font_name = "fonts/arial.ttf";
-    int font_height = 16;
-    FontAtlas atlas{};
-    {
-        FT_Library ft_lib;
-        int err = FT_Init_FreeType(&ft_lib);
-        if (err) {
-            printf("Error creaing freetype library: %d\n", err);
-        }
-
-        FT_Face face;
-        err = FT_New_Face(ft_lib, font_name, 0, &face);
-        if (err == FT_Err_Unknown_File_Format) {
-            printf("Format not supported\n");
-        } else if (err) {
-            printf("Font file could not be read\n");
-        }
-
-        err = FT_Set_Pixel_Sizes(face, 0, font_height);
-        if (err) {
-            printf("Error setting pixel sizes of font\n");
-        }
-
-        int bbox_ymax = FT_MulFix(face->bbox.yMax, face->size->metrics.y_scale) >> 6;
-        int bbox_ymin = FT_MulFix(face->bbox.yMin, face->size->metrics.y_scale) >> 6;
-        int height = bbox_ymax - bbox_ymin;
-        float ascend = face->size->metrics.ascender / 64.f;
-        float descend = face->size->metrics.descender / 64.f;
-        float bbox_height = (float)(bbox_ymax - bbox_ymin);
-        float glyph_height = (float)face->size->metrics.height / 64.f;
-        float glyph_width = (float)(face->bbox.xMax - face->bbox.xMin) / 64.f;
-
-        int atlas_width = 0;
-        int atlas_height = 0;
-        int max_bmp_height = 0;
-        for (unsigned char c = 32; c < 128; c++) {
-            if (FT_Load_Char(face, c, FT_LOAD_RENDER)) {
-                printf("Error loading char %c\n", c);
-                continue;
-            }
-
-            atlas_width += face->glyph->bitmap.width;
-            if (atlas_height < (int)face->glyph->bitmap.rows) {
-                atlas_height = face->glyph->bitmap.rows;
-            }
-
-            int bmp_height = face->glyph->bitmap.rows + face->glyph->bitmap_top;
-            if (max_bmp_height < bmp_height) {
-                max_bmp_height = bmp_height;
-            }
-        }
-
-        // +1 for the white pixel
-        atlas_width = atlas_width + 1;
-        int atlas_x = 1;
-        
-        // Pack glyph bitmaps
-        unsigned char *bitmap = (unsigned char *)calloc(atlas_width * atlas_height + 1, 1);
-        bitmap[0] = 255;
-        for (unsigned char c = 32; c < 128; c++) {
-            if (FT_Load_Char(face, c, FT_LOAD_RENDER)) {
-                printf("Error loading char '%c'\n", c);
-            }
-
-            FontGlyph *glyph = &atlas.glyphs[c];
-            glyph->ax = (float)(face->glyph->advance.x >> 6);
-            glyph->ay = (float)(face->glyph->advance.y >> 6);
-            glyph->bx = (float)face->glyph->bitmap.width;
-            glyph->by = (float)face->glyph->bitmap.rows;
-            glyph->bt = (float)face->glyph->bitmap_top;
-            glyph->bl = (float)face->glyph->bitmap_left;
-            glyph->to = (float)atlas_x / atlas_width;
-            
-            // Write glyph bitmap to atlas
-            for (int y = 0; y < glyph->by; y++) {
-                unsigned char *dest = bitmap + y * atlas_width + atlas_x;
-                unsigned char *source = face->glyph->bitmap.buffer + y * face->glyph->bitmap.width;
-                memcpy(dest, source, face->glyph->bitmap.width);
-            }
-
-            atlas_x += face->glyph->bitmap.width;
-        }
-
-        atlas.width = atlas_width;
-        atlas.height = atlas_height;
-        atlas.max_bmp_height = max_bmp_height;
-        atlas.ascend = ascend;
-        atlas.descend = descend;
-        atlas.bbox_height = height;
-        atlas.glyph_width = glyph_width;
-        atlas.glyph_height = glyph_height;
-
-        FT_Done_Face(face);
-        FT_Done_FreeType(ft_lib);
-
-        D3D11_TEXTURE2D_DESC desc{};
-        desc.Width = atlas_width;
-        desc.Height = atlas_height;
-        desc.MipLevels = 1;
-        desc.ArraySize = 1;
-        desc.Format = DXGI_FORMAT_R8_UNORM;
-        desc.SampleDesc.Count = 1;
-        desc.SampleDesc.Quality = 0;
-        desc.Usage = D3D11_USAGE_IMMUTABLE;
-        desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
-        desc.CPUAccessFlags = 0;
-        ID3D11Texture2D *font_texture = nullptr;
-        D3D11_SUBRESOURCE_DATA sr_data{};
-        sr_data.pSysMem = bitmap;
-        sr_data.SysMemPitch = atlas_width;
-        sr_data.SysMemSlicePitch = 0;
-        HRESULT hr = bd->device->CreateTexture2D(&desc, &sr_data, &font_texture);
-        assert(SUCCEEDED(hr));
-        assert(font_texture != nullptr);
-        hr = bd->device->CreateShaderResourceView(font_texture, nullptr, &bd->font_texture_view);
-        assert(SUCCEEDED(hr));
-
-        ui_state.font_atlas = atlas;
-    }
-
     // FONT SAMPLER
     {
         D3D11_SAMPLER_DESC desc{};
@@ -457,26 +954,2407 @@ void UI_DX11CreateDeviceObjects(DX11_Backend_Data *bd) {
         assert(SUCCEEDED(hr));
     }
 
+    // IMAGE SAMPLER
+    {
+        D3D11_SAMPLER_DESC desc{};
+        desc.Filter = D3D11_FILTER_MIN_MAG_MIP_LINEAR;
+        desc.AddressU = D3D11_TEXTURE_ADDRESS_CLAMP;
+        desc.AddressV = D3D11_TEXTURE_ADDRESS_CLAMP;
+        desc.AddressW = D3D11_TEXTURE_ADDRESS_CLAMP;
+        desc.ComparisonFunc = D3D11_COMPARISON_NEVER;
+        HRESULT hr = bd->device->CreateSamplerState(&desc, &bd->image_sampler);
+        assert(SUCCEEDED(hr));
+    }
+
 }
 
 void UI_DX11NewFrame() {
-    DX11_Backend_Data *bd = &ui_state.backend_data;
-    if (!bd->font_sampler) {
+    DX11_Backend_Data *bd = &ui_context->backend_data;
+    if (bd->device && !bd->font_sampler) {
         UI_DX11CreateDeviceObjects(bd);
     }
 }
 
-float UI_GetTextWidthRanged(char *text, int start, int end, FontAtlas *font) {
-    float width = 0.0f;
-    for (char *ptr = text + start; ptr < text + end; ptr++) {
-        FontGlyph glyph = font->glyphs[*ptr];
-        width += glyph.ax;
+// NOTE: Software rasterizer
+
+UI_RasterTarget *UI_RasterTargetCreate(int width, int height) {
+    UI_RasterTarget *target = new UI_RasterTarget();
+    target->width = width;
+    target->height = height;
+    target->pixels = (uint32_t *)malloc((size_t)width * height * sizeof(uint32_t));
+    return target;
+}
+
+void UI_RasterTargetDestroy(UI_RasterTarget *target) {
+    free(target->pixels);
+    delete target;
+}
+
+static bool UI_RasterSetup(UI_RasterTriangle *tri, UI_Vertex *v) {
+    float x0 = v[0].position.x, y0 = v[0].position.y;
+    float x1 = v[1].position.x, y1 = v[1].position.y;
+    float x2 = v[2].position.x, y2 = v[2].position.y;
+    float det = (x1 - x0) * (y2 - y0) - (x2 - x0) * (y1 - y0);
+    if (det == 0.0f) {
+        return false;
+    }
+
+    // NOTE: Rows and columns whose pixel centers can be inside
+    tri->x0 = (int)ceilf(UI_MIN(x0, UI_MIN(x1, x2)) - 0.5f);
+    tri->x1 = (int)ceilf(UI_MAX(x0, UI_MAX(x1, x2)) - 0.5f);
+    tri->y0 = (int)ceilf(UI_MIN(y0, UI_MIN(y1, y2)) - 0.5f);
+    tri->y1 = (int)ceilf(UI_MAX(y0, UI_MAX(y1, y2)) - 0.5f);
+    if (tri->x0 >= tri->x1 || tri->y0 >= tri->y1) {
+        return false;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        UI_Vec2 a = v[i].position;
+        UI_Vec2 b = v[(i + 1) % 3].position;
+        UI_Vec2 c = v[(i + 2) % 3].position;
+        if (a.y > b.y || (a.y == b.y && a.x > b.x)) {
+            UI_Vec2 t = a;
+            a = b;
+            b = t;
+        }
+        tri->edge_x[i] = a.x;
+        tri->edge_y[i] = a.y;
+        if (a.y == b.y) {
+            tri->edge_side[i] = 0;
+            tri->edge_dxdy[i] = 0.0f;
+            continue;
+        }
+        tri->edge_dxdy[i] = (b.x - a.x) / (b.y - a.y);
+        // NOTE: The inside is to the right of a downward edge if the third vertex is
+        float side = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+        tri->edge_side[i] = side < 0.0f ? 1 : -1;
+    }
+
+    float attributes[3][6];
+    for (int i = 0; i < 3; i++) {
+        attributes[i][0] = v[i].color.r;
+        attributes[i][1] = v[i].color.g;
+        attributes[i][2] = v[i].color.b;
+        attributes[i][3] = v[i].color.a;
+        attributes[i][4] = v[i].uv.x;
+        attributes[i][5] = v[i].uv.y;
+    }
+    tri->constant = true;
+    for (int k = 0; k < 6; k++) {
+        float d1 = attributes[1][k] - attributes[0][k];
+        float d2 = attributes[2][k] - attributes[0][k];
+        tri->dx[k] = (d1 * (y2 - y0) - d2 * (y1 - y0)) / det;
+        tri->dy[k] = (d2 * (x1 - x0) - d1 * (x2 - x0)) / det;
+        tri->base[k] = attributes[0][k] - tri->dx[k] * x0 - tri->dy[k] * y0;
+        if (d1 != 0.0f || d2 != 0.0f) {
+            tri->constant = false;
+        }
+    }
+    return true;
+}
+
+static float UI_RasterTexel(UI_RasterTarget *target, float u, float v) {
+    int x = (int)floorf(u * target->atlas_width) & (target->atlas_width - 1);
+    int y = (int)floorf(v * target->atlas_height) & (target->atlas_height - 1);
+    return target->atlas[y * target->atlas_width + x] * (1.0f / 255.0f);
+}
+
+static uint32_t UI_RasterImageTexel(UI_RasterTarget *target, float u, float v) {
+    int x = (int)floorf((u - UI_IMAGE_UV_OFFSET) * UI_IMAGE_ATLAS_SIZE);
+    int y = (int)floorf(v * UI_IMAGE_ATLAS_SIZE);
+    x = UI_CLAMP(x, 0, UI_IMAGE_ATLAS_SIZE - 1);
+    y = UI_CLAMP(y, 0, UI_IMAGE_ATLAS_SIZE - 1);
+    return target->image_atlas[(size_t)y * UI_IMAGE_ATLAS_SIZE + x];
+}
+
+// NOTE: Premultiplied output of the pixel shader for a straight alpha color at (u, v)
+static void UI_RasterSource(UI_RasterTarget *target, float *color, float u, float v, float *out) {
+    if (u >= UI_IMAGE_UV_OFFSET) {
+        uint32_t texel = UI_RasterImageTexel(target, u, v);
+        for (int k = 0; k < 4; k++) {
+            out[k] = (float)((texel >> (8 * k)) & 0xFF) * (1.0f / 255.0f) * color[k];
+        }
+        return;
+    }
+    float texel = UI_RasterTexel(target, u, v);
+    float alpha = color[3] * texel;
+    for (int k = 0; k < 3; k++) {
+        out[k] = color[k] * texel * alpha;
+    }
+    out[3] = alpha;
+}
+
+#if defined(UI_SSE2)
+static inline __m128 UI_RasterUnpack(uint32_t pixel) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i wide = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)pixel), zero), zero);
+    return _mm_mul_ps(_mm_cvtepi32_ps(wide), _mm_set1_ps(1.0f / 255.0f));
+}
+
+static inline uint32_t UI_RasterPack(__m128 color) {
+    __m128i wide = _mm_cvtps_epi32(_mm_mul_ps(color, _mm_set1_ps(255.0f)));
+    wide = _mm_packs_epi32(wide, wide);
+    return (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(wide, wide));
+}
+
+// NOTE: src is (r * a, g * a, b * a, a)
+static inline uint32_t UI_RasterBlend(uint32_t pixel, __m128 src, __m128 inv_alpha) {
+    return UI_RasterPack(_mm_add_ps(src, _mm_mul_ps(UI_RasterUnpack(pixel), inv_alpha)));
+}
+#endif
+
+static uint32_t UI_RasterPackScalar(float *color) {
+    uint32_t pixel = 0;
+    for (int k = 0; k < 4; k++) {
+        int value = (int)(UI_CLAMP(color[k], 0.0f, 1.0f) * 255.0f + 0.5f);
+        pixel |= (uint32_t)value << (8 * k);
+    }
+    return pixel;
+}
+
+// NOTE: src is premultiplied, see UI_RasterSource
+static void UI_RasterBlendSpan(uint32_t *pixels, int count, float *color) {
+    float alpha = color[3];
+#if defined(UI_SSE2)
+    __m128 src = _mm_loadu_ps(color);
+    if (alpha >= 1.0f) {
+        __m128i packed = _mm_set1_epi32((int)UI_RasterPack(src));
+        int i = 0;
+        for (; i + 4 <= count; i += 4) {
+            _mm_storeu_si128((__m128i *)(pixels + i), packed);
+        }
+        for (; i < count; i++) {
+            pixels[i] = (uint32_t)_mm_cvtsi128_si32(packed);
+        }
+        return;
+    }
+    if (alpha <= 0.0f) {
+        return;
+    }
+    __m128 inv_alpha = _mm_set1_ps(1.0f - alpha);
+    for (int i = 0; i < count; i++) {
+        pixels[i] = UI_RasterBlend(pixels[i], src, inv_alpha);
+    }
+#else
+    if (alpha <= 0.0f) {
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        float out[4];
+        for (int k = 0; k < 4; k++) {
+            float dst = (float)((pixels[i] >> (8 * k)) & 0xFF) * (1.0f / 255.0f);
+            out[k] = color[k] + dst * (1.0f - alpha);
+        }
+        pixels[i] = UI_RasterPackScalar(out);
+    }
+#endif
+}
+
+// NOTE: Color and uv step across the span, the atlas is sampled per pixel
+static void UI_RasterShadeSpan(UI_RasterTarget *target, UI_RasterTriangle *tri, uint32_t *pixels, int x, int count, float y) {
+    float px = (float)x + 0.5f;
+    float values[6];
+    for (int k = 0; k < 6; k++) {
+        values[k] = tri->base[k] + tri->dx[k] * px + tri->dy[k] * y;
+    }
+    for (int i = 0; i < count; i++) {
+        float src[4];
+        UI_RasterSource(target, values, values[4], values[5], src);
+        UI_RasterBlendSpan(pixels + i, 1, src);
+        for (int k = 0; k < 6; k++) {
+            values[k] += tri->dx[k];
+        }
+    }
+}
+
+static void UI_RasterTile(void *data, int index) {
+    UI_RasterTarget *target = (UI_RasterTarget *)data;
+    int tx0 = (index % target->tiles_x) * UI_RASTER_TILE_SIZE;
+    int ty0 = (index / target->tiles_x) * UI_RASTER_TILE_SIZE;
+    int tx1 = UI_MIN(tx0 + UI_RASTER_TILE_SIZE, target->width);
+    int ty1 = UI_MIN(ty0 + UI_RASTER_TILE_SIZE, target->height);
+
+    float clear[4] = {target->clear_color.r, target->clear_color.g, target->clear_color.b, target->clear_color.a};
+    uint32_t clear_pixel = UI_RasterPackScalar(clear);
+    for (int y = ty0; y < ty1; y++) {
+        uint32_t *row = target->pixels + (size_t)y * target->width;
+        for (int x = tx0; x < tx1; x++) {
+            row[x] = clear_pixel;
+        }
+    }
+
+    for (int item = target->tile_start[index]; item < target->tile_start[index + 1]; item++) {
+        UI_RasterTriangle *tri = &target->triangles[target->tile_items[item]];
+        int y0 = UI_MAX(tri->y0, ty0);
+        int y1 = UI_MIN(tri->y1, ty1);
+        float src[4];
+        if (tri->constant) {
+            UI_RasterSource(target, tri->base, tri->base[4], tri->base[5], src);
+        }
+        for (int y = y0; y < y1; y++) {
+            float center = (float)y + 0.5f;
+            int x0 = UI_MAX(tri->x0, tx0);
+            int x1 = UI_MIN(tri->x1, tx1);
+            // NOTE: Left bounds include a pixel whose center is on the edge, right bounds don't
+            for (int e = 0; e < 3; e++) {
+                if (tri->edge_side[e] == 0) {
+                    continue;
+                }
+                float edge = tri->edge_x[e] + (center - tri->edge_y[e]) * tri->edge_dxdy[e];
+                int bound = (int)ceilf(edge - 0.5f);
+                if (tri->edge_side[e] > 0) {
+                    x0 = UI_MAX(x0, bound);
+                } else {
+                    x1 = UI_MIN(x1, bound);
+                }
+            }
+            if (x0 >= x1) {
+                continue;
+            }
+            uint32_t *pixels = target->pixels + (size_t)y * target->width + x0;
+            if (tri->constant) {
+                UI_RasterBlendSpan(pixels, x1 - x0, src);
+            } else {
+                UI_RasterShadeSpan(target, tri, pixels, x0, x1 - x0, center);
+            }
+        }
+    }
+}
+
+// NOTE: Renders a frame's draw list with the current context's atlases, clearing the target
+// first. Vertices are in the draw list's target space, one unit per pixel.
+void UI_RasterizeDrawData(UI_RasterTarget *target, UI_Draw_Data *draw_data, UI_Vec4 clear_color) {
+    UI_Resources *resources = ui_context->resources;
+    UI_TextureAtlas *atlas = &resources->atlas;
+    assert((atlas->width & (atlas->width - 1)) == 0 && (atlas->height & (atlas->height - 1)) == 0);
+    target->clear_color = clear_color;
+    // NOTE: Other contexts of the resources may pack into the atlases meanwhile, but only into
+    // texels this frame doesn't sample
+    target->atlas = atlas->bitmap;
+    target->atlas_width = atlas->width;
+    target->atlas_height = atlas->height;
+    {
+        std::lock_guard<std::mutex> lock(resources->image_mutex);
+        target->image_atlas = resources->image_atlas.bitmap;
+    }
+    target->tiles_x = (target->width + UI_RASTER_TILE_SIZE - 1) / UI_RASTER_TILE_SIZE;
+    target->tiles_y = (target->height + UI_RASTER_TILE_SIZE - 1) / UI_RASTER_TILE_SIZE;
+    int tile_count = target->tiles_x * target->tiles_y;
+    if (tile_count == 0) {
+        return;
+    }
+
+    target->triangles.clear();
+    for (int i = 0; i + 3 <= draw_data->vertex_count; i += 3) {
+        UI_Vertex v[3];
+        for (int k = 0; k < 3; k++) {
+            v[k] = draw_data->vertex_list[i + k];
+            v[k].position.x -= draw_data->target_pos.x;
+            v[k].position.y -= draw_data->target_pos.y;
+        }
+        UI_RasterTriangle tri;
+        if (!UI_RasterSetup(&tri, v)) {
+            continue;
+        }
+        tri.x0 = UI_MAX(tri.x0, 0);
+        tri.y0 = UI_MAX(tri.y0, 0);
+        tri.x1 = UI_MIN(tri.x1, target->width);
+        tri.y1 = UI_MIN(tri.y1, target->height);
+        if (tri.x0 < tri.x1 && tri.y0 < tri.y1) {
+            target->triangles.push_back(tri);
+        }
+    }
+
+    // NOTE: Count the triangles per tile, then fill the tiles in draw order
+    target->tile_start.assign(tile_count + 1, 0);
+    for (int i = 0; i < (int)target->triangles.size(); i++) {
+        UI_RasterTriangle *tri = &target->triangles[i];
+        for (int ty = tri->y0 / UI_RASTER_TILE_SIZE; ty <= (tri->y1 - 1) / UI_RASTER_TILE_SIZE; ty++) {
+            for (int tx = tri->x0 / UI_RASTER_TILE_SIZE; tx <= (tri->x1 - 1) / UI_RASTER_TILE_SIZE; tx++) {
+                target->tile_start[ty * target->tiles_x + tx + 1]++;
+            }
+        }
+    }
+    for (int tile = 0; tile < tile_count; tile++) {
+        target->tile_start[tile + 1] += target->tile_start[tile];
+    }
+    target->tile_items.resize(target->tile_start[tile_count]);
+    target->tile_fill.assign(target->tile_start.begin(), target->tile_start.end() - 1);
+    for (int i = 0; i < (int)target->triangles.size(); i++) {
+        UI_RasterTriangle *tri = &target->triangles[i];
+        for (int ty = tri->y0 / UI_RASTER_TILE_SIZE; ty <= (tri->y1 - 1) / UI_RASTER_TILE_SIZE; ty++) {
+            for (int tx = tri->x0 / UI_RASTER_TILE_SIZE; tx <= (tri->x1 - 1) / UI_RASTER_TILE_SIZE; tx++) {
+                target->tile_items[target->tile_fill[ty * target->tiles_x + tx]++] = i;
+            }
+        }
+    }
+
+    UI_ParallelFor(tile_count, UI_RasterTile, target);
+}
+
+// NOTE: Shared maps
+
+static UI_SharedMapTable *UI_SharedMapTableCreate(int capacity) {
+    UI_SharedMapTable *table = new UI_SharedMapTable();
+    table->slots = new UI_SharedMapSlot[capacity]();
+    table->capacity = capacity;
+    return table;
+}
+
+static void UI_SharedMapInit(UI_SharedMap *map) {
+    map->table.store(UI_SharedMapTableCreate(64), std::memory_order_relaxed);
+    map->count = 0;
+}
+
+static void UI_SharedMapFree(UI_SharedMap *map) {
+    map->retired.push_back(map->table.load(std::memory_order_relaxed));
+    for (int i = 0; i < (int)map->retired.size(); i++) {
+        delete[] map->retired[i]->slots;
+        delete map->retired[i];
+    }
+    map->retired.clear();
+    map->table.store(nullptr, std::memory_order_relaxed);
+}
+
+static uint32_t UI_SharedMapHash(uint64_t key) {
+    key *= 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(key ^ (key >> 32));
+}
+
+static uint64_t UI_SharedMapFind(UI_SharedMap *map, uint64_t key) {
+    UI_SharedMapTable *table = map->table.load(std::memory_order_acquire);
+    int mask = table->capacity - 1;
+    for (int i = UI_SharedMapHash(key) & mask;; i = (i + 1) & mask) {
+        UI_SharedMapSlot *slot = &table->slots[i];
+        uint64_t slot_key = slot->key.load(std::memory_order_acquire);
+        if (slot_key == key) {
+            return slot->value.load(std::memory_order_relaxed);
+        }
+        if (slot_key == 0) {
+            return 0;
+        }
+    }
+}
+
+static void UI_SharedMapPut(UI_SharedMapTable *table, uint64_t key, uint64_t value) {
+    int mask = table->capacity - 1;
+    int i = UI_SharedMapHash(key) & mask;
+    while (table->slots[i].key.load(std::memory_order_relaxed) != 0) {
+        i = (i + 1) & mask;
+    }
+    table->slots[i].value.store(value, std::memory_order_relaxed);
+    table->slots[i].key.store(key, std::memory_order_release);
+}
+
+// NOTE: With the owner's lock held, key must not be in the map yet
+static void UI_SharedMapInsert(UI_SharedMap *map, uint64_t key, uint64_t value) {
+    assert(key != 0 && value != 0);
+    UI_SharedMapTable *table = map->table.load(std::memory_order_relaxed);
+    if (2 * (map->count + 1) > table->capacity) {
+        UI_SharedMapTable *grown = UI_SharedMapTableCreate(2 * table->capacity);
+        for (int i = 0; i < table->capacity; i++) {
+            uint64_t slot_key = table->slots[i].key.load(std::memory_order_relaxed);
+            if (slot_key != 0) {
+                UI_SharedMapPut(grown, slot_key, table->slots[i].value.load(std::memory_order_relaxed));
+            }
+        }
+        map->retired.push_back(table);
+        map->table.store(grown, std::memory_order_release);
+        table = grown;
+    }
+    UI_SharedMapPut(table, key, value);
+    map->count++;
+}
+
+void UI_AtlasInit(UI_TextureAtlas *atlas, int width, int height) {
+    atlas->width = width;
+    atlas->height = height;
+    atlas->bitmap = (unsigned char *)calloc(width * height, 1);
+    // White pixel
+    atlas->bitmap[0] = 255;
+    atlas->shelf_x = 2;
+    atlas->shelf_y = 0;
+    atlas->shelf_height = 1;
+}
+
+bool UI_AtlasPack(UI_TextureAtlas *atlas, int width, int height, int *out_x, int *out_y) {
+    int padding = 1;
+    if (atlas->shelf_x + width > atlas->width) {
+        atlas->shelf_x = 0;
+        atlas->shelf_y += atlas->shelf_height + padding;
+        atlas->shelf_height = 0;
+    }
+    if (width > atlas->width || atlas->shelf_y + height > atlas->height) {
+        return false;
+    }
+
+    *out_x = atlas->shelf_x;
+    *out_y = atlas->shelf_y;
+    atlas->shelf_x += width + padding;
+    atlas->shelf_height = UI_MAX(atlas->shelf_height, height);
+    return true;
+}
+
+bool UI_RasterizeGlyph(FontAtlas *font, uint32_t codepoint, FontGlyph *glyph) {
+    FT_Face face = (FT_Face)font->raster_face;
+    UI_Resources *resources = font->resources;
+    UI_TextureAtlas *atlas = &resources->atlas;
+    if (FT_Load_Char(face, codepoint, FT_LOAD_RENDER)) {
+        printf("Error loading char U+%04X\n", codepoint);
+        return false;
+    }
+
+    int bmp_width = face->glyph->bitmap.width;
+    int bmp_rows = face->glyph->bitmap.rows;
+    int atlas_x = 0, atlas_y = 0;
+    {
+        std::lock_guard<std::mutex> lock(resources->atlas_mutex);
+        if (!UI_AtlasPack(atlas, bmp_width, bmp_rows, &atlas_x, &atlas_y)) {
+            printf("Font atlas full, dropping char U+%04X of %s\n", codepoint, font->path);
+            return false;
+        }
+
+        // Write glyph bitmap to atlas
+        for (int y = 0; y < bmp_rows; y++) {
+            unsigned char *dest = atlas->bitmap + (atlas_y + y) * atlas->width + atlas_x;
+            unsigned char *source = face->glyph->bitmap.buffer + y * face->glyph->bitmap.pitch;
+            memcpy(dest, source, bmp_width);
+        }
+        for (int i = 0; i < (int)resources->contexts.size(); i++) {
+            resources->contexts[i]->atlas_dirty = true;
+        }
+    }
+
+    glyph->ax = (float)(face->glyph->advance.x >> 6);
+    glyph->ay = (float)(face->glyph->advance.y >> 6);
+    glyph->bx = (float)bmp_width;
+    glyph->by = (float)bmp_rows;
+    glyph->bt = (float)face->glyph->bitmap_top;
+    glyph->bl = (float)face->glyph->bitmap_left;
+    glyph->index = FT_Get_Char_Index(face, codepoint);
+    glyph->tx = (float)atlas_x / atlas->width;
+    glyph->ty = (float)atlas_y / atlas->height;
+
+    int bmp_height = bmp_rows + face->glyph->bitmap_top;
+    if (font->max_bmp_height < bmp_height) {
+        font->max_bmp_height = bmp_height;
+    }
+    return true;
+}
+
+// NOTE: Zeroed, only the writer appends
+static FontGlyph *UI_GlyphArrayAppend(UI_GlyphArray *array) {
+    int page = array->count / UI_GLYPH_PAGE_SIZE;
+    if (array->count % UI_GLYPH_PAGE_SIZE == 0) {
+        FontGlyph *glyphs = (FontGlyph *)calloc(UI_GLYPH_PAGE_SIZE, sizeof(FontGlyph));
+        array->pages[page].store(glyphs, std::memory_order_relaxed);
+    }
+    return &(*array)[array->count++];
+}
+
+// NOTE: Hits only read the lookup. A miss takes the font's lock, since another context may be
+// rasterizing the same codepoint, and publishes the glyph before its id.
+int UI_FindGlyph(FontAtlas *font, uint32_t codepoint) {
+    if (codepoint < 128) {
+        return (int)codepoint;
+    }
+
+    uint64_t found = UI_SharedMapFind(&font->glyph_lookup, codepoint);
+    if (found) {
+        return (int)found;
+    }
+
+    std::lock_guard<std::mutex> lock(font->mutex);
+    found = UI_SharedMapFind(&font->glyph_lookup, codepoint);
+    if (found) {
+        return (int)found;
+    }
+    if (font->glyphs.count == UI_GLYPH_PAGE_SIZE * UI_GLYPH_MAX_PAGES) {
+        printf("Too many glyphs, dropping char U+%04X of %s\n", codepoint, font->path);
+        return 0;
+    }
+
+    // NOTE: Glyphs that fail to rasterize stay zeroed so they are only attempted once
+    FontGlyph *glyph = UI_GlyphArrayAppend(&font->glyphs);
+    UI_RasterizeGlyph(font, codepoint, glyph);
+    int id = font->glyphs.count - 1;
+    UI_SharedMapInsert(&font->glyph_lookup, codepoint, (uint64_t)id);
+    return id;
+}
+
+static int UI_FindFont(UI_Resources *resources, char *path, int pixel_height) {
+    int count = resources->font_count.load(std::memory_order_acquire);
+    for (int i = 0; i < count; i++) {
+        FontAtlas *font = resources->fonts[i];
+        if (font->size == pixel_height && strcmp(font->path, path) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static FT_Face UI_OpenFace(FT_Library library, char *path, int pixel_height) {
+    FT_Face face;
+    int err = FT_New_Face(library, path, 0, &face);
+    if (err == FT_Err_Unknown_File_Format) {
+        printf("Format not supported\n");
+        return nullptr;
+    } else if (err) {
+        printf("Font file could not be read\n");
+        return nullptr;
+    }
+
+    err = FT_Set_Pixel_Sizes(face, 0, pixel_height);
+    if (err) {
+        printf("Error setting pixel sizes of font\n");
+    }
+    return face;
+}
+
+int UI_LoadFont(char *path, int pixel_height) {
+    UI_Resources *resources = ui_context->resources;
+    // NOTE: Published fonts never change, so a font that is already loaded is found without the lock
+    int existing = UI_FindFont(resources, path, pixel_height);
+    if (existing >= 0) {
+        return existing;
+    }
+
+    std::lock_guard<std::mutex> lock(resources->mutex);
+    existing = UI_FindFont(resources, path, pixel_height);
+    if (existing >= 0) {
+        return existing;
+    }
+    int count = resources->font_count.load(std::memory_order_relaxed);
+    if (count == UI_MAX_FONTS) {
+        printf("Too many fonts, could not load %s\n", path);
+        return -1;
+    }
+
+    if (!resources->ft_library) {
+        FT_Library library;
+        int err = FT_Init_FreeType(&library);
+        if (err) {
+            printf("Error creaing freetype library: %d\n", err);
+            return -1;
+        }
+        resources->ft_library = library;
+    }
+
+    UI_TextureAtlas *atlas = &resources->atlas;
+    FT_Face face = UI_OpenFace((FT_Library)resources->ft_library, path, pixel_height);
+    if (!face) {
+        return -1;
+    }
+    FT_Face raster_face = UI_OpenFace((FT_Library)resources->ft_library, path, pixel_height);
+    if (!raster_face) {
+        FT_Done_Face(face);
+        return -1;
+    }
+
+    FontAtlas *font = new FontAtlas();
+    font->resources = resources;
+    font->id = count;
+    font->face = face;
+    font->raster_face = raster_face;
+    font->has_kerning = FT_HAS_KERNING(face);
+    font->path = (char *)malloc(strlen(path) + 1);
+    strcpy(font->path, path);
+    font->size = pixel_height;
+    UI_SharedMapInit(&font->glyph_lookup);
+
+    int bbox_ymax = FT_MulFix(face->bbox.yMax, face->size->metrics.y_scale) >> 6;
+    int bbox_ymin = FT_MulFix(face->bbox.yMin, face->size->metrics.y_scale) >> 6;
+    font->width = atlas->width;
+    font->height = atlas->height;
+    font->inv_width = 1.0f / (float)atlas->width;
+    font->inv_height = 1.0f / (float)atlas->height;
+    font->ascend = face->size->metrics.ascender / 64.f;
+    font->descend = face->size->metrics.descender / 64.f;
+    font->bbox_height = bbox_ymax - bbox_ymin;
+    font->glyph_height = (float)face->size->metrics.height / 64.f;
+    font->glyph_width = (float)(face->bbox.xMax - face->bbox.xMin) / 64.f;
+
+    // NOTE: ASCII is packed up front, everything else on first use
+    for (uint32_t c = 0; c < 128; c++) {
+        FontGlyph *glyph = UI_GlyphArrayAppend(&font->glyphs);
+        if (c >= 32) {
+            UI_RasterizeGlyph(font, c, glyph);
+        }
+    }
+
+    resources->fonts[count] = font;
+    resources->font_count.store(count + 1, std::memory_order_release);
+    return count;
+}
+
+FontAtlas *UI_GetFont(int font) {
+    UI_Resources *resources = ui_context->resources;
+    assert(font >= 0 && font < resources->font_count.load(std::memory_order_acquire));
+    return resources->fonts[font];
+}
+
+// NOTE: Shared resources
+
+UI_Resources *UI_CreateResources() {
+    UI_Resources *resources = new UI_Resources();
+    resources->refs = 1;
+    UI_AtlasInit(&resources->atlas, UI_ATLAS_SIZE, UI_ATLAS_SIZE);
+    UI_SharedMapInit(&resources->images);
+    return resources;
+}
+
+void UI_AcquireResources(UI_Resources *resources) {
+    resources->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+// NOTE: By the last reference no context is attached, so no decode is running
+void UI_ReleaseResources(UI_Resources *resources) {
+    if (resources->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+        return;
+    }
+    assert(resources->contexts.empty());
+    if (resources->jobs) {
+        UI_JobSystemDestroy(resources->jobs);
+    }
+    for (int i = 0; i < resources->font_count; i++) {
+        FontAtlas *font = resources->fonts[i];
+        FT_Done_Face((FT_Face)font->face);
+        FT_Done_Face((FT_Face)font->raster_face);
+        for (int page = 0; page < UI_GLYPH_MAX_PAGES; page++) {
+            free(font->glyphs.pages[page].load(std::memory_order_relaxed));
+        }
+        UI_SharedMapFree(&font->glyph_lookup);
+        free(font->path);
+        delete font;
+    }
+    if (resources->ft_library) {
+        FT_Done_FreeType((FT_Library)resources->ft_library);
+    }
+    free(resources->atlas.bitmap);
+
+    UI_SharedMapTable *images = resources->images.table.load(std::memory_order_relaxed);
+    for (int i = 0; i < images->capacity; i++) {
+        UI_Image *image = (UI_Image *)(uintptr_t)images->slots[i].value.load(std::memory_order_relaxed);
+        if (image) {
+            free(image->pixels);
+            free(image->path);
+            delete image;
+        }
+    }
+    UI_SharedMapFree(&resources->images);
+    free(resources->image_atlas.bitmap);
+    free(resources->image_atlas.nodes);
+    delete resources;
+}
+
+void UI_PushFont(int font) {
+    ui_context->font_stack.push(font);
+}
+
+void UI_PopFont() {
+    ui_context->font_stack.pop();
+}
+
+// NOTE: UTF-8
+
+int UI_CountTrailingZeros(uint32_t value) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return (int)index;
+#else
+    return __builtin_ctz(value);
+#endif
+}
+
+// NOTE: Invalid sequences decode to UI_UTF8_REPLACEMENT so text never stalls
+uint32_t UI_Utf8Decode(char *text, int length, int *advance) {
+    unsigned char *s = (unsigned char *)text;
+    uint32_t c = s[0];
+    *advance = 1;
+    if (c < 0x80) {
+        return c;
+    }
+
+    int count = 0;
+    uint32_t min = 0;
+    if ((c & 0xE0) == 0xC0) {
+        count = 2; c &= 0x1F; min = 0x80;
+    } else if ((c & 0xF0) == 0xE0) {
+        count = 3; c &= 0x0F; min = 0x800;
+    } else if ((c & 0xF8) == 0xF0) {
+        count = 4; c &= 0x07; min = 0x10000;
+    } else {
+        return UI_UTF8_REPLACEMENT;
+    }
+    if (count > length) {
+        return UI_UTF8_REPLACEMENT;
+    }
+
+    for (int i = 1; i < count; i++) {
+        if ((s[i] & 0xC0) != 0x80) {
+            return UI_UTF8_REPLACEMENT;
+        }
+        c = (c << 6) | (s[i] & 0x3F);
+    }
+
+    *advance = count;
+    if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) {
+        return UI_UTF8_REPLACEMENT;
+    }
+    return c;
+}
+
+int UI_Utf8Encode(uint32_t codepoint, char *out) {
+    if (codepoint < 0x80) {
+        out[0] = (char)codepoint;
+        return 1;
+    } else if (codepoint < 0x800) {
+        out[0] = (char)(0xC0 | (codepoint >> 6));
+        out[1] = (char)(0x80 | (codepoint & 0x3F));
+        return 2;
+    } else if (codepoint < 0x10000) {
+        out[0] = (char)(0xE0 | (codepoint >> 12));
+        out[1] = (char)(0x80 | ((codepoint >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (codepoint & 0x3F));
+        return 3;
+    } else if (codepoint <= 0x10FFFF) {
+        out[0] = (char)(0xF0 | (codepoint >> 18));
+        out[1] = (char)(0x80 | ((codepoint >> 12) & 0x3F));
+        out[2] = (char)(0x80 | ((codepoint >> 6) & 0x3F));
+        out[3] = (char)(0x80 | (codepoint & 0x3F));
+        return 4;
+    }
+    return UI_Utf8Encode(UI_UTF8_REPLACEMENT, out);
+}
+
+// NOTE: Length of the leading run of ASCII bytes, checked 32 or 16 bytes at a time
+int UI_Utf8AsciiPrefix(char *text, int length) {
+    int i = 0;
+#if defined(UI_AVX2)
+    for (; i + 32 <= length; i += 32) {
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_loadu_si256((__m256i *)(text + i)));
+        if (mask) return i + UI_CountTrailingZeros(mask);
+    }
+#endif
+#if defined(UI_SSE2)
+    for (; i + 16 <= length; i += 16) {
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((__m128i *)(text + i)));
+        if (mask) return i + UI_CountTrailingZeros(mask);
+    }
+#endif
+    while (i < length && !(text[i] & 0x80)) {
+        i++;
+    }
+    return i;
+}
+
+// NOTE: Offset of the codepoint before offset
+int UI_Utf8Prev(char *text, int offset) {
+    if (offset <= 0) return 0;
+    offset--;
+    int limit = UI_MAX(offset - 3, 0);
+    while (offset > limit && (text[offset] & 0xC0) == 0x80) {
+        offset--;
+    }
+    return offset;
+}
+
+// NOTE: Offset of the codepoint after offset
+int UI_Utf8NextOffset(char *text, int length, int offset) {
+    if (offset >= length) return length;
+    int advance;
+    UI_Utf8Decode(text + offset, length - offset, &advance);
+    return offset + advance;
+}
+
+UI_Utf8Iter UI_Utf8Begin(char *text, int length) {
+    UI_Utf8Iter it{};
+    it.text = text;
+    it.length = length;
+    return it;
+}
+
+bool UI_Utf8Next(UI_Utf8Iter *it, uint32_t *codepoint, int *offset) {
+    if (it->offset >= it->length) {
+        return false;
+    }
+
+    *offset = it->offset;
+    if (it->offset >= it->ascii_end) {
+        it->ascii_end = it->offset + UI_Utf8AsciiPrefix(it->text + it->offset, it->length - it->offset);
+    }
+
+    if (it->offset < it->ascii_end) {
+        *codepoint = (unsigned char)it->text[it->offset];
+        it->offset++;
+    } else {
+        int advance;
+        *codepoint = UI_Utf8Decode(it->text + it->offset, it->length - it->offset, &advance);
+        it->offset += advance;
+    }
+    return true;
+}
+
+// NOTE: FNV-1a
+uint64_t UI_HashString(char *text, int length, uint64_t seed) {
+    uint64_t hash = 14695981039346656037ull ^ seed;
+    for (int i = 0; i < length; i++) {
+        hash ^= (unsigned char)text[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+float UI_GetKerning(FontAtlas *font, int left, int right) {
+    unsigned int left_index = font->glyphs[left].index;
+    unsigned int right_index = font->glyphs[right].index;
+    if (!font->has_kerning || !left_index || !right_index) {
+        return 0.0f;
+    }
+    FT_Vector delta;
+    if (FT_Get_Kerning((FT_Face)font->face, left_index, right_index, FT_KERNING_DEFAULT, &delta) != 0) {
+        return 0.0f;
+    }
+    return (float)(delta.x >> 6);
+}
+
+// NOTE: Shapes without touching the cache, the caller owns the run
+UI_TextRun *UI_ShapeRun(char *text, int length, FontAtlas *font) {
+    UI_TextRun *run = (UI_TextRun *)calloc(1, sizeof(UI_TextRun));
+    run->font = font->id;
+    run->length = length;
+    // NOTE: Never more glyphs than bytes
+    run->glyphs = (UI_ShapedGlyph *)malloc(UI_MAX(length, 1) * sizeof(UI_ShapedGlyph));
+    run->last_used_frame = ui_context->frame_index;
+
+    float pen_x = 0.0f;
+    int prev_id = -1;
+    UI_Utf8Iter iter = UI_Utf8Begin(text, length);
+    uint32_t codepoint;
+    int offset;
+    while (UI_Utf8Next(&iter, &codepoint, &offset)) {
+        int id = UI_FindGlyph(font, codepoint);
+        FontGlyph *glyph = &font->glyphs[id];
+
+        if (prev_id >= 0) {
+            pen_x += UI_GetKerning(font, prev_id, id);
+        }
+        prev_id = id;
+
+        UI_ShapedGlyph *shaped = &run->glyphs[run->glyph_count++];
+        shaped->glyph = id;
+        shaped->offset = offset;
+        shaped->x = pen_x;
+        pen_x += glyph->ax;
+    }
+    run->width = pen_x;
+    return run;
+}
+
+void UI_TextRunDestroy(UI_TextRun *run) {
+    free(run->text);
+    free(run->glyphs);
+    free(run);
+}
+
+void UI_TextLayoutDestroy(UI_TextLayout *layout) {
+    UI_TextRunDestroy(layout->run);
+    free(layout->text);
+    delete layout;
+}
+
+UI_TextRun *UI_ShapeText(char *text, int length, FontAtlas *font) {
+    uint64_t hash = UI_HashString(text, length, (uint64_t)font->id);
+    auto it = ui_context->text_runs.find(hash);
+    UI_TextRun *first = it != ui_context->text_runs.end() ? it->second : nullptr;
+    for (UI_TextRun *run = first; run; run = run->next) {
+        if (run->font == font->id && run->length == length && memcmp(run->text, text, length) == 0) {
+            run->last_used_frame = ui_context->frame_index;
+            return run;
+        }
+    }
+
+    UI_TextRun *run = UI_ShapeRun(text, length, font);
+    run->hash = hash;
+    run->text = (char *)malloc(length + 1);
+    memcpy(run->text, text, length);
+    run->text[length] = 0;
+    // NOTE: A different string with the same hash may be in use by widgets of this frame, so it
+    // stays in the chain until UI_EvictTextCache finds it unused
+    run->next = first;
+    ui_context->text_runs[hash] = run;
+    return run;
+}
+
+// NOTE: Index of the glyph starting at byte offset, or the glyph containing it
+int UI_TextRunGlyphAt(UI_TextRun *run, int offset) {
+    if (offset >= run->length) {
+        return run->glyph_count;
+    }
+    if (run->glyph_count == run->length) {
+        // NOTE: Pure ASCII, one glyph per byte
+        return offset;
+    }
+    int lo = 0, hi = run->glyph_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (run->glyphs[mid].offset <= offset) lo = mid + 1;
+        else hi = mid;
+    }
+    return UI_MAX(lo - 1, 0);
+}
+
+// NOTE: Caret position at a byte offset in the run
+float UI_TextRunCaretX(UI_TextRun *run, int offset) {
+    int index = UI_TextRunGlyphAt(run, offset);
+    return index < run->glyph_count ? run->glyphs[index].x : run->width;
+}
+
+// NOTE: Byte offset of the caret closest to x among the glyphs [first, last) of a run, x is
+// relative to the run. Glyph x is the cumulative advance, so the glyph whose midpoint is past x
+// is found by bisection.
+int UI_TextRunHitTest(UI_TextRun *run, int first, int last, float x) {
+    int lo = first, hi = last;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        float next = mid + 1 < run->glyph_count ? run->glyphs[mid + 1].x : run->width;
+        if (x < (run->glyphs[mid].x + next) * 0.5f) hi = mid;
+        else lo = mid + 1;
+    }
+    if (lo < last) {
+        return run->glyphs[lo].offset;
+    }
+    return last < run->glyph_count ? run->glyphs[last].offset : run->length;
+}
+
+// NOTE: Wrapped layouts are cached per (text, font) and keep the width they were
+// broken at, so lines are only recomputed when the wrap width changes.
+UI_TextLayout *UI_GetTextLayout(char *text, int length, FontAtlas *font) {
+    uint64_t hash = UI_HashString(text, length, (uint64_t)font->id);
+    auto it = ui_context->text_layouts.find(hash);
+    UI_TextLayout *first = it != ui_context->text_layouts.end() ? it->second : nullptr;
+    for (UI_TextLayout *layout = first; layout; layout = layout->next) {
+        if (layout->font == font->id && layout->length == length && memcmp(layout->text, text, length) == 0) {
+            layout->last_used_frame = ui_context->frame_index;
+            return layout;
+        }
+    }
+
+    UI_TextLayout *layout = new UI_TextLayout();
+    layout->hash = hash;
+    layout->font = font->id;
+    layout->length = length;
+    layout->text = (char *)malloc(length + 1);
+    memcpy(layout->text, text, length);
+    layout->text[length] = 0;
+    layout->run = UI_ShapeRun(layout->text, length, font);
+    layout->wrap_width = -1.0f;
+    layout->last_used_frame = ui_context->frame_index;
+    // NOTE: Widgets of this frame may still draw a colliding layout, it is chained like runs are
+    layout->next = first;
+    ui_context->text_layouts[hash] = layout;
+    return layout;
+}
+
+static void UI_TextLayoutPushLine(UI_TextLayout *layout, FontAtlas *font, int first, int last) {
+    UI_TextRun *run = layout->run;
+    UI_TextLine line{};
+    line.first_glyph = first;
+    line.last_glyph = last;
+    line.start = first < run->glyph_count ? run->glyphs[first].offset : layout->length;
+    line.end = last < run->glyph_count ? run->glyphs[last].offset : layout->length;
+    if (last > first) {
+        UI_ShapedGlyph end = run->glyphs[last - 1];
+        line.width = end.x + font->glyphs[end.glyph].ax - run->glyphs[first].x;
+    }
+    layout->lines.push_back(line);
+}
+
+// NOTE: Greedy line breaking in one pass over the shaped run. Lines break at the last
+// space that fits, mid-word when a word is wider than the line, and always at '\n'.
+// A wrap width of 0 only breaks at newlines.
+void UI_TextLayoutWrap(UI_TextLayout *layout, float wrap_width) {
+    if (layout->wrap_width == wrap_width) {
+        return;
+    }
+    layout->wrap_width = wrap_width;
+    layout->lines.clear();
+
+    FontAtlas *font = UI_GetFont(layout->font);
+    UI_TextRun *run = layout->run;
+    char *text = layout->text;
+    int line_first = 0;
+    int break_next = -1;
+    int break_end = -1;
+    for (int i = 0; i < run->glyph_count; i++) {
+        UI_ShapedGlyph shaped = run->glyphs[i];
+        char c = text[shaped.offset];
+        if (c == '\n') {
+            UI_TextLayoutPushLine(layout, font, line_first, i);
+            line_first = i + 1;
+            break_next = -1;
+            continue;
+        }
+        if (c == ' ') {
+            // NOTE: Trailing spaces hang past the edge and are not part of the line
+            if (break_next != i) break_end = i;
+            break_next = i + 1;
+            continue;
+        }
+
+        float right = shaped.x + font->glyphs[shaped.glyph].ax - run->glyphs[line_first].x;
+        if (wrap_width > 0.0f && right > wrap_width && i > line_first) {
+            if (break_next > line_first) {
+                UI_TextLayoutPushLine(layout, font, line_first, break_end);
+                line_first = break_next;
+            } else {
+                UI_TextLayoutPushLine(layout, font, line_first, i);
+                line_first = i;
+            }
+            break_next = -1;
+        }
+    }
+    UI_TextLayoutPushLine(layout, font, line_first, run->glyph_count);
+}
+
+float UI_TextLayoutHeight(UI_TextLayout *layout) {
+    FontAtlas *font = UI_GetFont(layout->font);
+    return roundf((float)layout->lines.size() * font->glyph_height);
+}
+
+// NOTE: Gap buffer text editing
+
+UI_TextEdit *UI_TextEditCreate(char *text, int length, int font) {
+    UI_TextEdit *edit = new UI_TextEdit();
+    edit->capacity = UI_MAX(length * 2, 64);
+    edit->buffer = (char *)malloc(edit->capacity);
+    edit->caret_x = (float *)calloc(edit->capacity + 1, sizeof(float));
+    memcpy(edit->buffer, text, length);
+    // NOTE: Gap starts at the end of the text
+    edit->gap_start = length;
+    edit->gap_end = edit->capacity;
+    edit->cursor = length;
+    edit->anchor = length;
+    edit->font = font;
+    return edit;
+}
+
+void UI_TextEditDestroy(UI_TextEdit *edit) {
+    free(edit->buffer);
+    free(edit->caret_x);
+    delete edit;
+}
+
+int UI_TextEditLength(UI_TextEdit *edit) {
+    return edit->capacity - (edit->gap_end - edit->gap_start);
+}
+
+// NOTE: Physical index of a logical offset, the end of the text maps to capacity
+inline int UI_TextEditPhys(UI_TextEdit *edit, int offset) {
+    return offset < edit->gap_start ? offset : offset + (edit->gap_end - edit->gap_start);
+}
+
+inline char UI_TextEditByte(UI_TextEdit *edit, int offset) {
+    return edit->buffer[UI_TextEditPhys(edit, offset)];
+}
+
+uint32_t UI_TextEditDecode(UI_TextEdit *edit, int offset, int *advance) {
+    char bytes[4];
+    int count = UI_MIN(UI_TextEditLength(edit) - offset, 4);
+    for (int i = 0; i < count; i++) {
+        bytes[i] = UI_TextEditByte(edit, offset + i);
+    }
+    return UI_Utf8Decode(bytes, count, advance);
+}
+
+int UI_TextEditPrev(UI_TextEdit *edit, int offset) {
+    if (offset <= 0) return 0;
+    offset--;
+    int limit = UI_MAX(offset - 3, 0);
+    while (offset > limit && (UI_TextEditByte(edit, offset) & 0xC0) == 0x80) {
+        offset--;
+    }
+    return offset;
+}
+
+int UI_TextEditNext(UI_TextEdit *edit, int offset) {
+    int length = UI_TextEditLength(edit);
+    if (offset >= length) return length;
+    int advance;
+    UI_TextEditDecode(edit, offset, &advance);
+    return offset + advance;
+}
+
+// NOTE: Moving the gap only shifts the bytes between the old and new position,
+// the cached caret positions move along with their bytes
+void UI_TextEditMoveGap(UI_TextEdit *edit, int offset) {
+    if (offset < edit->gap_start) {
+        int count = edit->gap_start - offset;
+        memmove(edit->buffer + edit->gap_end - count, edit->buffer + offset, count);
+        memmove(edit->caret_x + edit->gap_end - count, edit->caret_x + offset, count * sizeof(float));
+        edit->gap_start -= count;
+        edit->gap_end -= count;
+    } else if (offset > edit->gap_start) {
+        int count = offset - edit->gap_start;
+        memmove(edit->buffer + edit->gap_start, edit->buffer + edit->gap_end, count);
+        memmove(edit->caret_x + edit->gap_start, edit->caret_x + edit->gap_end, count * sizeof(float));
+        edit->gap_start += count;
+        edit->gap_end += count;
+    }
+}
+
+void UI_TextEditReserve(UI_TextEdit *edit, int count) {
+    if (edit->gap_end - edit->gap_start >= count) {
+        return;
+    }
+    int length = UI_TextEditLength(edit);
+    int capacity = UI_MAX(edit->capacity * 2, length + count + 64);
+    int tail = edit->capacity - edit->gap_end;
+    edit->buffer = (char *)realloc(edit->buffer, capacity);
+    edit->caret_x = (float *)realloc(edit->caret_x, (capacity + 1) * sizeof(float));
+    // NOTE: Tail and the end caret slot move to the end of the new buffer
+    memmove(edit->buffer + capacity - tail, edit->buffer + edit->gap_end, tail);
+    memmove(edit->caret_x + capacity - tail, edit->caret_x + edit->gap_end, (tail + 1) * sizeof(float));
+    edit->gap_end = capacity - tail;
+    edit->capacity = capacity;
+}
+
+// NOTE: An edit at offset changes the kerning of the codepoint before it
+void UI_TextEditInvalidate(UI_TextEdit *edit, int offset) {
+    edit->valid_to = UI_MIN(edit->valid_to, UI_TextEditPrev(edit, offset));
+    if (edit->valid_to == 0) {
+        // NOTE: Edits at the start put a different slot at offset 0
+        edit->caret_x[UI_TextEditPhys(edit, 0)] = 0.0f;
+    }
+}
+
+void UI_TextEditInsert(UI_TextEdit *edit, char *text, int count) {
+    if (edit->max_length && UI_TextEditLength(edit) + count > edit->max_length) {
+        return;
+    }
+    UI_TextEditMoveGap(edit, edit->cursor);
+    UI_TextEditReserve(edit, count);
+    memcpy(edit->buffer + edit->gap_start, text, count);
+    edit->gap_start += count;
+    UI_TextEditInvalidate(edit, edit->cursor);
+    edit->cursor += count;
+    edit->dirty = true;
+}
+
+void UI_TextEditDelete(UI_TextEdit *edit, int start, int end) {
+    if (end <= start) return;
+    UI_TextEditMoveGap(edit, start);
+    edit->gap_end += end - start;
+    UI_TextEditInvalidate(edit, start);
+    edit->cursor = start;
+    edit->dirty = true;
+}
+
+// NOTE: Caret position at a logical offset. Positions are computed lazily from the
+// last valid one, so typing at the cursor only measures the codepoints it touched.
+float UI_TextEditCaretX(UI_TextEdit *edit, int offset) {
+    int length = UI_TextEditLength(edit);
+    offset = UI_MIN(offset, length);
+    if (offset > edit->valid_to) {
+        FontAtlas *font = UI_GetFont(edit->font);
+        int at = edit->valid_to;
+        while (at < offset) {
+            int advance;
+            int id = UI_FindGlyph(font, UI_TextEditDecode(edit, at, &advance));
+            float pen = edit->caret_x[UI_TextEditPhys(edit, at)] + font->glyphs[id].ax;
+            for (int i = 1; i < advance; i++) {
+                edit->caret_x[UI_TextEditPhys(edit, at + i)] = edit->caret_x[UI_TextEditPhys(edit, at)];
+            }
+            int next = at + advance;
+            if (next < length) {
+                int next_advance;
+                int next_id = UI_FindGlyph(font, UI_TextEditDecode(edit, next, &next_advance));
+                pen += UI_GetKerning(font, id, next_id);
+            }
+            edit->caret_x[UI_TextEditPhys(edit, next)] = pen;
+            at = next;
+        }
+        edit->valid_to = at;
+    }
+    return edit->caret_x[UI_TextEditPhys(edit, offset)];
+}
+
+// NOTE: Offset of the codepoint whose caret is the last one at or before x, within the valid range
+int UI_TextEditOffsetAtX(UI_TextEdit *edit, float x) {
+    int lo = 0, hi = edit->valid_to;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (edit->caret_x[UI_TextEditPhys(edit, mid)] <= x) lo = mid;
+        else hi = mid - 1;
+    }
+    while (lo > 0 && (UI_TextEditByte(edit, lo) & 0xC0) == 0x80) {
+        lo--;
+    }
+    return lo;
+}
+
+// NOTE: Offset of the caret closest to x
+int UI_TextEditHitTest(UI_TextEdit *edit, float x) {
+    int length = UI_TextEditLength(edit);
+    if (x >= UI_TextEditCaretX(edit, length)) {
+        return length;
+    }
+    int at = UI_TextEditOffsetAtX(edit, x);
+    int next = UI_TextEditNext(edit, at);
+    if (next > at && UI_TextEditCaretX(edit, next) - x < x - UI_TextEditCaretX(edit, at)) {
+        return next;
+    }
+    return at;
+}
+
+// NOTE: Removes the selected text, returns false when nothing is selected
+bool UI_TextEditDeleteSelection(UI_TextEdit *edit) {
+    if (edit->anchor == edit->cursor) {
+        return false;
+    }
+    UI_TextEditDelete(edit, UI_MIN(edit->anchor, edit->cursor), UI_MAX(edit->anchor, edit->cursor));
+    edit->anchor = edit->cursor;
+    return true;
+}
+
+int UI_TextEditCopy(UI_TextEdit *edit, char *out, int out_size) {
+    int length = UI_MIN(UI_TextEditLength(edit), out_size - 1);
+    // NOTE: Don't cut a codepoint in half
+    while (length > 0 && length < UI_TextEditLength(edit) && (UI_TextEditByte(edit, length) & 0xC0) == 0x80) {
+        length--;
+    }
+    int head = UI_MIN(length, edit->gap_start);
+    memcpy(out, edit->buffer, head);
+    memcpy(out + head, edit->buffer + edit->gap_end, length - head);
+    out[length] = 0;
+    return length;
+}
+
+UI_TextEdit *UI_GetTextEdit(char *label, char *input, int input_length, int font) {
+    uint64_t hash = UI_HashString(label, (int)strlen(label), 0);
+    UI_TextEdit *edit = nullptr;
+    auto it = ui_context->text_edits.find(hash);
+    if (it != ui_context->text_edits.end()) {
+        edit = it->second;
+    } else {
+        int length = (int)strnlen(input, input_length);
+        edit = UI_TextEditCreate(input, length, font);
+        ui_context->text_edits[hash] = edit;
+    }
+    if (edit->font != font) {
+        edit->font = font;
+        edit->valid_to = 0;
+    }
+    edit->max_length = input_length - 1;
+    edit->last_used_frame = ui_context->frame_index;
+    return edit;
+}
+
+// NOTE: Memory-mapped text files
+
+// NOTE: Indexes one chunk and queues the next, so a large file never holds a worker for
+// long and cancelling takes effect within a chunk
+static void UI_TextFileIndexChunk(void *data, int index) {
+    UI_TextFile *file = (UI_TextFile *)data;
+    uint64_t lines = file->index_lines;
+    uint64_t checkpoint = file->index_checkpoint;
+    uint64_t at = file->indexed_bytes.load(std::memory_order_relaxed);
+    if (at < file->size && !file->cancel.load(std::memory_order_relaxed)) {
+        std::vector<UI_TextFileCheckpoint> found;
+        uint64_t chunk_end = UI_MIN(at + UI_TEXT_FILE_CHUNK_SIZE, file->size);
+        while (at < chunk_end) {
+            char *newline = (char *)memchr(file->data + at, '\n', (size_t)(chunk_end - at));
+            if (!newline) {
+                at = chunk_end;
+                break;
+            }
+            at = (uint64_t)(newline - file->data) + 1;
+            // NOTE: A trailing newline doesn't start another line
+            if (at < file->size) {
+                if (lines % UI_TEXT_FILE_LINE_STRIDE == 0 || at - checkpoint >= UI_TEXT_FILE_CHECKPOINT_BYTES) {
+                    found.push_back(UI_TextFileCheckpoint{lines, at});
+                    checkpoint = at;
+                }
+                lines++;
+            }
+        }
+
+        if (!found.empty()) {
+            std::lock_guard<std::mutex> lock(file->index_mutex);
+            file->checkpoints.insert(file->checkpoints.end(), found.begin(), found.end());
+        }
+        file->index_lines = lines;
+        file->index_checkpoint = checkpoint;
+        // NOTE: Only lines that are known to have started are published
+        file->line_count.store(at < file->size ? lines - 1 : lines, std::memory_order_release);
+        file->indexed_bytes.store(at, std::memory_order_release);
+    }
+
+    if (at < file->size && !file->cancel.load(std::memory_order_relaxed)) {
+        UI_JobSpawn(&file->index_jobs, UI_TextFileIndexChunk, file, 0);
+        return;
+    }
+    file->indexed.store(true, std::memory_order_release);
+    UI_PostWakeup(file->context);
+}
+
+UI_TextFile *UI_OpenTextFile(char *path) {
+    HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (handle == INVALID_HANDLE_VALUE) {
+        printf("Could not open %s\n", path);
+        return nullptr;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(handle, &size)) {
+        CloseHandle(handle);
+        return nullptr;
+    }
+
+    UI_TextFile *file = new UI_TextFile();
+    file->context = ui_context;
+    file->file_handle = handle;
+    file->size = (uint64_t)size.QuadPart;
+    if (file->size > 0) {
+        file->mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (file->mapping) {
+            file->data = (char *)MapViewOfFile(file->mapping, FILE_MAP_READ, 0, 0, 0);
+        }
+        if (!file->data) {
+            printf("Could not map %s\n", path);
+            UI_CloseTextFile(file);
+            return nullptr;
+        }
+    }
+
+    // NOTE: Line 0 always starts at offset 0
+    file->checkpoints.push_back(UI_TextFileCheckpoint{0, 0});
+    file->index_lines = file->size ? 1 : 0;
+    UI_JobSpawn(&file->index_jobs, UI_TextFileIndexChunk, file, 0);
+    return file;
+}
+
+void UI_CloseTextFile(UI_TextFile *file) {
+    file->cancel = true;
+    UI_JobWait(&file->index_jobs);
+    if (file->data) UnmapViewOfFile(file->data);
+    if (file->mapping) CloseHandle(file->mapping);
+    if (file->file_handle) CloseHandle(file->file_handle);
+    delete file;
+}
+
+float UI_TextFileProgress(UI_TextFile *file) {
+    if (file->size == 0) return 1.0f;
+    return (float)((double)file->indexed_bytes.load(std::memory_order_acquire) / (double)file->size);
+}
+
+void UI_TextFileScrollTo(UI_TextFile *file, uint64_t line) {
+    file->scroll = (double)line;
+}
+
+// NOTE: Start offset of a line that has been indexed
+uint64_t UI_TextFileLineStart(UI_TextFile *file, uint64_t line) {
+    UI_TextFileCheckpoint checkpoint;
+    {
+        // NOTE: Last checkpoint at or before the line
+        std::lock_guard<std::mutex> lock(file->index_mutex);
+        std::vector<UI_TextFileCheckpoint> &checkpoints = file->checkpoints;
+        size_t lo = 0, hi = checkpoints.size();
+        while (hi - lo > 1) {
+            size_t mid = (lo + hi) / 2;
+            if (checkpoints[mid].line <= line) lo = mid;
+            else hi = mid;
+        }
+        checkpoint = checkpoints[lo];
+    }
+    uint64_t offset = checkpoint.offset;
+    for (uint64_t skip = line - checkpoint.line; skip > 0; skip--) {
+        char *newline = (char *)memchr(file->data + offset, '\n', (size_t)(file->size - offset));
+        offset = (uint64_t)(newline - file->data) + 1;
+    }
+    return offset;
+}
+
+// NOTE: Length of the line starting at offset without its line ending
+int UI_TextFileLineLength(UI_TextFile *file, uint64_t offset, uint64_t *next) {
+    char *start = file->data + offset;
+    char *newline = (char *)memchr(start, '\n', (size_t)(file->size - offset));
+    uint64_t end = newline ? (uint64_t)(newline - file->data) : file->size;
+    *next = newline ? end + 1 : file->size;
+    if (end > offset && file->data[end - 1] == '\r') end--;
+    uint64_t length = UI_MIN(end - offset, (uint64_t)UI_TEXT_VIEW_MAX_LINE_BYTES);
+    // NOTE: Don't cut a codepoint in half when clipping long lines
+    while (length > 0 && offset + length < end && (start[length] & 0xC0) == 0x80) {
+        length--;
+    }
+    return (int)length;
+}
+
+// NOTE: Logs
+
+UI_Log *UI_LogCreate(int line_capacity, int queue_capacity) {
+    UI_Log *log = (UI_Log *)calloc(1, sizeof(UI_Log));
+    log->ring = UI_RingCreate(sizeof(UI_LogLine), queue_capacity);
+    log->lines = (UI_LogLine *)malloc(line_capacity * sizeof(UI_LogLine));
+    log->line_capacity = line_capacity;
+    log->follow = true;
+    ui_context->logs.push_back(log);
+    return log;
+}
+
+// NOTE: Producers must have stopped pushing
+void UI_LogDestroy(UI_Log *log) {
+    std::vector<UI_Log*> &logs = ui_context->logs;
+    for (int i = 0; i < (int)logs.size(); i++) {
+        if (logs[i] == log) {
+            logs.erase(logs.begin() + i);
+            break;
+        }
+    }
+    UI_RingDestroy(log->ring);
+    free(log->lines);
+    free(log);
+}
+
+// NOTE: Safe from any thread, lines longer than UI_LOG_LINE_LENGTH are cut
+bool UI_LogPush(UI_Log *log, char *text, int length) {
+    UI_LogLine line;
+    line.length = UI_MIN(length, UI_LOG_LINE_LENGTH);
+    memcpy(line.text, text, line.length);
+    return UI_RingPush(log->ring, &line);
+}
+
+// NOTE: Pops straight into the scrollback, a batch per contiguous run of free lines
+static void UI_LogDrain(UI_Log *log) {
+    for (;;) {
+        int slot = (int)(log->line_count % log->line_capacity);
+        int count = UI_RingPop(log->ring, &log->lines[slot], log->line_capacity - slot);
+        if (count == 0) {
+            break;
+        }
+        log->line_count += count;
+    }
+}
+
+static uint64_t UI_LogFirstLine(UI_Log *log) {
+    return log->line_count > (uint64_t)log->line_capacity ? log->line_count - log->line_capacity : 0;
+}
+
+// NOTE: Images
+
+static void UI_DirtyRectAdd(UI_DirtyRect *rect, int x0, int y0, int x1, int y1) {
+    if (rect->x0 >= rect->x1) {
+        *rect = UI_DirtyRect{x0, y0, x1, y1};
+        return;
+    }
+    rect->x0 = UI_MIN(rect->x0, x0);
+    rect->y0 = UI_MIN(rect->y0, y0);
+    rect->x1 = UI_MAX(rect->x1, x1);
+    rect->y1 = UI_MAX(rect->y1, y1);
+}
+
+// NOTE: Takes a free block of size below node, whose own block is node_size at (x, y), splitting
+// free blocks on the way down. Returns the block's node and moves (x, y) to it, -1 if there is
+// no room.
+static int UI_ImageBlockAlloc(UI_ImageAtlas *atlas, int node, int node_size, int size, int *x, int *y) {
+    unsigned char state = atlas->nodes[node];
+    if (state == UI_ImageBlock_Used) {
+        return -1;
+    }
+    if (node_size == size) {
+        if (state != UI_ImageBlock_Free) {
+            return -1;
+        }
+        atlas->nodes[node] = UI_ImageBlock_Used;
+        return node;
+    }
+    if (state == UI_ImageBlock_Free) {
+        atlas->nodes[node] = UI_ImageBlock_Split;
+        for (int i = 0; i < 4; i++) {
+            atlas->nodes[4 * node + 1 + i] = UI_ImageBlock_Free;
+        }
+    }
+    int half = node_size / 2;
+    for (int i = 0; i < 4; i++) {
+        int child_x = *x + (i & 1) * half;
+        int child_y = *y + (i >> 1) * half;
+        int block = UI_ImageBlockAlloc(atlas, 4 * node + 1 + i, half, size, &child_x, &child_y);
+        if (block >= 0) {
+            *x = child_x;
+            *y = child_y;
+            return block;
+        }
+    }
+    return -1;
+}
+
+static void UI_ImageBlockFree(UI_ImageAtlas *atlas, int node) {
+    atlas->nodes[node] = UI_ImageBlock_Free;
+    while (node > 0) {
+        int parent = (node - 1) / 4;
+        for (int i = 0; i < 4; i++) {
+            if (atlas->nodes[4 * parent + 1 + i] != UI_ImageBlock_Free) {
+                return;
+            }
+        }
+        atlas->nodes[parent] = UI_ImageBlock_Free;
+        node = parent;
+    }
+}
+
+// NOTE: Wakes the context that loaded the image, or every context of a shared image's
+// resources, which takes image_mutex to be held
+static void UI_ImageWakeup(UI_Image *image) {
+    if (!image->shared) {
+        UI_PostWakeup(image->context);
+        return;
+    }
+    std::vector<UI_Context*> &contexts = image->shared->contexts;
+    for (int i = 0; i < (int)contexts.size(); i++) {
+        UI_PostWakeup(contexts[i]);
+    }
+}
+
+static void UI_ImageAtlasAllocate(UI_ImageAtlas *atlas) {
+    if (atlas->bitmap) {
+        return;
+    }
+    atlas->bitmap = (uint32_t *)calloc((size_t)UI_IMAGE_ATLAS_SIZE * UI_IMAGE_ATLAS_SIZE, sizeof(uint32_t));
+    int node_count = 0;
+    for (int size = UI_IMAGE_ATLAS_SIZE; size >= UI_IMAGE_BLOCK_MIN; size /= 2) {
+        node_count = node_count * 4 + 1;
+    }
+    atlas->nodes = (unsigned char *)calloc(node_count, 1);
+}
+
+static int UI_ImageBlockSize(UI_Image *image) {
+    int size = UI_IMAGE_BLOCK_MIN;
+    while (size < UI_MAX(image->width, image->height) + 2) {
+        size *= 2;
+    }
+    return size;
+}
+
+// NOTE: Copies a decoded image into its block at (x, y) with its edge texels repeated around
+// it, with image_mutex held. Every context of the resources uploads the texels again.
+static void UI_ImageAtlasWrite(UI_Resources *resources, UI_Image *image, int block, int size, int x, int y) {
+    UI_ImageAtlas *atlas = &resources->image_atlas;
+    int width = image->width;
+    int height = image->height;
+    for (int row = -1; row <= height; row++) {
+        uint32_t *src = image->pixels + (size_t)UI_CLAMP(row, 0, height - 1) * width;
+        uint32_t *dst = atlas->bitmap + (size_t)(y + 1 + row) * UI_IMAGE_ATLAS_SIZE + x + 1;
+        dst[-1] = src[0];
+        memcpy(dst, src, width * sizeof(uint32_t));
+        dst[width] = src[width - 1];
+    }
+    for (int i = 0; i < (int)resources->contexts.size(); i++) {
+        UI_DirtyRectAdd(&resources->contexts[i]->image_dirty, x, y, x + width + 2, y + height + 2);
+    }
+
+    float scale = 1.0f / UI_IMAGE_ATLAS_SIZE;
+    image->block = block;
+    image->block_size = size;
+    image->uv0 = UI_Vec2((x + 1) * scale + UI_IMAGE_UV_OFFSET, (y + 1) * scale);
+    image->uv1 = UI_Vec2((x + 1 + width) * scale + UI_IMAGE_UV_OFFSET, (y + 1 + height) * scale);
+}
+
+// NOTE: Shared images are placed by the decode job itself, they are never evicted
+static void UI_SharedImagePlace(UI_Image *image) {
+    UI_Resources *resources = image->shared;
+    UI_ImageAtlas *atlas = &resources->image_atlas;
+    std::lock_guard<std::mutex> lock(resources->image_mutex);
+    UI_ImageAtlasAllocate(atlas);
+    int size = UI_ImageBlockSize(image);
+    int x = 0;
+    int y = 0;
+    int block = UI_ImageBlockAlloc(atlas, 0, UI_IMAGE_ATLAS_SIZE, size, &x, &y);
+    if (block >= 0) {
+        UI_ImageAtlasWrite(resources, image, block, size, x, y);
+    } else {
+        printf("Image atlas is full, could not fit %s\n", image->path);
+    }
+    free(image->pixels);
+    image->pixels = nullptr;
+    image->state.store(block >= 0 ? UI_ImageState_Ready : UI_ImageState_Failed, std::memory_order_release);
+    UI_ImageWakeup(image);
+}
+
+// NOTE: Runs as a job. Colors are premultiplied before scaling down, so transparent texels
+// don't bleed their color into the average.
+static void UI_ImageDecode(void *data, int index) {
+    UI_Image *image = (UI_Image *)data;
+    int width, height, channels;
+    unsigned char *pixels = nullptr;
+    if (image->data) {
+        pixels = stbi_load_from_memory(image->data, image->data_size, &width, &height, &channels, 4);
+    } else {
+        pixels = stbi_load(image->path, &width, &height, &channels, 4);
+    }
+    if (!pixels) {
+        printf("Could not load %s: %s\n", image->path ? image->path : "image from memory", stbi_failure_reason());
+        std::unique_lock<std::mutex> lock;
+        if (image->shared) {
+            lock = std::unique_lock<std::mutex>(image->shared->image_mutex);
+        }
+        image->state.store(UI_ImageState_Failed, std::memory_order_release);
+        UI_ImageWakeup(image);
+        return;
+    }
+
+    for (int i = 0; i < width * height; i++) {
+        unsigned char *texel = pixels + 4 * i;
+        for (int k = 0; k < 3; k++) {
+            texel[k] = (unsigned char)((texel[k] * texel[3] + 127) / 255);
+        }
+    }
+
+    int out_width = width;
+    int out_height = height;
+    if (width >= height && width > UI_IMAGE_MAX_SIZE) {
+        out_width = UI_IMAGE_MAX_SIZE;
+        out_height = UI_MAX(1, (int)((int64_t)height * UI_IMAGE_MAX_SIZE / width));
+    } else if (height > width && height > UI_IMAGE_MAX_SIZE) {
+        out_height = UI_IMAGE_MAX_SIZE;
+        out_width = UI_MAX(1, (int)((int64_t)width * UI_IMAGE_MAX_SIZE / height));
+    }
+
+    // NOTE: Box filter, every texel is the average of the source texels it covers
+    uint32_t *out = (uint32_t *)malloc((size_t)out_width * out_height * sizeof(uint32_t));
+    for (int y = 0; y < out_height; y++) {
+        int y0 = (int)((int64_t)y * height / out_height);
+        int y1 = UI_MAX(y0 + 1, (int)((int64_t)(y + 1) * height / out_height));
+        for (int x = 0; x < out_width; x++) {
+            int x0 = (int)((int64_t)x * width / out_width);
+            int x1 = UI_MAX(x0 + 1, (int)((int64_t)(x + 1) * width / out_width));
+            uint32_t sum[4] = {};
+            for (int sy = y0; sy < y1; sy++) {
+                unsigned char *row = pixels + ((size_t)sy * width + x0) * 4;
+                for (int sx = 0; sx < x1 - x0; sx++) {
+                    for (int k = 0; k < 4; k++) {
+                        sum[k] += row[4 * sx + k];
+                    }
+                }
+            }
+            uint32_t count = (uint32_t)((y1 - y0) * (x1 - x0));
+            uint32_t texel = 0;
+            for (int k = 0; k < 4; k++) {
+                texel |= ((sum[k] + count / 2) / count) << (8 * k);
+            }
+            out[(size_t)y * out_width + x] = texel;
+        }
+    }
+    stbi_image_free(pixels);
+
+    image->pixels = out;
+    image->width = out_width;
+    image->height = out_height;
+    if (image->shared) {
+        UI_SharedImagePlace(image);
+        return;
+    }
+    image->state.store(UI_ImageState_Decoded, std::memory_order_release);
+    UI_ImageWakeup(image);
+}
+
+static void UI_ImageLruRemove(UI_ImageCache *cache, UI_Image *image) {
+    if (image->lru_prev) image->lru_prev->lru_next = image->lru_next;
+    else cache->lru_first = image->lru_next;
+    if (image->lru_next) image->lru_next->lru_prev = image->lru_prev;
+    else cache->lru_last = image->lru_prev;
+    image->lru_prev = image->lru_next = nullptr;
+}
+
+static void UI_ImageLruPushFront(UI_ImageCache *cache, UI_Image *image) {
+    image->lru_prev = nullptr;
+    image->lru_next = cache->lru_first;
+    if (cache->lru_first) cache->lru_first->lru_prev = image;
+    else cache->lru_last = image;
+    cache->lru_first = image;
+}
+
+// NOTE: Frees the block of the least recently used cached image unless it was shown in the
+// last frame, which may still be on screen
+static bool UI_ImageEvictOne() {
+    UI_ImageCache *cache = &ui_context->image_cache;
+    UI_Image *image = cache->lru_last;
+    if (!image || image->last_used_frame + 1 >= ui_context->frame_index) {
+        return false;
+    }
+    UI_ImageLruRemove(cache, image);
+    UI_ImageBlockFree(&ui_context->resources->image_atlas, image->block);
+    cache->stats.bytes -= (size_t)image->block_size * image->block_size * sizeof(uint32_t);
+    cache->stats.evictions++;
+    image->block = -1;
+    image->state.store(UI_ImageState_Evicted, std::memory_order_relaxed);
+    return true;
+}
+
+// NOTE: Copies a decoded image into the atlas, evicting cached images to make room. Returns
+// false if there is still no room. With image_mutex held, the atlas is shared with the other
+// contexts of the resources, the budget and the evictions are this context's.
+static bool UI_ImageAtlasInsert(UI_Image *image) {
+    UI_Resources *resources = ui_context->resources;
+    UI_ImageAtlas *atlas = &resources->image_atlas;
+    UI_ImageAtlasAllocate(atlas);
+
+    int size = UI_ImageBlockSize(image);
+    UI_ImageCacheStats *stats = &ui_context->image_cache.stats;
+    size_t bytes = (size_t)size * size * sizeof(uint32_t);
+    while (stats->bytes + bytes > stats->budget) {
+        if (!UI_ImageEvictOne()) {
+            return false;
+        }
+    }
+    int x = 0;
+    int y = 0;
+    int block = UI_ImageBlockAlloc(atlas, 0, UI_IMAGE_ATLAS_SIZE, size, &x, &y);
+    // NOTE: Evicted blocks may be scattered, so keep going until one merges into a fit
+    while (block < 0 && UI_ImageEvictOne()) {
+        block = UI_ImageBlockAlloc(atlas, 0, UI_IMAGE_ATLAS_SIZE, size, &x, &y);
+    }
+    if (block < 0) {
+        return false;
+    }
+    stats->bytes += bytes;
+    UI_ImageAtlasWrite(resources, image, block, size, x, y);
+    return true;
+}
+
+// NOTE: Moves images that finished decoding into the atlas
+static void UI_ImagesUpdate() {
+    std::vector<UI_Image*> &loading = ui_context->loading_images;
+    int kept = 0;
+    for (int i = 0; i < (int)loading.size(); i++) {
+        UI_Image *image = loading[i];
+        int state = image->state.load(std::memory_order_acquire);
+        if (state == UI_ImageState_Loading) {
+            loading[kept++] = image;
+        } else if (state == UI_ImageState_Decoded) {
+            bool inserted;
+            {
+                std::lock_guard<std::mutex> lock(ui_context->resources->image_mutex);
+                inserted = UI_ImageAtlasInsert(image);
+            }
+            if (inserted) {
+                free(image->pixels);
+                image->pixels = nullptr;
+                image->state.store(UI_ImageState_Ready, std::memory_order_release);
+                if (image->cached) {
+                    UI_ImageLruPushFront(&ui_context->image_cache, image);
+                }
+            } else if (image->cached) {
+                // NOTE: Room is made as the images on screen go out of use
+                loading[kept++] = image;
+            } else {
+                printf("Image atlas is full, could not fit %s\n", image->path);
+                free(image->pixels);
+                image->pixels = nullptr;
+                image->state.store(UI_ImageState_Failed, std::memory_order_release);
+            }
+        }
+    }
+    loading.resize(kept);
+}
+
+// NOTE: Marks an image used this frame, and starts decoding a cached image again if it was evicted
+static void UI_ImageTouch(UI_Image *image) {
+    if (!image->cached) {
+        return;
+    }
+    image->last_used_frame = ui_context->frame_index;
+    UI_ImageCache *cache = &ui_context->image_cache;
+    int state = image->state.load(std::memory_order_relaxed);
+    if (state == UI_ImageState_Evicted || (state == UI_ImageState_Failed && ui_context->frame_index >= image->retry_frame)) {
+        cache->stats.misses++;
+        image->retry_frame = ui_context->frame_index + UI_IMAGE_RETRY_FRAMES;
+        image->state.store(UI_ImageState_Loading, std::memory_order_relaxed);
+        ui_context->loading_images.push_back(image);
+        UI_JobSpawn(&image->decode_jobs, UI_ImageDecode, image, 0);
+    } else if (image->block >= 0 && cache->lru_first != image) {
+        UI_ImageLruRemove(cache, image);
+        UI_ImageLruPushFront(cache, image);
+    }
+}
+
+static UI_Image *UI_ImageCacheFind(uint64_t key) {
+    UI_ImageCache *cache = &ui_context->image_cache;
+    auto found = cache->images.find(key);
+    if (found == cache->images.end()) {
+        return nullptr;
+    }
+    UI_Image *image = found->second;
+    int state = image->state.load(std::memory_order_relaxed);
+    if (state == UI_ImageState_Failed) {
+        cache->stats.failures++;
+    } else if (state != UI_ImageState_Evicted) {
+        cache->stats.hits++;
+    }
+    UI_ImageTouch(image);
+    return image;
+}
+
+static UI_Image *UI_ImageCacheAdd(uint64_t key, UI_Image *image) {
+    UI_ImageCache *cache = &ui_context->image_cache;
+    image->context = ui_context;
+    image->block = -1;
+    image->cached = true;
+    image->key = key;
+    // NOTE: Starts out evicted so the touch decodes it
+    image->state.store(UI_ImageState_Evicted, std::memory_order_relaxed);
+    cache->images.emplace(key, image);
+    UI_ImageTouch(image);
+    return image;
+}
+
+// NOTE: Cached by path, the image belongs to the cache and is freed with the context
+UI_Image *UI_GetImage(char *path) {
+    uint64_t key = UI_HashString(path, (int)strlen(path), 0);
+    UI_Image *image = UI_ImageCacheFind(key);
+    if (image) {
+        return image;
+    }
+    image = new UI_Image();
+    image->path = (char *)malloc(strlen(path) + 1);
+    strcpy(image->path, path);
+    return UI_ImageCacheAdd(key, image);
+}
+
+// NOTE: Cached by key, e.g. UI_HashString of the data computed once by the caller, so the data
+// isn't hashed on every lookup. data must stay valid as long as the context, an evicted image
+// is decoded from it again.
+UI_Image *UI_GetImageFromMemory(unsigned char *data, int size, uint64_t key) {
+    UI_Image *image = UI_ImageCacheFind(key);
+    if (image) {
+        return image;
+    }
+    image = new UI_Image();
+    image->data = data;
+    image->data_size = size;
+    return UI_ImageCacheAdd(key, image);
+}
+
+// NOTE: Bytes of atlas blocks images may hold, at least one of the largest blocks. Takes
+// effect as images are inserted.
+void UI_SetImageCacheBudget(size_t bytes) {
+    size_t min = (size_t)UI_IMAGE_BLOCK_MAX * UI_IMAGE_BLOCK_MAX * sizeof(uint32_t);
+    ui_context->image_cache.stats.budget = UI_MAX(bytes, min);
+}
+
+UI_ImageCacheStats UI_GetImageCacheStats() {
+    return ui_context->image_cache.stats;
+}
+
+// NOTE: Decoded once into the image atlas of the context's resources and kept until they are
+// released, for every context using them. Finding an image doesn't lock, the first context to
+// ask for it starts the decode.
+UI_Image *UI_GetSharedImage(char *path) {
+    UI_Resources *resources = ui_context->resources;
+    uint64_t key = UI_HashString(path, (int)strlen(path), 0);
+    if (key == 0) {
+        key = 1;
+    }
+    UI_Image *image = (UI_Image *)(uintptr_t)UI_SharedMapFind(&resources->images, key);
+    if (image) {
+        return image;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(resources->image_mutex);
+        image = (UI_Image *)(uintptr_t)UI_SharedMapFind(&resources->images, key);
+        if (image) {
+            return image;
+        }
+        image = new UI_Image();
+        image->shared = resources;
+        image->path = (char *)malloc(strlen(path) + 1);
+        strcpy(image->path, path);
+        image->block = -1;
+        image->key = key;
+        UI_SharedMapInsert(&resources->images, key, (uint64_t)(uintptr_t)image);
+    }
+    // NOTE: Outside the lock, the first spawn creates the job system under the resources' mutex
+    UI_JobSpawn(&ui_context->image_jobs, UI_ImageDecode, image, 0);
+    return image;
+}
+
+static void UI_ImageDestroy(UI_Image *image) {
+    UI_JobWait(&image->decode_jobs);
+    free(image->pixels);
+    free(image->path);
+    delete image;
+}
+
+// NOTE: Returns right away, the image can be shown once it is decoded and in the atlas
+UI_Image *UI_LoadImage(char *path) {
+    UI_Image *image = new UI_Image();
+    image->context = ui_context;
+    image->path = (char *)malloc(strlen(path) + 1);
+    strcpy(image->path, path);
+    image->block = -1;
+    ui_context->loading_images.push_back(image);
+    UI_JobSpawn(&image->decode_jobs, UI_ImageDecode, image, 0);
+    return image;
+}
+
+// NOTE: Not while a widget built this frame shows the image, and not for cached or shared images
+void UI_FreeImage(UI_Image *image) {
+    assert(!image->cached && !image->shared);
+    UI_JobWait(&image->decode_jobs);
+    std::vector<UI_Image*> &loading = ui_context->loading_images;
+    for (int i = 0; i < (int)loading.size(); i++) {
+        if (loading[i] == image) {
+            loading.erase(loading.begin() + i);
+            break;
+        }
+    }
+    if (image->block >= 0) {
+        std::lock_guard<std::mutex> lock(ui_context->resources->image_mutex);
+        UI_ImageBlockFree(&ui_context->resources->image_atlas, image->block);
+        ui_context->image_cache.stats.bytes -= (size_t)image->block_size * image->block_size * sizeof(uint32_t);
+    }
+    UI_ImageDestroy(image);
+}
+
+bool UI_ImageReady(UI_Image *image) {
+    return image->state.load(std::memory_order_acquire) == UI_ImageState_Ready;
+}
+
+// NOTE: Piece table text documents
+
+// NOTE: Blocks after an edited one moved, their starts are summed again from it
+static void UI_TextDocumentSumPieceBlocks(UI_TextDocument *doc, int block) {
+    for (int k = block; k < (int)doc->piece_blocks.size(); k++) {
+        UI_PieceBlock *previous = k > 0 ? &doc->piece_blocks[k - 1] : nullptr;
+        doc->piece_blocks[k].start = previous ? previous->start + previous->bytes : 0;
+    }
+    // NOTE: The first piece is always a valid place to continue reading from
+    doc->read_at = UI_PieceRef{};
+}
+
+static void UI_TextDocumentSumLineBlocks(UI_TextDocument *doc, int block) {
+    for (int k = block; k < (int)doc->blocks.size(); k++) {
+        UI_LineBlock *previous = k > 0 ? &doc->blocks[k - 1] : nullptr;
+        doc->blocks[k].start = previous ? previous->start + previous->bytes : 0;
+        doc->blocks[k].line = previous ? previous->line + previous->lines.size() : 0;
+    }
+}
+
+UI_TextDocument *UI_TextDocumentCreate(char *text, uint64_t length) {
+    UI_TextDocument *doc = new UI_TextDocument();
+    doc->original = (char *)malloc((size_t)UI_MAX(length, 1));
+    memcpy(doc->original, text, (size_t)length);
+    doc->length = length;
+    UI_PieceBlock piece_block{};
+    if (length > 0) {
+        UI_TextPiece piece = {false, 0, length};
+        piece_block.pieces.push_back(piece);
+        piece_block.bytes = length;
+    }
+    doc->piece_blocks.push_back(piece_block);
+
+    UI_LineBlock block{};
+    uint64_t at = 0;
+    for (;;) {
+        char *newline = (char *)memchr(text + at, '\n', (size_t)(length - at));
+        uint64_t next = newline ? (uint64_t)(newline - text) + 1 : length;
+        block.lines.push_back((uint32_t)(next - at));
+        block.bytes += next - at;
+        doc->line_count++;
+        if (block.lines.size() == UI_TEXT_DOCUMENT_BLOCK_LINES) {
+            doc->blocks.push_back(block);
+            block = UI_LineBlock{};
+        }
+        if (!newline) break;
+        at = next;
+    }
+    if (!block.lines.empty()) {
+        doc->blocks.push_back(block);
+    }
+    UI_TextDocumentSumLineBlocks(doc, 0);
+    return doc;
+}
+
+void UI_TextDocumentDestroy(UI_TextDocument *doc) {
+    free(doc->original);
+    delete doc;
+}
+
+// NOTE: Piece containing a byte offset, or the end of the last block at the document's length.
+// Offsets at or past the last read in the same block walk on from it, others bisect the blocks.
+static UI_PieceRef UI_TextDocumentFindPiece(UI_TextDocument *doc, uint64_t offset) {
+    UI_PieceRef ref = doc->read_at;
+    UI_PieceBlock *block = &doc->piece_blocks[ref.block];
+    if (offset < ref.start || offset >= block->start + block->bytes) {
+        int lo = 0, hi = (int)doc->piece_blocks.size();
+        while (hi - lo > 1) {
+            int mid = (lo + hi) / 2;
+            if (doc->piece_blocks[mid].start <= offset) lo = mid;
+            else hi = mid;
+        }
+        block = &doc->piece_blocks[lo];
+        ref = UI_PieceRef{lo, 0, block->start};
+    }
+    while (ref.index < (int)block->pieces.size() && ref.start + block->pieces[ref.index].length <= offset) {
+        ref.start += block->pieces[ref.index].length;
+        ref.index++;
+    }
+    return ref;
+}
+
+void UI_TextDocumentRead(UI_TextDocument *doc, uint64_t offset, uint64_t length, char *out) {
+    UI_PieceRef ref = UI_TextDocumentFindPiece(doc, offset);
+    while (length > 0) {
+        UI_PieceBlock *block = &doc->piece_blocks[ref.block];
+        if (ref.index == (int)block->pieces.size()) {
+            if (ref.block + 1 == (int)doc->piece_blocks.size()) break;
+            ref.block++;
+            ref.index = 0;
+            continue;
+        }
+        UI_TextPiece *piece = &block->pieces[ref.index];
+        uint64_t from = offset - ref.start;
+        uint64_t count = UI_MIN(piece->length - from, length);
+        char *source = piece->added ? doc->added.data() : doc->original;
+        memcpy(out, source + piece->start + from, (size_t)count);
+        out += count;
+        offset += count;
+        length -= count;
+        if (offset == ref.start + piece->length) {
+            ref.start += piece->length;
+            ref.index++;
+        }
+    }
+    doc->read_at = ref;
+}
+
+// NOTE: Line containing a byte offset, an offset just past a newline starts the next line
+UI_LineRef UI_TextDocumentLineAt(UI_TextDocument *doc, uint64_t offset) {
+    int lo = 0, hi = (int)doc->blocks.size();
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (doc->blocks[mid].start <= offset) lo = mid;
+        else hi = mid;
+    }
+    UI_LineRef ref{};
+    ref.start = doc->blocks[lo].start;
+    ref.line = doc->blocks[lo].line;
+    std::vector<uint32_t> &lines = doc->blocks[lo].lines;
+    int index = 0;
+    while (index + 1 < (int)lines.size() && ref.start + lines[index] <= offset) {
+        ref.start += lines[index];
+        ref.line++;
+        index++;
+    }
+    ref.block = lo;
+    ref.index = index;
+    return ref;
+}
+
+UI_LineRef UI_TextDocumentLine(UI_TextDocument *doc, uint64_t line) {
+    line = UI_MIN(line, doc->line_count - 1);
+    int lo = 0, hi = (int)doc->blocks.size();
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (doc->blocks[mid].line <= line) lo = mid;
+        else hi = mid;
+    }
+    UI_LineRef ref{};
+    ref.start = doc->blocks[lo].start;
+    ref.line = doc->blocks[lo].line;
+    std::vector<uint32_t> &lines = doc->blocks[lo].lines;
+    int index = 0;
+    for (; ref.line < line; ref.line++) {
+        ref.start += lines[index++];
+    }
+    ref.block = lo;
+    ref.index = index;
+    return ref;
+}
+
+bool UI_TextDocumentNextLine(UI_TextDocument *doc, UI_LineRef *ref) {
+    if (ref->line + 1 >= doc->line_count) {
+        return false;
+    }
+    ref->start += doc->blocks[ref->block].lines[ref->index];
+    ref->line++;
+    if (++ref->index == (int)doc->blocks[ref->block].lines.size()) {
+        ref->block++;
+        ref->index = 0;
+    }
+    return true;
+}
+
+// NOTE: Copies a line without its line ending into the document's scratch buffer
+char *UI_TextDocumentLineText(UI_TextDocument *doc, UI_LineRef ref, int *length) {
+    uint32_t count = doc->blocks[ref.block].lines[ref.index];
+    doc->scratch.resize(count + 1);
+    char *text = doc->scratch.data();
+    UI_TextDocumentRead(doc, ref.start, count, text);
+    if (count > 0 && text[count - 1] == '\n') count--;
+    if (count > 0 && text[count - 1] == '\r') count--;
+    text[count] = 0;
+    *length = (int)count;
+    return text;
+}
+
+uint64_t UI_TextDocumentPrev(UI_TextDocument *doc, uint64_t offset) {
+    if (offset == 0) return 0;
+    uint64_t limit = offset > 4 ? offset - 4 : 0;
+    char bytes[4];
+    UI_TextDocumentRead(doc, limit, offset - limit, bytes);
+    return limit + UI_Utf8Prev(bytes, (int)(offset - limit));
+}
+
+uint64_t UI_TextDocumentNext(UI_TextDocument *doc, uint64_t offset) {
+    if (offset >= doc->length) return doc->length;
+    char bytes[4];
+    int count = (int)UI_MIN(doc->length - offset, 4);
+    UI_TextDocumentRead(doc, offset, count, bytes);
+    return offset + UI_Utf8NextOffset(bytes, count, 0);
+}
+
+// NOTE: Blocks that grew past twice their size are cut back into full blocks
+static void UI_TextDocumentSplitBlock(UI_TextDocument *doc, int block) {
+    if (doc->blocks[block].lines.size() <= 2 * UI_TEXT_DOCUMENT_BLOCK_LINES) {
+        return;
+    }
+    std::vector<uint32_t> lines = doc->blocks[block].lines;
+    std::vector<UI_LineBlock> split;
+    for (size_t i = 0; i < lines.size(); i += UI_TEXT_DOCUMENT_BLOCK_LINES) {
+        UI_LineBlock part{};
+        size_t end = UI_MIN(i + UI_TEXT_DOCUMENT_BLOCK_LINES, lines.size());
+        part.lines.assign(lines.begin() + i, lines.begin() + end);
+        for (uint32_t line : part.lines) {
+            part.bytes += line;
+        }
+        split.push_back(part);
+    }
+    split[0].start = doc->blocks[block].start;
+    split[0].line = doc->blocks[block].line;
+    doc->blocks[block] = split[0];
+    doc->blocks.insert(doc->blocks.begin() + block + 1, split.begin() + 1, split.end());
+}
+
+static void UI_TextDocumentSplitPieces(UI_TextDocument *doc, int block) {
+    if (doc->piece_blocks[block].pieces.size() <= 2 * UI_TEXT_DOCUMENT_BLOCK_PIECES) {
+        return;
+    }
+    std::vector<UI_TextPiece> pieces = doc->piece_blocks[block].pieces;
+    std::vector<UI_PieceBlock> split;
+    for (size_t i = 0; i < pieces.size(); i += UI_TEXT_DOCUMENT_BLOCK_PIECES) {
+        UI_PieceBlock part{};
+        size_t end = UI_MIN(i + UI_TEXT_DOCUMENT_BLOCK_PIECES, pieces.size());
+        part.pieces.assign(pieces.begin() + i, pieces.begin() + end);
+        for (UI_TextPiece &piece : part.pieces) {
+            part.bytes += piece.length;
+        }
+        split.push_back(part);
+    }
+    split[0].start = doc->piece_blocks[block].start;
+    doc->piece_blocks[block] = split[0];
+    doc->piece_blocks.insert(doc->piece_blocks.begin() + block + 1, split.begin() + 1, split.end());
+}
+
+void UI_TextDocumentInsert(UI_TextDocument *doc, uint64_t offset, char *text, uint64_t length) {
+    if (length == 0) return;
+    offset = UI_MIN(offset, doc->length);
+    UI_LineRef ref = UI_TextDocumentLineAt(doc, offset);
+
+    uint64_t added_start = doc->added.size();
+    doc->added.insert(doc->added.end(), text, text + length);
+
+    UI_TextPiece piece = {true, added_start, length};
+    UI_PieceRef piece_at = UI_TextDocumentFindPiece(doc, offset);
+    int changed = piece_at.block;
+    UI_PieceBlock *pieces = &doc->piece_blocks[piece_at.block];
+    uint64_t from = offset - piece_at.start;
+    UI_PieceBlock *previous_block = pieces;
+    UI_TextPiece *previous = nullptr;
+    if (from == 0 && piece_at.index > 0) {
+        previous = &pieces->pieces[piece_at.index - 1];
+    } else if (from == 0 && piece_at.block > 0) {
+        changed = piece_at.block - 1;
+        previous_block = &doc->piece_blocks[changed];
+        previous = &previous_block->pieces.back();
+    }
+    if (previous && previous->added && previous->start + previous->length == added_start) {
+        // NOTE: Typing at the end of the last insert just extends its piece
+        previous->length += length;
+        previous_block->bytes += length;
+    } else if (from == 0) {
+        changed = piece_at.block;
+        pieces->pieces.insert(pieces->pieces.begin() + piece_at.index, piece);
+        pieces->bytes += length;
+    } else {
+        UI_TextPiece *current = &pieces->pieces[piece_at.index];
+        UI_TextPiece tail = {current->added, current->start + from, current->length - from};
+        current->length = from;
+        pieces->pieces.insert(pieces->pieces.begin() + piece_at.index + 1, {piece, tail});
+        pieces->bytes += length;
+    }
+    UI_TextDocumentSplitPieces(doc, changed);
+    UI_TextDocumentSumPieceBlocks(doc, changed);
+    doc->length += length;
+
+    UI_LineBlock *block = &doc->blocks[ref.block];
+    block->bytes += length;
+    char *newline = (char *)memchr(text, '\n', (size_t)length);
+    if (!newline) {
+        block->lines[ref.index] += (uint32_t)length;
+        UI_TextDocumentSumLineBlocks(doc, ref.block);
+        return;
+    }
+
+    uint64_t column = offset - ref.start;
+    uint64_t rest = block->lines[ref.index] - column;
+    uint64_t at = (uint64_t)(newline - text) + 1;
+    block->lines[ref.index] = (uint32_t)(column + at);
+    std::vector<uint32_t> inserted;
+    while ((newline = (char *)memchr(text + at, '\n', (size_t)(length - at)))) {
+        uint64_t next = (uint64_t)(newline - text) + 1;
+        inserted.push_back((uint32_t)(next - at));
+        at = next;
+    }
+    inserted.push_back((uint32_t)(length - at + rest));
+    block->lines.insert(block->lines.begin() + ref.index + 1, inserted.begin(), inserted.end());
+    doc->line_count += inserted.size();
+    UI_TextDocumentSplitBlock(doc, ref.block);
+    UI_TextDocumentSumLineBlocks(doc, ref.block);
+}
+
+void UI_TextDocumentDelete(UI_TextDocument *doc, uint64_t start, uint64_t end) {
+    end = UI_MIN(end, doc->length);
+    if (start >= end) return;
+    UI_LineRef first = UI_TextDocumentLineAt(doc, start);
+    UI_LineRef last = UI_TextDocumentLineAt(doc, end);
+
+    UI_PieceRef at = UI_TextDocumentFindPiece(doc, start);
+    uint64_t piece_start = at.start;
+    int p = at.block;
+    size_t index = at.index;
+    while (piece_start < end) {
+        UI_PieceBlock *pieces = &doc->piece_blocks[p];
+        if (index == pieces->pieces.size()) {
+            p++;
+            index = 0;
+            continue;
+        }
+        UI_TextPiece *piece = &pieces->pieces[index];
+        uint64_t piece_end = piece_start + piece->length;
+        uint64_t cut_from = UI_MAX(start, piece_start) - piece_start;
+        uint64_t cut_to = UI_MIN(end, piece_end) - piece_start;
+        pieces->bytes -= cut_to - cut_from;
+        if (cut_from == 0 && cut_to == piece->length) {
+            pieces->pieces.erase(pieces->pieces.begin() + index);
+        } else if (cut_from == 0) {
+            piece->start += cut_to;
+            piece->length -= cut_to;
+            index++;
+        } else if (cut_to == piece->length) {
+            piece->length = cut_from;
+            index++;
+        } else {
+            UI_TextPiece tail = {piece->added, piece->start + cut_to, piece->length - cut_to};
+            piece->length = cut_from;
+            pieces->pieces.insert(pieces->pieces.begin() + index + 1, tail);
+            break;
+        }
+        piece_start = piece_end;
+    }
+    for (int k = p; k > at.block; k--) {
+        if (doc->piece_blocks[k].pieces.empty()) {
+            doc->piece_blocks.erase(doc->piece_blocks.begin() + k);
+        }
+    }
+    if (doc->piece_blocks[at.block].pieces.empty() && doc->piece_blocks.size() > 1) {
+        doc->piece_blocks.erase(doc->piece_blocks.begin() + at.block);
+    } else {
+        UI_TextDocumentSplitPieces(doc, at.block);
+    }
+    UI_TextDocumentSumPieceBlocks(doc, at.block);
+    doc->length -= end - start;
+
+    // NOTE: The first and last line touched merge into one, the lines between are dropped
+    uint64_t last_length = doc->blocks[last.block].lines[last.index];
+    uint64_t merged = (start - first.start) + (last.start + last_length - end);
+    UI_LineBlock *block = &doc->blocks[first.block];
+    block->bytes = block->bytes - block->lines[first.index] + merged;
+    block->lines[first.index] = (uint32_t)merged;
+
+    uint64_t count = last.line - first.line;
+    doc->line_count -= count;
+    int b = first.block;
+    size_t i = first.index + 1;
+    while (count > 0) {
+        UI_LineBlock *current = &doc->blocks[b];
+        if (i >= current->lines.size()) {
+            b++;
+            i = 0;
+            continue;
+        }
+        size_t n = (size_t)UI_MIN((uint64_t)(current->lines.size() - i), count);
+        for (size_t k = i; k < i + n; k++) {
+            current->bytes -= current->lines[k];
+        }
+        current->lines.erase(current->lines.begin() + i, current->lines.begin() + i + n);
+        count -= n;
+    }
+    for (int k = b; k > first.block; k--) {
+        if (doc->blocks[k].lines.empty()) {
+            doc->blocks.erase(doc->blocks.begin() + k);
+        }
     }
-    return roundf(width);
+    UI_TextDocumentSumLineBlocks(doc, first.block);
 }
 
-float UI_GetTextWidth(char *text, FontAtlas *font) {
-    return UI_GetTextWidthRanged(text, 0, (int)strlen(text), font);
+void UI_EvictTextCache() {
+    for (auto it = ui_context->text_runs.begin(); it != ui_context->text_runs.end();) {
+        UI_TextRun **link = &it->second;
+        while (*link) {
+            UI_TextRun *run = *link;
+            if (ui_context->frame_index - run->last_used_frame > UI_TEXT_RUN_MAX_AGE) {
+                *link = run->next;
+                UI_TextRunDestroy(run);
+            } else {
+                link = &run->next;
+            }
+        }
+        if (!it->second) {
+            it = ui_context->text_runs.erase(it);
+        } else {
+            it++;
+        }
+    }
+
+    for (auto it = ui_context->text_layouts.begin(); it != ui_context->text_layouts.end();) {
+        UI_TextLayout **link = &it->second;
+        while (*link) {
+            UI_TextLayout *layout = *link;
+            if (ui_context->frame_index - layout->last_used_frame > UI_TEXT_RUN_MAX_AGE) {
+                *link = layout->next;
+                UI_TextLayoutDestroy(layout);
+            } else {
+                link = &layout->next;
+            }
+        }
+        if (!it->second) {
+            it = ui_context->text_layouts.erase(it);
+        } else {
+            it++;
+        }
+    }
+
+    for (auto it = ui_context->text_edits.begin(); it != ui_context->text_edits.end();) {
+        UI_TextEdit *edit = it->second;
+        if (ui_context->frame_index - edit->last_used_frame > UI_TEXT_RUN_MAX_AGE) {
+            UI_TextEditDestroy(edit);
+            it = ui_context->text_edits.erase(it);
+        } else {
+            it++;
+        }
+    }
 }
 
 float UI_GetTextHeight(char *text, FontAtlas *font) {
@@ -489,6 +3367,14 @@ float UI_GetTextHeight(char *text, FontAtlas *font) {
     return roundf(height);
 }
 
+// NOTE: Draw calls append to the calling thread's draw list, the context's own list unless
+// the thread is tessellating a chunk of a parallel draw
+static thread_local UI_Draw_Data *ui_draw_list;
+
+UI_Draw_Data *UI_GetDrawList() {
+    return ui_draw_list ? ui_draw_list : &ui_context->viewport->draw_data;
+}
+
 void UI_PushVertex(UI_Draw_Data *draw_data, UI_Vertex vertex) {
     draw_data->vertex_count++;
     if (draw_data->vertex_count >= draw_data->vertex_capacity) {
@@ -498,6 +3384,18 @@ void UI_PushVertex(UI_Draw_Data *draw_data, UI_Vertex vertex) {
     draw_data->vertex_list[draw_data->vertex_count - 1] = vertex;
 }
 
+UI_Vertex *UI_ReserveVertices(UI_Draw_Data *draw_data, int count) {
+    int needed = draw_data->vertex_count + count;
+    if (needed >= draw_data->vertex_capacity) {
+        int capacity = draw_data->vertex_capacity + (draw_data->vertex_capacity / 2) + 1;
+        draw_data->vertex_capacity = UI_MAX(capacity, needed + 1);
+        draw_data->vertex_list = (UI_Vertex *)realloc(draw_data->vertex_list, draw_data->vertex_capacity * sizeof(UI_Vertex));
+    }
+    UI_Vertex *result = draw_data->vertex_list + draw_data->vertex_count;
+    draw_data->vertex_count = needed;
+    return result;
+}
+
 void UI_DrawLine(UI_Vec2 start, UI_Vec2 end, UI_Vec4 color, float thickness) {
     float angle = atan2f(end.y - start.y, end.x - start.x);
     float half_thickness = thickness / 2.0f;
@@ -510,81 +3408,172 @@ void UI_DrawLine(UI_Vec2 start, UI_Vec2 end, UI_Vec4 color, float thickness) {
     vertices[4] = vertices[2];
     for (int i = 0; i < 6; i++) {
         vertices[i].color = color;
-        UI_PushVertex(&ui_state.draw_data, vertices[i]);
+        UI_PushVertex(UI_GetDrawList(), vertices[i]);
+    }
+}
+
+// NOTE: Tessellates a run of shaped glyphs into 6 vertices each, written straight into
+// vertices reserved up front. The SIMD paths build a vertex as two 4-wide halves,
+// (x, y, r, g) and (b, a, u, v), shuffled out of the quad corners and uv rect.
+void UI_TessellateGlyphs(UI_Draw_Data *draw_data, FontAtlas *font, UI_ShapedGlyph *glyphs, int count, UI_Vec2 position, UI_Vec4 color) {
+    if (count <= 0) return;
+    static_assert(sizeof(UI_Vertex) == 8 * sizeof(float), "UI_Vertex must be tightly packed");
+
+    UI_Vertex *vertices = UI_ReserveVertices(draw_data, count * 6);
+    float *out = (float *)vertices;
+    float inv_width = font->inv_width;
+    float inv_height = font->inv_height;
+    float base_y = position.y + font->ascend;
+    int i = 0;
+
+#if defined(UI_AVX)
+    {
+        __m256 crg = _mm256_setr_ps(color.r, color.g, color.r, color.g, color.r, color.g, color.r, color.g);
+        __m256 cba = _mm256_setr_ps(color.b, color.a, color.b, color.a, color.b, color.a, color.b, color.a);
+        for (; i + 2 <= count; i += 2) {
+            UI_ShapedGlyph sa = glyphs[i];
+            UI_ShapedGlyph sb = glyphs[i + 1];
+            FontGlyph *ga = &font->glyphs[sa.glyph];
+            FontGlyph *gb = &font->glyphs[sb.glyph];
+            float xa = position.x + sa.x + ga->bl;
+            float xb = position.x + sb.x + gb->bl;
+            __m256 pos = _mm256_setr_ps(xa, base_y - ga->bt, xa + ga->bx, base_y - ga->bt + ga->by,
+                                        xb, base_y - gb->bt, xb + gb->bx, base_y - gb->bt + gb->by);
+            __m256 uv = _mm256_add_ps(_mm256_setr_ps(ga->tx, ga->ty, ga->tx, ga->ty, gb->tx, gb->ty, gb->tx, gb->ty),
+                                      _mm256_mul_ps(_mm256_setr_ps(0.0f, 0.0f, ga->bx, ga->by, 0.0f, 0.0f, gb->bx, gb->by),
+                                                    _mm256_setr_ps(0.0f, 0.0f, inv_width, inv_height, 0.0f, 0.0f, inv_width, inv_height)));
+
+            __m256 lo[4], hi[4];
+            lo[0] = _mm256_shuffle_ps(pos, crg, _MM_SHUFFLE(1, 0, 3, 0)); hi[0] = _mm256_shuffle_ps(cba, uv, _MM_SHUFFLE(3, 0, 1, 0));
+            lo[1] = _mm256_shuffle_ps(pos, crg, _MM_SHUFFLE(1, 0, 1, 0)); hi[1] = _mm256_shuffle_ps(cba, uv, _MM_SHUFFLE(1, 0, 1, 0));
+            lo[2] = _mm256_shuffle_ps(pos, crg, _MM_SHUFFLE(1, 0, 1, 2)); hi[2] = _mm256_shuffle_ps(cba, uv, _MM_SHUFFLE(1, 2, 1, 0));
+            lo[3] = _mm256_shuffle_ps(pos, crg, _MM_SHUFFLE(1, 0, 3, 2)); hi[3] = _mm256_shuffle_ps(cba, uv, _MM_SHUFFLE(3, 2, 1, 0));
+
+            // NOTE: Low lanes belong to the first glyph, high lanes to the second
+            __m256 va[4], vb[4];
+            for (int k = 0; k < 4; k++) {
+                va[k] = _mm256_permute2f128_ps(lo[k], hi[k], 0x20);
+                vb[k] = _mm256_permute2f128_ps(lo[k], hi[k], 0x31);
+            }
+            _mm256_storeu_ps(out + 0,  va[0]);
+            _mm256_storeu_ps(out + 8,  va[1]);
+            _mm256_storeu_ps(out + 16, va[2]);
+            _mm256_storeu_ps(out + 24, va[0]);
+            _mm256_storeu_ps(out + 32, va[2]);
+            _mm256_storeu_ps(out + 40, va[3]);
+            _mm256_storeu_ps(out + 48, vb[0]);
+            _mm256_storeu_ps(out + 56, vb[1]);
+            _mm256_storeu_ps(out + 64, vb[2]);
+            _mm256_storeu_ps(out + 72, vb[0]);
+            _mm256_storeu_ps(out + 80, vb[2]);
+            _mm256_storeu_ps(out + 88, vb[3]);
+            out += 96;
+        }
+    }
+#endif
+
+#if defined(UI_SSE2)
+    {
+        __m128 crg = _mm_setr_ps(color.r, color.g, color.r, color.g);
+        __m128 cba = _mm_setr_ps(color.b, color.a, color.b, color.a);
+        __m128 inv_dim = _mm_setr_ps(0.0f, 0.0f, inv_width, inv_height);
+        for (; i < count; i++) {
+            UI_ShapedGlyph shaped = glyphs[i];
+            FontGlyph *glyph = &font->glyphs[shaped.glyph];
+            float x = position.x + shaped.x + glyph->bl;
+            __m128 pos = _mm_setr_ps(x, base_y - glyph->bt, x + glyph->bx, base_y - glyph->bt + glyph->by);
+            __m128 uv = _mm_add_ps(_mm_setr_ps(glyph->tx, glyph->ty, glyph->tx, glyph->ty),
+                                   _mm_mul_ps(_mm_setr_ps(0.0f, 0.0f, glyph->bx, glyph->by), inv_dim));
+
+            __m128 lo0 = _mm_shuffle_ps(pos, crg, _MM_SHUFFLE(1, 0, 3, 0)), hi0 = _mm_shuffle_ps(cba, uv, _MM_SHUFFLE(3, 0, 1, 0));
+            __m128 lo1 = _mm_shuffle_ps(pos, crg, _MM_SHUFFLE(1, 0, 1, 0)), hi1 = _mm_shuffle_ps(cba, uv, _MM_SHUFFLE(1, 0, 1, 0));
+            __m128 lo2 = _mm_shuffle_ps(pos, crg, _MM_SHUFFLE(1, 0, 1, 2)), hi2 = _mm_shuffle_ps(cba, uv, _MM_SHUFFLE(1, 2, 1, 0));
+            __m128 lo3 = _mm_shuffle_ps(pos, crg, _MM_SHUFFLE(1, 0, 3, 2)), hi3 = _mm_shuffle_ps(cba, uv, _MM_SHUFFLE(3, 2, 1, 0));
+            _mm_storeu_ps(out + 0,  lo0); _mm_storeu_ps(out + 4,  hi0);
+            _mm_storeu_ps(out + 8,  lo1); _mm_storeu_ps(out + 12, hi1);
+            _mm_storeu_ps(out + 16, lo2); _mm_storeu_ps(out + 20, hi2);
+            _mm_storeu_ps(out + 24, lo0); _mm_storeu_ps(out + 28, hi0);
+            _mm_storeu_ps(out + 32, lo2); _mm_storeu_ps(out + 36, hi2);
+            _mm_storeu_ps(out + 40, lo3); _mm_storeu_ps(out + 44, hi3);
+            out += 48;
+        }
+    }
+#endif
+
+    UI_Vertex *v = (UI_Vertex *)out;
+    for (; i < count; i++) {
+        UI_ShapedGlyph shaped = glyphs[i];
+        FontGlyph *glyph = &font->glyphs[shaped.glyph];
+        float x0 = position.x + shaped.x + glyph->bl;
+        float x1 = x0 + glyph->bx;
+        float y0 = base_y - glyph->bt;
+        float y1 = y0 + glyph->by;
+        float u0 = glyph->tx;
+        float v0 = glyph->ty;
+        float u1 = u0 + glyph->bx * inv_width;
+        float v1 = v0 + glyph->by * inv_height;
+
+        v[0].position = {x0, y1};
+        v[0].color = color;
+        v[0].uv = {u0, v1};
+        v[1].position = {x0, y0};
+        v[1].color = color;
+        v[1].uv = {u0, v0};
+        v[2].position = {x1, y0};
+        v[2].color = color;
+        v[2].uv = {u1, v0};
+        v[5].position = {x1, y1};
+        v[5].color = color;
+        v[5].uv = {u1, v1};
+        v[3] = v[0];
+        v[4] = v[2];
+        v += 6;
     }
 }
 
 void UI_DrawTextOffset(char *text, FontAtlas *font, UI_Vec2 position, float offset) {
-    for (char *ptr = text; *ptr; ptr++) {
-        int glyph_index = *ptr;
-        FontGlyph glyph = font->glyphs[glyph_index];
-        float x0 = position.x + glyph.bl - offset;
-        float x1 = x0 + glyph.bx;
-        float y0 = position.y - glyph.bt + font->ascend;
-        float y1 = y0 + glyph.by;
-
-        float tw = glyph.bx / (float)font->width;
-        float th = glyph.by / (float)font->height;
-        float tx = glyph.to;
-        float ty = 0.0f;
-
-        if (position.x > offset + glyph.bl) {
-            UI_Vertex vertices[6]{};
-            vertices[0].position = {x0, y1};
-            vertices[0].color = BLACK;
-            vertices[0].uv = {tx, ty + th};
-            vertices[1].position = {x0, y0};
-            vertices[1].color = BLACK;
-            vertices[1].uv = {tx, ty};
-            vertices[2].position = {x1, y0};
-            vertices[2].color = BLACK;
-            vertices[2].uv = {tx + tw, ty};
-            vertices[5].position = {x1, y1};
-            vertices[5].color = BLACK;
-            vertices[5].uv = {tx + tw, ty + th};
-            vertices[3] = vertices[0];
-            vertices[4] = vertices[2];
-            for (int i = 0; i < 6; i++) {
-                UI_PushVertex(&ui_state.draw_data, vertices[i]);
+    UI_TextRun *run = UI_ShapeText(text, (int)strlen(text), font);
+    // NOTE: Skip the glyphs scrolled out to the left, the rest of the run is drawn as one batch
+    int first = 0;
+    while (first < run->glyph_count) {
+        UI_ShapedGlyph shaped = run->glyphs[first];
+        if (position.x + shaped.x > offset + font->glyphs[shaped.glyph].bl) break;
+        first++;
+    }
+    UI_TessellateGlyphs(UI_GetDrawList(), font, run->glyphs + first, run->glyph_count - first, UI_Vec2(position.x - offset, position.y), BLACK);
+}
+
+void UI_DrawTextRun(char *text, UI_TextRun *run, FontAtlas *font, UI_Vec2 position) {
+    // NOTE: Each line between newlines is tessellated as one batch
+    int first = 0;
+    float y = position.y;
+    for (int i = 0; i <= run->glyph_count; i++) {
+        if (i == run->glyph_count || text[run->glyphs[i].offset] == '\n') {
+            if (i > first) {
+                UI_Vec2 line_position(position.x - run->glyphs[first].x, y);
+                UI_TessellateGlyphs(UI_GetDrawList(), font, run->glyphs + first, i - first, line_position, BLACK);
             }
+            first = i + 1;
+            y += font->glyph_height;
         }
-        position.x += glyph.ax;
     }
 }
 
 void UI_DrawText(char *text, FontAtlas *font, UI_Vec2 position) {
-    for (char *ptr = text; *ptr; ptr++) {
-        int glyph_index = *ptr;
-        FontGlyph glyph = font->glyphs[glyph_index];
-        float x0 = position.x + glyph.bl;
-        float x1 = x0 + glyph.bx;
-        float y0 = position.y - glyph.bt + font->ascend;
-        float y1 = y0 + glyph.by;
-
-        float tw = glyph.bx / (float)font->width;
-        float th = glyph.by / (float)font->height;
-        float tx = glyph.to;
-        float ty = 0.0f;
-
-        UI_Vertex vertices[6]{};
-        vertices[0].position = {x0, y1};
-        vertices[0].color = BLACK;
-        vertices[0].uv = {tx, ty + th};
-        vertices[1].position = {x0, y0};
-        vertices[1].color = BLACK;
-        vertices[1].uv = {tx, ty};
-        vertices[2].position = {x1, y0};
-        vertices[2].color = BLACK;
-        vertices[2].uv = {tx + tw, ty};
-        vertices[5].position = {x1, y1};
-        vertices[5].color = BLACK;
-        vertices[5].uv = {tx + tw, ty + th};
-        vertices[3] = vertices[0];
-        vertices[4] = vertices[2];
-        for (int i = 0; i < 6; i++) {
-            UI_PushVertex(&ui_state.draw_data, vertices[i]);
-        }
-        position.x += glyph.ax;
+    UI_DrawTextRun(text, UI_ShapeText(text, (int)strlen(text), font), font, position);
+}
+
+void UI_DrawTextLayout(UI_TextLayout *layout, UI_Vec2 position) {
+    FontAtlas *font = UI_GetFont(layout->font);
+    UI_TextRun *run = layout->run;
+    float y = position.y;
+    for (int i = 0; i < (int)layout->lines.size(); i++) {
+        UI_TextLine *line = &layout->lines[i];
+        if (line->last_glyph > line->first_glyph) {
+            UI_Vec2 line_position(position.x - run->glyphs[line->first_glyph].x, y);
+            UI_TessellateGlyphs(UI_GetDrawList(), font, run->glyphs + line->first_glyph, line->last_glyph - line->first_glyph, line_position, BLACK);
+        }
+        y += font->glyph_height;
     }
 }
 
@@ -610,7 +3599,7 @@ void UI_DrawRect(UI_Rect rect, UI_Vec4 color) {
     vertices[3] = vertices[0];
     vertices[4] = vertices[2];
     for (int i = 0; i < 6; i++) {
-        UI_PushVertex(&ui_state.draw_data, vertices[i]);
+        UI_PushVertex(UI_GetDrawList(), vertices[i]);
     }
 }
 
@@ -632,6 +3621,224 @@ void UI_DrawRectOutline(UI_Rect rect, UI_Vec4 color) {
 }
 
 
+// NOTE: Only the codepoints between the scroll offset and the right edge are measured and drawn
+void UI_DrawTextEdit(UI_Widget *widget) {
+    UI_TextEdit *edit = widget->text_edit;
+    FontAtlas *font = UI_GetFont(edit->font);
+    float width = widget->rect.width - 2.0f * UI_TEXT_MARGIN;
+    int length = UI_TextEditLength(edit);
+
+    float caret = UI_TextEditCaretX(edit, edit->cursor);
+    if (caret - edit->scroll > width) {
+        edit->scroll = caret - width;
+    } else if (caret < edit->scroll) {
+        edit->scroll = caret;
+    }
+
+    edit->visible.clear();
+    int at = UI_TextEditOffsetAtX(edit, edit->scroll);
+    if (UI_TextEditCaretX(edit, at) < edit->scroll) {
+        at = UI_TextEditNext(edit, at);
+    }
+    while (at < length) {
+        float x = UI_TextEditCaretX(edit, at);
+        int advance;
+        int id = UI_FindGlyph(font, UI_TextEditDecode(edit, at, &advance));
+        if (x + font->glyphs[id].ax - edit->scroll > width) {
+            break;
+        }
+        UI_ShapedGlyph shaped;
+        shaped.glyph = id;
+        shaped.offset = at;
+        shaped.x = x - edit->scroll;
+        edit->visible.push_back(shaped);
+        at += advance;
+    }
+
+    UI_Vec2 position(widget->rect.x + UI_TEXT_MARGIN, widget->rect.y + 2.0f);
+    if (UI_IsActive(widget) && edit->anchor != edit->cursor) {
+        float x0 = UI_TextEditCaretX(edit, UI_MIN(edit->anchor, edit->cursor)) - edit->scroll;
+        float x1 = UI_TextEditCaretX(edit, UI_MAX(edit->anchor, edit->cursor)) - edit->scroll;
+        x0 = UI_CLAMP(x0, 0.0f, width);
+        x1 = UI_CLAMP(x1, 0.0f, width);
+        UI_DrawRect({position.x + x0, position.y, x1 - x0, font->glyph_height}, UI_Vec4(0.6f, 0.8f, 1.0f, 1.0f));
+    }
+    UI_TessellateGlyphs(UI_GetDrawList(), font, edit->visible.data(), (int)edit->visible.size(), position, widget->text_color);
+
+    if (UI_IsActive(widget) && UI_CaretVisible()) {
+        UI_DrawRect({position.x + caret - edit->scroll, widget->rect.y + 2.0f, 1.0f, widget->rect.height - 4.0f}, widget->text_color);
+    }
+}
+
+// NOTE: Only the visible lines plus a small overscan are located and tessellated
+void UI_DrawTextView(UI_Widget *widget) {
+    UI_TextFile *file = widget->text_file;
+    FontAtlas *font = UI_GetFont(widget->font);
+    float width = widget->rect.width - 2.0f * UI_TEXT_MARGIN;
+    int visible_lines = (int)(widget->rect.height / font->glyph_height) + 1;
+
+    uint64_t line_count = file->line_count.load(std::memory_order_acquire);
+    double max_scroll = line_count > (uint64_t)visible_lines ? (double)(line_count - visible_lines) : 0.0;
+    file->scroll = UI_CLAMP(file->scroll, 0.0, max_scroll);
+
+    uint64_t first = (uint64_t)file->scroll;
+    uint64_t begin = first > UI_TEXT_VIEW_OVERSCAN ? first - UI_TEXT_VIEW_OVERSCAN : 0;
+    uint64_t end = UI_MIN(first + visible_lines + UI_TEXT_VIEW_OVERSCAN, line_count);
+    if (begin < end) {
+        uint64_t offset = UI_TextFileLineStart(file, begin);
+        for (uint64_t line = begin; line < end; line++) {
+            uint64_t next;
+            int length = UI_TextFileLineLength(file, offset, &next);
+            float y = widget->rect.y + (float)((double)line - file->scroll) * font->glyph_height;
+            if (line >= first && length > 0) {
+                UI_TextRun *run = UI_ShapeText(file->data + offset, length, font);
+                int count = 0;
+                while (count < run->glyph_count && run->glyphs[count].x < width) {
+                    count++;
+                }
+                UI_TessellateGlyphs(UI_GetDrawList(), font, run->glyphs, count, UI_Vec2(widget->rect.x + UI_TEXT_MARGIN, y), widget->text_color);
+            }
+            offset = next;
+        }
+    }
+
+    if (!file->indexed.load(std::memory_order_acquire)) {
+        // NOTE: Progress is redrawn a few times a second, the indexer wakes the host when done
+        UI_RequestFrame(0.1);
+        float progress = UI_TextFileProgress(file);
+        UI_DrawRect({widget->rect.x, widget->rect.y + widget->rect.height - 3.0f, widget->rect.width * progress, 3.0f}, UI_Vec4(0.25f, 0.75f, 1.0f, 1.0f));
+    }
+}
+
+// NOTE: Only the lines on screen are shaped and tessellated
+void UI_DrawLogView(UI_Widget *widget) {
+    UI_Log *log = widget->log;
+    FontAtlas *font = UI_GetFont(widget->font);
+    float width = widget->rect.width - 2.0f * UI_TEXT_MARGIN;
+    int visible_lines = (int)(widget->rect.height / font->glyph_height);
+
+    double first_line = (double)UI_LogFirstLine(log);
+    double max_scroll = UI_MAX(first_line, (double)log->line_count - visible_lines);
+    if (log->follow) {
+        log->scroll = max_scroll;
+    }
+    log->scroll = UI_CLAMP(log->scroll, first_line, max_scroll);
+    log->follow = log->scroll >= max_scroll;
+
+    uint64_t first = (uint64_t)log->scroll;
+    uint64_t end = UI_MIN(first + visible_lines + 1, log->line_count);
+    for (uint64_t n = first; n < end; n++) {
+        UI_LogLine *line = &log->lines[n % log->line_capacity];
+        if (line->length == 0) {
+            continue;
+        }
+        float y = widget->rect.y + (float)((double)n - log->scroll) * font->glyph_height;
+        UI_TextRun *run = UI_ShapeText(line->text, line->length, font);
+        int count = 0;
+        while (count < run->glyph_count && run->glyphs[count].x < width) {
+            count++;
+        }
+        UI_TessellateGlyphs(UI_GetDrawList(), font, run->glyphs, count, UI_Vec2(widget->rect.x + UI_TEXT_MARGIN, y), widget->text_color);
+    }
+}
+
+// NOTE: A placeholder until the image is in the atlas
+void UI_DrawImage(UI_Widget *widget) {
+    UI_Image *image = widget->image;
+    // NOTE: Shared images are placed by other threads, acquire makes their uv visible
+    if (image->state.load(std::memory_order_acquire) != UI_ImageState_Ready) {
+        UI_DrawRect(widget->rect, LIGHTGRAY);
+        return;
+    }
+
+    float x0 = widget->rect.x;
+    float y0 = widget->rect.y;
+    float x1 = widget->rect.x + widget->rect.width;
+    float y1 = widget->rect.y + widget->rect.height;
+    UI_Vertex *vertices = UI_ReserveVertices(UI_GetDrawList(), 6);
+    vertices[0] = {UI_Vec2(x0, y1), WHITE, UI_Vec2(image->uv0.x, image->uv1.y)};
+    vertices[1] = {UI_Vec2(x0, y0), WHITE, image->uv0};
+    vertices[2] = {UI_Vec2(x1, y0), WHITE, UI_Vec2(image->uv1.x, image->uv0.y)};
+    vertices[3] = vertices[0];
+    vertices[4] = vertices[2];
+    vertices[5] = {UI_Vec2(x1, y1), WHITE, image->uv1};
+}
+
+// NOTE: Walks the lines on screen the same way the draw does and finds the offset under a point
+uint64_t UI_TextDocumentHitTest(UI_TextDocument *doc, UI_Rect rect, FontAtlas *font, float x, float y) {
+    float width = rect.width - 2.0f * UI_TEXT_MARGIN;
+    UI_LineRef ref = UI_TextDocumentLine(doc, (uint64_t)doc->scroll);
+    float top = rect.y - (float)(doc->scroll - (double)ref.line) * font->glyph_height;
+    for (;;) {
+        int length;
+        char *text = UI_TextDocumentLineText(doc, ref, &length);
+        UI_TextLayout *layout = UI_GetTextLayout(text, length, font);
+        UI_TextLayoutWrap(layout, width);
+        int rows = (int)layout->lines.size();
+        float bottom = top + rows * font->glyph_height;
+        if (y < bottom || ref.line + 1 >= doc->line_count) {
+            int row = UI_CLAMP((int)((y - top) / font->glyph_height), 0, rows - 1);
+            UI_TextLine *line = &layout->lines[row];
+            UI_TextRun *run = layout->run;
+            float row_x = line->first_glyph < run->glyph_count ? run->glyphs[line->first_glyph].x : run->width;
+            return ref.start + UI_TextRunHitTest(run, line->first_glyph, line->last_glyph, x - rect.x - UI_TEXT_MARGIN + row_x);
+        }
+        top = bottom;
+        UI_TextDocumentNextLine(doc, &ref);
+    }
+}
+
+// NOTE: Lines are wrapped through the layout cache, so an edit only reshapes and rewraps
+// the line it touched. Only the lines on screen are read out of the piece table.
+void UI_DrawTextDocument(UI_Widget *widget) {
+    UI_TextDocument *doc = widget->text_document;
+    FontAtlas *font = UI_GetFont(widget->font);
+    float width = widget->rect.width - 2.0f * UI_TEXT_MARGIN;
+    float bottom = widget->rect.y + widget->rect.height;
+    int visible_lines = UI_MAX((int)(widget->rect.height / font->glyph_height), 1);
+
+    UI_LineRef cursor = UI_TextDocumentLineAt(doc, doc->cursor);
+    if (doc->cursor_moved) {
+        // NOTE: Wrapped rows are ignored here, a moved cursor is kept within the visible lines
+        if ((double)cursor.line < doc->scroll) {
+            doc->scroll = (double)cursor.line;
+        } else if ((double)cursor.line >= doc->scroll + visible_lines) {
+            doc->scroll = (double)(cursor.line - visible_lines + 1);
+        }
+        doc->cursor_moved = false;
+    }
+    doc->scroll = UI_CLAMP(doc->scroll, 0.0, (double)(doc->line_count - 1));
+
+    UI_LineRef ref = UI_TextDocumentLine(doc, (uint64_t)doc->scroll);
+    float y = widget->rect.y - (float)(doc->scroll - (double)ref.line) * font->glyph_height;
+    for (;;) {
+        int length;
+        char *text = UI_TextDocumentLineText(doc, ref, &length);
+        UI_TextLayout *layout = UI_GetTextLayout(text, length, font);
+        UI_TextLayoutWrap(layout, width);
+        UI_Vec2 position(widget->rect.x + UI_TEXT_MARGIN, y);
+        UI_DrawTextLayout(layout, position);
+
+        if (UI_IsActive(widget) && ref.line == cursor.line && UI_CaretVisible()) {
+            UI_TextRun *run = layout->run;
+            int column = (int)UI_MIN(doc->cursor - ref.start, (uint64_t)length);
+            int row = 0;
+            while (row + 1 < (int)layout->lines.size() && layout->lines[row + 1].start <= column) {
+                row++;
+            }
+            UI_TextLine *line = &layout->lines[row];
+            float row_x = line->first_glyph < run->glyph_count ? run->glyphs[line->first_glyph].x : run->width;
+            float caret = UI_TextRunCaretX(run, column) - row_x;
+            UI_DrawRect({position.x + caret, y + row * font->glyph_height, 1.0f, font->glyph_height}, widget->text_color);
+        }
+
+        y += layout->lines.size() * font->glyph_height;
+        if (y >= bottom || !UI_TextDocumentNextLine(doc, &ref)) {
+            break;
+        }
+    }
+}
+
 void UI_DrawCheckMark(UI_Vec2 position, UI_Vec2 bound, UI_Vec4 color) {
     float width = bound.x - position.x;
     float height = bound.y - position.y;
@@ -645,20 +3852,109 @@ void UI_DrawCheckMark(UI_Vec2 position, UI_Vec2 bound, UI_Vec4 color) {
 
 UI_Widget *UI_GetParent() {
     UI_Widget *parent = nullptr;
-    if (!ui_state.parent_stack.empty()) parent = ui_state.parent_stack.top();
+    if (!ui_context->parent_stack.empty()) parent = ui_context->parent_stack.top();
     return parent;
 }
 
 UI_Widget *UI_FindWidget(char *label) {
-    UI_Widget *result = nullptr;
-    for (int i = 0; i < ui_state.old_list.size(); i++) {
-        UI_Widget *widget = ui_state.old_list[i];
-        if (strcmp(widget->label, label) == 0) {
-            result = widget;
-            break;
+    auto it = ui_context->old_widgets.find(UI_HashString(label, (int)strlen(label), 0));
+    if (it != ui_context->old_widgets.end() && strcmp(it->second->label, label) == 0) {
+        return it->second;
+    }
+    return nullptr;
+}
+
+static void UI_HitIndexCollect(UI_HitIndex *index, UI_Widget *widget, UI_Rect clip) {
+    float x0 = UI_MAX(widget->rect.x, clip.x);
+    float y0 = UI_MAX(widget->rect.y, clip.y);
+    float x1 = UI_MIN(widget->rect.x + widget->rect.width, clip.x + clip.width);
+    float y1 = UI_MIN(widget->rect.y + widget->rect.height, clip.y + clip.height);
+    if (x1 <= x0 || y1 <= y0) {
+        return;
+    }
+    UI_Rect rect = {x0, y0, x1 - x0, y1 - y0};
+    if (widget->flags & UI_WidgetFlags_Clickable) {
+        UI_HitRect hit = {rect, widget->key, widget->focus_index};
+        if (widget->focus_index >= 0) {
+            index->focus_rects[widget->focus_index] = (int)index->rects.size();
+        }
+        index->rects.push_back(hit);
+    }
+    for (UI_Widget *child = widget->first; child; child = child->next) {
+        UI_HitIndexCollect(index, child, rect);
+    }
+}
+
+// NOTE: Cells covered by a rect, clamped to the grid
+static void UI_HitIndexCells(UI_HitIndex *index, UI_Rect rect, int *c0, int *r0, int *c1, int *r1) {
+    *c0 = UI_CLAMP((int)((rect.x - index->origin_x) / UI_HIT_CELL_SIZE), 0, index->columns - 1);
+    *r0 = UI_CLAMP((int)((rect.y - index->origin_y) / UI_HIT_CELL_SIZE), 0, index->rows - 1);
+    *c1 = UI_CLAMP((int)((rect.x + rect.width - index->origin_x) / UI_HIT_CELL_SIZE), 0, index->columns - 1);
+    *r1 = UI_CLAMP((int)((rect.y + rect.height - index->origin_y) / UI_HIT_CELL_SIZE), 0, index->rows - 1);
+}
+
+void UI_HitIndexBuild(UI_HitIndex *index, UI_Widget *root) {
+    index->rects.clear();
+    index->origin_x = root->rect.x;
+    index->origin_y = root->rect.y;
+    index->columns = UI_MAX((int)ceilf(root->rect.width / UI_HIT_CELL_SIZE), 1);
+    index->rows = UI_MAX((int)ceilf(root->rect.height / UI_HIT_CELL_SIZE), 1);
+    index->focus_rects.assign(ui_context->focus_order.size(), -1);
+    UI_HitIndexCollect(index, root, root->rect);
+
+    // NOTE: Count the rects per cell, then fill the cells in draw order
+    int cell_count = index->columns * index->rows;
+    index->cell_start.assign(cell_count + 1, 0);
+    for (int i = 0; i < (int)index->rects.size(); i++) {
+        int c0, r0, c1, r1;
+        UI_HitIndexCells(index, index->rects[i].rect, &c0, &r0, &c1, &r1);
+        for (int r = r0; r <= r1; r++) {
+            for (int c = c0; c <= c1; c++) {
+                index->cell_start[r * index->columns + c + 1]++;
+            }
+        }
+    }
+    for (int cell = 0; cell < cell_count; cell++) {
+        index->cell_start[cell + 1] += index->cell_start[cell];
+    }
+    index->cell_items.resize(index->cell_start[cell_count]);
+    index->cell_fill.assign(index->cell_start.begin(), index->cell_start.end() - 1);
+    for (int i = 0; i < (int)index->rects.size(); i++) {
+        int c0, r0, c1, r1;
+        UI_HitIndexCells(index, index->rects[i].rect, &c0, &r0, &c1, &r1);
+        for (int r = r0; r <= r1; r++) {
+            for (int c = c0; c <= c1; c++) {
+                index->cell_items[index->cell_fill[r * index->columns + c]++] = i;
+            }
+        }
+    }
+}
+
+// NOTE: Key of the topmost clickable widget containing the point of the mouse viewport, 0 if
+// there is none
+uint64_t UI_HitTest(float x, float y) {
+    UI_HitIndex *index = &ui_context->mouse_viewport->hit_index;
+    if (index->cell_start.empty()) {
+        return 0;
+    }
+    int column = (int)floorf((x - index->origin_x) / UI_HIT_CELL_SIZE);
+    int row = (int)floorf((y - index->origin_y) / UI_HIT_CELL_SIZE);
+    if (column < 0 || column >= index->columns || row < 0 || row >= index->rows) {
+        return 0;
+    }
+    int cell = row * index->columns + column;
+    for (int i = index->cell_start[cell + 1] - 1; i >= index->cell_start[cell]; i--) {
+        UI_HitRect *hit = &index->rects[index->cell_items[i]];
+        if (x >= hit->rect.x && x <= hit->rect.x + hit->rect.width &&
+            y >= hit->rect.y && y <= hit->rect.y + hit->rect.height) {
+            return hit->key;
         }
     }
-    return result;
+    return 0;
+}
+
+bool UI_IsHot(UI_Widget *widget) {
+    return widget && ui_context->hot_key != 0 && widget->key == ui_context->hot_key;
 }
 
 UI_Widget *UI_WidgetCreate() {
@@ -670,6 +3966,7 @@ UI_Widget *UI_WidgetCreate(char *label) {
     UI_Widget *widget = (UI_Widget *)calloc(1, sizeof(UI_Widget));
     widget->label = (char *)malloc(strlen(label) + 1);
     strcpy(widget->label, label);
+    widget->key = UI_HashString(label, (int)strlen(label), 0);
     widget->next = nullptr;
     return widget;
 }
@@ -686,7 +3983,10 @@ UI_Widget *UI_WidgetCopy(UI_Widget *widget) {
 
 void UI_WidgetActivate(UI_Widget *widget) {
     widget->active = true;
-    active_widget = UI_WidgetCopy(widget);
+    ui_context->active_key = widget->key;
+    if (widget->flags & UI_WidgetFlags_Focusable) {
+        ui_context->focus_key = widget->key;
+    }
 }
 
 void UI_WidgetDestroy(UI_Widget *widget) {
@@ -696,8 +3996,145 @@ void UI_WidgetDestroy(UI_Widget *widget) {
 }
 
 void UI_WidgetDeactivate() {
-    UI_WidgetDestroy(active_widget);
-    active_widget = nullptr;
+    ui_context->active_key = 0;
+}
+
+bool UI_IsFocused(UI_Widget *widget) {
+    return widget && ui_context->focus_key != 0 && widget->key == ui_context->focus_key;
+}
+
+// NOTE: Moving focus away from the widget being edited ends the edit
+static void UI_FocusKey(uint64_t key) {
+    if (key != ui_context->focus_key && ui_context->active_key != 0 && ui_context->active_key == ui_context->focus_key) {
+        UI_WidgetDeactivate();
+    }
+    ui_context->focus_key = key;
+}
+
+void UI_SetFocus(UI_Widget *widget) {
+    UI_FocusKey(widget ? widget->key : 0);
+}
+
+static float UI_RectSize(UI_Rect rect, UI_Axis axis) {
+    return axis == UI_Axis_X ? rect.width : rect.height;
+}
+
+// NOTE: Nearest focusable rect from rect `from` in the direction sign along axis. Scores are the
+// distance between centers along the axis plus twice the gap across it. Grid lines are scanned
+// moving away from the focused rect and the scan stops once no unseen rect can score better.
+static int UI_FocusFindSpatial(UI_HitIndex *index, int from, UI_Axis axis, int sign) {
+    UI_Axis cross = axis == UI_Axis_X ? UI_Axis_Y : UI_Axis_X;
+    UI_Rect rect = index->rects[from].rect;
+    float center = rect.p[axis] + 0.5f * UI_RectSize(rect, axis);
+    float cross_min = rect.p[cross];
+    float cross_max = cross_min + UI_RectSize(rect, cross);
+
+    float origin = axis == UI_Axis_X ? index->origin_x : index->origin_y;
+    int lines = axis == UI_Axis_X ? index->columns : index->rows;
+    int across = axis == UI_Axis_X ? index->rows : index->columns;
+    int start = UI_CLAMP((int)floorf((center - origin) / UI_HIT_CELL_SIZE), 0, lines - 1);
+
+    int best = -1;
+    float best_score = INFINITY;
+    for (int line = start; line >= 0 && line < lines; line += sign) {
+        if (line != start) {
+            // NOTE: Rects first seen on this line start at or beyond its near edge
+            float edge = origin + (float)(sign > 0 ? line : line + 1) * UI_HIT_CELL_SIZE;
+            if ((float)sign * (edge - center) > best_score) {
+                break;
+            }
+        }
+        for (int k = 0; k < across; k++) {
+            int cell = axis == UI_Axis_X ? k * index->columns + line : line * index->columns + k;
+            for (int i = index->cell_start[cell]; i < index->cell_start[cell + 1]; i++) {
+                int item = index->cell_items[i];
+                UI_HitRect *hit = &index->rects[item];
+                if (item == from || hit->focus_index < 0) {
+                    continue;
+                }
+                float distance = (float)sign * (hit->rect.p[axis] + 0.5f * UI_RectSize(hit->rect, axis) - center);
+                if (distance <= 0.5f) {
+                    continue;
+                }
+                float hit_min = hit->rect.p[cross];
+                float hit_max = hit_min + UI_RectSize(hit->rect, cross);
+                float gap = UI_MAX(UI_MAX(hit_min, cross_min) - UI_MIN(hit_max, cross_max), 0.0f);
+                float score = distance + 2.0f * gap;
+                if (score < best_score) {
+                    best_score = score;
+                    best = item;
+                }
+            }
+        }
+    }
+    return best;
+}
+
+// NOTE: Hit index of the viewport a focus order entry was placed in, null if it was clipped away
+static UI_HitIndex *UI_FocusHitIndex(int position) {
+    for (int i = 0; i < UI_MAX_VIEWPORTS; i++) {
+        UI_Viewport *viewport = ui_context->viewports[i];
+        if (viewport && viewport->built && viewport->hit_index.focus_rects[position] >= 0) {
+            return &viewport->hit_index;
+        }
+    }
+    return nullptr;
+}
+
+// NOTE: Handles Tab/Shift+Tab and arrow keys that no widget consumed this frame. Runs after
+// the frame's widgets were swapped into old_widgets, so the focused widget's focus_index and
+// the hit index both describe the frame that was just built.
+static void UI_FocusNavigate() {
+    if (ui_context->focus_key != 0 && ui_context->old_widgets.find(ui_context->focus_key) == ui_context->old_widgets.end()) {
+        ui_context->focus_key = 0;
+    }
+
+    std::vector<uint64_t> &order = ui_context->focus_order;
+    int count = (int)order.size();
+    if (count == 0) {
+        return;
+    }
+    for (UI_Event *event = UI_FirstEvent(); event; event = UI_NextEvent(event)) {
+        if (event->type != UI_EventType_KeyDown) {
+            continue;
+        }
+        int position = -1;
+        if (ui_context->focus_key != 0) {
+            position = ui_context->old_widgets[ui_context->focus_key]->focus_index;
+        }
+
+        int target = -1;
+        switch (event->key) {
+        case VK_TAB:
+            if (event->modifiers & UI_Modifier_Shift) {
+                target = position < 0 ? count - 1 : (position + count - 1) % count;
+            } else {
+                target = position < 0 ? 0 : (position + 1) % count;
+            }
+            break;
+        case VK_LEFT:
+        case VK_RIGHT:
+        case VK_UP:
+        case VK_DOWN: {
+            UI_HitIndex *index = position < 0 ? nullptr : UI_FocusHitIndex(position);
+            if (!index) {
+                continue;
+            }
+            UI_Axis axis = (event->key == VK_LEFT || event->key == VK_RIGHT) ? UI_Axis_X : UI_Axis_Y;
+            int sign = (event->key == VK_LEFT || event->key == VK_UP) ? -1 : 1;
+            int item = UI_FocusFindSpatial(index, index->focus_rects[position], axis, sign);
+            if (item < 0) {
+                continue;
+            }
+            target = index->rects[item].focus_index;
+            break;
+        }
+        default:
+            continue;
+        }
+        UI_FocusKey(order[target]);
+        UI_ConsumeEvent(event);
+    }
 }
 
 UI_Widget *UI_WidgetBuild(char *label, UI_WidgetFlags flags) {
@@ -709,6 +4146,23 @@ UI_Widget *UI_WidgetBuild(char *label, UI_WidgetFlags flags) {
         widget = UI_WidgetCreate(label);
     }
     widget->flags = flags;
+    widget->text_layout = nullptr;
+    widget->text_edit = nullptr;
+    widget->text_file = nullptr;
+    widget->text_document = nullptr;
+    widget->log = nullptr;
+    widget->image = nullptr;
+    widget->text_run = nullptr;
+    widget->content_prepared = false;
+
+    widget->focus_index = -1;
+    if (flags & UI_WidgetFlags_Focusable) {
+        widget->focus_index = (int)ui_context->focus_order.size();
+        ui_context->focus_order.push_back(widget->key);
+        if (widget->key == ui_context->focus_key) {
+            widget->flags = (UI_WidgetFlags)(widget->flags | UI_WidgetFlags_DrawFocusEffects);
+        }
+    }
 
     widget->first = widget->last = nullptr;
     widget->next = widget->prev = nullptr;
@@ -724,40 +4178,41 @@ UI_Widget *UI_WidgetBuild(char *label, UI_WidgetFlags flags) {
             parent->first = parent->last = widget;
         }
     } else {
-        ui_state.root = widget;
+        ui_context->viewport->root = widget;
     }
     widget->parent = parent;
 
-    widget->bg_color = ui_state.bg_color_stack.top();
-    widget->border_color = ui_state.border_color_stack.top();
-    widget->text_color = ui_state.text_color_stack.top();
-    
-    ui_state.widget_list.push_back(widget);
+    widget->bg_color = ui_context->bg_color_stack.top();
+    widget->border_color = ui_context->border_color_stack.top();
+    widget->text_color = ui_context->text_color_stack.top();
+    widget->font = ui_context->font_stack.top();
+
+    ui_context->widget_list.push_back(widget);
     return widget; 
 }
 
 void UI_PushPrefSize(UI_Axis axis, UI_Size size) {
     switch (axis) {
     case UI_Axis_X:
-        ui_state.pref_width_stack.push(size);
+        ui_context->pref_width_stack.push(size);
         break;
     case UI_Axis_Y:
-        ui_state.pref_height_stack.push(size);
+        ui_context->pref_height_stack.push(size);
         break;
     }
-    // ui_state.pref_size_stack.push(size);
+    // ui_context->pref_size_stack.push(size);
 }
 
 UI_Size UI_PopPrefSize(UI_Axis axis) {
     UI_Size size = {};
     switch (axis) {
     case UI_Axis_X:
-        size = !ui_state.pref_width_stack.empty() ? ui_state.pref_width_stack.top() : size;
-        if (!ui_state.pref_width_stack.empty()) ui_state.pref_width_stack.pop();
+        size = !ui_context->pref_width_stack.empty() ? ui_context->pref_width_stack.top() : size;
+        if (!ui_context->pref_width_stack.empty()) ui_context->pref_width_stack.pop();
         break;
     case UI_Axis_Y:
-        size = !ui_state.pref_height_stack.empty() ? ui_state.pref_height_stack.top() : size;
-        if (!ui_state.pref_height_stack.empty()) ui_state.pref_height_stack.pop();
+        size = !ui_context->pref_height_stack.empty() ? ui_context->pref_height_stack.top() : size;
+        if (!ui_context->pref_height_stack.empty()) ui_context->pref_height_stack.pop();
     }
     return size;
 }
@@ -766,10 +4221,10 @@ UI_Size UI_GetNextPrefSize(UI_Axis axis) {
     UI_Size size{};
     switch (axis) {
     case UI_Axis_X:
-        size = !ui_state.pref_width_stack.empty() ? ui_state.pref_width_stack.top() : size;
+        size = !ui_context->pref_width_stack.empty() ? ui_context->pref_width_stack.top() : size;
         break;
     case UI_Axis_Y:
-        size = !ui_state.pref_height_stack.empty() ? ui_state.pref_height_stack.top() : size;
+        size = !ui_context->pref_height_stack.empty() ? ui_context->pref_height_stack.top() : size;
         break;
     }
     return size;
@@ -783,184 +4238,863 @@ void UI_LayoutCalcSizesRigid(UI_Widget *widget, UI_Axis axis) {
         break;
     case UI_Size_TextBounds: {
         float padding = widget->pref_size[axis].value;
-        size = (axis == UI_Axis_X) ? (UI_GetTextWidth(widget->label, &ui_state.font_atlas) + padding) : UI_GetTextHeight(widget->label, &ui_state.font_atlas);
+        FontAtlas *font = UI_GetFont(widget->font);
+        if (widget->text_layout && axis == UI_Axis_Y) {
+            // NOTE: Width is resolved before the Y pass, so wrap to it now
+            UI_TextLayoutWrap(widget->text_layout, widget->actual_size[UI_Axis_X] - 2.0f * UI_TEXT_MARGIN);
+            size = UI_TextLayoutHeight(widget->text_layout) + padding;
+            break;
+        }
+        if (axis == UI_Axis_X) {
+            widget->text_run = UI_ShapeText(widget->label, (int)strlen(widget->label), font);
+            size = roundf(widget->text_run->width) + padding;
+        } else {
+            size = UI_GetTextHeight(widget->label, font);
+        }
+        break;
+    }
+    }
+
+    widget->actual_size[axis] = size;
+
+    for (UI_Widget *child = widget->first; child != nullptr; child = child->next) {
+        UI_LayoutCalcSizesRigid(child, axis);
+    }
+}
+
+void UI_LayoutCalcSizesUpwardDependent(UI_Widget *widget, UI_Axis axis) {
+    switch (widget->pref_size[axis].type) {
+    case UI_Size_ParentPercent: {
+        UI_Widget *rigid = nullptr;
+        for (UI_Widget *p = widget->parent; p != nullptr; p = p->parent) {
+            UI_Size size = p->pref_size[axis];
+            if (size.type == UI_Size_Pixels || size.type == UI_Size_TextBounds) {
+                rigid = p;
+                break;
+            }
+        }
+        widget->actual_size[axis] = widget->pref_size[axis].value * rigid->actual_size[axis];
+        break;
+    }
+    default:
+        break;
+    }
+
+    for (UI_Widget *child = widget->first; child != nullptr; child = child->next) {
+        UI_LayoutCalcSizesUpwardDependent(child, axis);
+    }
+}
+
+void UI_LayoutCalcSizesDownwardDependent(UI_Widget *widget, UI_Axis axis) {
+    float children_sum = 0;
+    for (UI_Widget *child = widget->first; child != nullptr; child = child->next) {
+        UI_LayoutCalcSizesDownwardDependent(child, axis);
+        children_sum += child->actual_size[axis];
+    }
+        
+    switch (widget->pref_size[axis].type) {
+    case UI_Size_ChildrenSum:
+        widget->actual_size[axis] = children_sum;
         break;
     }
+}
+
+void UI_LayoutResolveSize(UI_Widget *widget, UI_Axis axis) {
+    UI_Widget *parent = widget->parent;
+    if (parent) {
+        widget->actual_size[axis] = UI_CLAMP(widget->actual_size[axis], 0, parent->actual_size[axis]);
+    }
+
+    for (UI_Widget *child = widget->first; child != nullptr; child = child->next) {
+        UI_LayoutResolveSize(child, axis);
+    }
+}
+
+void UI_LayoutPlaceWidgets(UI_Widget *widget, UI_Axis axis) {
+    float current_pos = 0;
+    for (UI_Widget *child = widget->first; child != nullptr; child = child->next) {
+        child->relative_pos[axis] = current_pos;
+
+        // NOTE: Move relative position in the layout axis for children
+        if (axis == widget->child_layout_axis) {
+            current_pos += child->actual_size[axis]; 
+        }
+    }
+
+    float absolute_pos = 0;
+    for (UI_Widget *p = widget; p != nullptr; p = p->parent) {
+        absolute_pos += p->relative_pos[axis];
+    }
+
+    widget->rect.p[axis] = absolute_pos;
+    widget->rect.width = widget->actual_size[UI_Axis_X];
+    widget->rect.height = widget->actual_size[UI_Axis_Y];
+
+    for (UI_Widget *child = widget->first; child != nullptr; child = child->next) {
+        UI_LayoutPlaceWidgets(child, axis);
+    }
+}
+
+void UI_LayoutRoot(UI_Widget *root, UI_Axis axis) {
+    UI_LayoutCalcSizesRigid(root, axis);
+    UI_LayoutCalcSizesUpwardDependent(root, axis);
+    UI_LayoutCalcSizesDownwardDependent(root, axis);
+    UI_LayoutResolveSize(root, axis);
+    UI_LayoutPlaceWidgets(root, axis);
+}
+
+// NOTE: Input recording and replay
+
+static void UI_RecordWrite(FILE *file, void *data, size_t size) {
+    fwrite(data, size, 1, file);
+}
+
+static bool UI_RecordRead(FILE *file, void *data, size_t size) {
+    return fread(data, size, 1, file) == 1;
+}
+
+// NOTE: Events are packed field by field, 25 bytes each
+static void UI_RecordWriteEvent(FILE *file, UI_Event *event) {
+    uint8_t viewport = (uint8_t)event->viewport;
+    uint8_t type = (uint8_t)event->type;
+    uint8_t modifiers = (uint8_t)event->modifiers;
+    uint16_t key = (uint16_t)event->key;
+    int32_t x = event->x;
+    int32_t y = event->y;
+    UI_RecordWrite(file, &type, 1);
+    UI_RecordWrite(file, &modifiers, 1);
+    UI_RecordWrite(file, &key, 2);
+    UI_RecordWrite(file, &event->character, 4);
+    UI_RecordWrite(file, &x, 4);
+    UI_RecordWrite(file, &y, 4);
+    UI_RecordWrite(file, &event->wheel, 4);
+    UI_RecordWrite(file, &event->time, 4);
+    UI_RecordWrite(file, &viewport, 1);
+}
+
+static bool UI_RecordReadEvent(FILE *file, UI_Event *event) {
+    uint8_t type, modifiers, viewport;
+    uint16_t key;
+    int32_t x, y;
+    *event = UI_Event{};
+    bool ok = UI_RecordRead(file, &type, 1) && UI_RecordRead(file, &modifiers, 1) && UI_RecordRead(file, &key, 2) &&
+        UI_RecordRead(file, &event->character, 4) && UI_RecordRead(file, &x, 4) && UI_RecordRead(file, &y, 4) &&
+        UI_RecordRead(file, &event->wheel, 4) && UI_RecordRead(file, &event->time, 4) && UI_RecordRead(file, &viewport, 1);
+    event->type = (UI_EventType)type;
+    event->modifiers = modifiers;
+    event->key = key;
+    event->x = x;
+    event->y = y;
+    // NOTE: Events of viewports the replaying build doesn't have go to the main one
+    event->viewport = viewport < UI_MAX_VIEWPORTS ? viewport : 0;
+    return ok;
+}
+
+// NOTE: Writes the frame descriptor and every event the frame is about to see
+static void UI_RecordFrame(FILE *file, UI_FrameDesc desc) {
+    UI_EventQueue *queue = &ui_context->events;
+    uint32_t count = queue->frame_end - queue->head;
+    UI_RecordWrite(file, &desc.width, 4);
+    UI_RecordWrite(file, &desc.height, 4);
+    UI_RecordWrite(file, &desc.time, 8);
+    UI_RecordWrite(file, &count, 4);
+    for (uint32_t position = queue->head; position != queue->frame_end; position++) {
+        UI_RecordWriteEvent(file, &queue->events[position & (UI_EVENT_QUEUE_SIZE - 1)]);
+    }
+}
+
+bool UI_StartRecording(char *path) {
+    UI_StopRecording();
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        printf("Could not open %s for recording\n", path);
+        return false;
+    }
+    uint32_t header[2] = {UI_RECORD_MAGIC, UI_RECORD_VERSION};
+    UI_RecordWrite(file, header, sizeof(header));
+    ui_context->record_file = file;
+    return true;
+}
+
+void UI_StopRecording() {
+    if (ui_context->record_file) {
+        fclose(ui_context->record_file);
+        ui_context->record_file = nullptr;
+    }
+}
+
+// NOTE: Feeds a recording back frame by frame as fast as possible. build_frame runs the
+// application's widget code between UI_BeginFrame and UI_EndFrame. Per-frame timings go
+// to report as CSV, with averages and maximums printed at the end.
+bool UI_Replay(char *path, void (*build_frame)(void *user), void *user, FILE *report) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        printf("Could not open recording %s\n", path);
+        return false;
+    }
+    uint32_t header[2];
+    if (!UI_RecordRead(file, header, sizeof(header)) || header[0] != UI_RECORD_MAGIC || header[1] != UI_RECORD_VERSION) {
+        printf("%s is not a recording\n", path);
+        fclose(file);
+        return false;
+    }
+
+    if (report) {
+        fprintf(report, "frame,build_ms,layout_ms,tessellate_ms,render_ms\n");
+    }
+    UI_FrameTimings total{};
+    UI_FrameTimings worst{};
+    int frame_count = 0;
+    for (;;) {
+        UI_FrameDesc desc;
+        uint32_t count;
+        if (!UI_RecordRead(file, &desc.width, 4) || !UI_RecordRead(file, &desc.height, 4) ||
+            !UI_RecordRead(file, &desc.time, 8) || !UI_RecordRead(file, &count, 4)) {
+            break;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            UI_Event event;
+            if (!UI_RecordReadEvent(file, &event)) break;
+            UI_PushEvent(event);
+        }
+
+        UI_BeginFrame(desc);
+        build_frame(user);
+        UI_EndFrame();
+
+        UI_FrameTimings t = ui_context->timings;
+        if (report) {
+            fprintf(report, "%d,%.4f,%.4f,%.4f,%.4f\n", frame_count, t.build * 1000.0, t.layout * 1000.0, t.tessellate * 1000.0, t.render * 1000.0);
+        }
+        total.build += t.build;
+        total.layout += t.layout;
+        total.tessellate += t.tessellate;
+        total.render += t.render;
+        worst.build = UI_MAX(worst.build, t.build);
+        worst.layout = UI_MAX(worst.layout, t.layout);
+        worst.tessellate = UI_MAX(worst.tessellate, t.tessellate);
+        worst.render = UI_MAX(worst.render, t.render);
+        frame_count++;
+    }
+    fclose(file);
+
+    if (frame_count > 0) {
+        double n = (double)frame_count;
+        printf("Replayed %d frames (avg / max ms)\n", frame_count);
+        printf("  build      %.4f / %.4f\n", total.build * 1000.0 / n, worst.build * 1000.0);
+        printf("  layout     %.4f / %.4f\n", total.layout * 1000.0 / n, worst.layout * 1000.0);
+        printf("  tessellate %.4f / %.4f\n", total.tessellate * 1000.0 / n, worst.tessellate * 1000.0);
+        printf("  render     %.4f / %.4f\n", total.render * 1000.0 / n, worst.render * 1000.0);
+    }
+    return true;
+}
+
+void UI_NewFrame(HWND window) {
+    RECT client_rect;
+    GetClientRect(window, &client_rect);
+    UI_FrameDesc desc;
+    desc.width = (float)(client_rect.right - client_rect.left);
+    desc.height = (float)(client_rect.bottom - client_rect.top);
+    desc.time = UI_GetTime();
+    UI_BeginFrame(desc);
+}
+
+// NOTE: Builds a viewport's root and makes it the parent of the widgets that follow
+static void UI_ViewportBegin(UI_Viewport *viewport, char *label, UI_Vec2 dim) {
+    viewport->draw_data.target_size = dim;
+    viewport->draw_data.target_pos = {0.0f, 0.0f};
+    viewport->draw_data.vertex_count = 0;
+    viewport->built = true;
+    ui_context->viewport = viewport;
+
+    UI_Widget *root = UI_WidgetBuild(label, (UI_WidgetFlags)(UI_WidgetFlags_DrawBackground | UI_WidgetFlags_DrawBorder));
+    root->child_layout_axis = UI_Axis_Y;
+    root->rect = {0, 0, dim.x, dim.y};
+    root->pref_size[UI_Axis_X] = UI_SIZE_FIXED(dim.x);
+    root->pref_size[UI_Axis_Y] = UI_SIZE_FIXED(dim.y);
+    root->bg_color = WHITE;
+    root->border_color = WHITE;
+    ui_context->parent_stack.push(root);
+}
+
+void UI_BeginFrame(UI_FrameDesc desc) {
+    ui_context->time = desc.time;
+    ui_context->next_frame_time = INFINITY;
+
+    // Clear layout stacks
+    STACK_CLEAR(ui_context->parent_stack);
+    STACK_CLEAR(ui_context->bg_color_stack);
+    STACK_CLEAR(ui_context->pref_width_stack);
+    STACK_CLEAR(ui_context->pref_height_stack);
+    STACK_CLEAR(ui_context->font_stack);
+
+    if (ui_context->resources->font_count.load(std::memory_order_acquire) == 0) {
+        UI_LoadFont(UI_DEFAULT_FONT_PATH, UI_DEFAULT_FONT_SIZE);
+    }
+
+    ui_context->bg_color_stack.push(WHITE);
+    ui_context->border_color_stack.push(GRAY);
+    ui_context->text_color_stack.push(BLACK);
+    ui_context->font_stack.push(0);
+
+    for (int i = 0; i < UI_MAX_VIEWPORTS; i++) {
+        if (ui_context->viewports[i]) {
+            ui_context->viewports[i]->built = false;
+        }
+    }
+    UI_ViewportBegin(ui_context->viewports[0], "~Root", UI_Vec2(desc.width, desc.height));
+    ui_context->focus_order.clear();
+
+    for (int i = 0; i < (int)ui_context->logs.size(); i++) {
+        UI_LogDrain(ui_context->logs[i]);
+    }
+    UI_ImagesUpdate();
+
+    UI_BeginEvents();
+    if (ui_context->record_file) {
+        UI_RecordFrame(ui_context->record_file, desc);
+    }
+    ui_context->hot_key = UI_HitTest((float)ui_context->mouse_x, (float)ui_context->mouse_y);
+
+    // DX11
+    UI_DX11NewFrame();
+    ui_context->build_start = UI_GetTime();
+}
+
+static void UI_DrawWidgetContent(UI_Widget *widget) {
+    if (widget->image) {
+        UI_DrawImage(widget);
+    } else if (widget->text_document) {
+        UI_DrawTextDocument(widget);
+    } else if (widget->text_file) {
+        UI_DrawTextView(widget);
+    } else if (widget->log) {
+        UI_DrawLogView(widget);
+    } else if (widget->text_edit) {
+        UI_DrawTextEdit(widget);
+    } else if (widget->text_layout) {
+        UI_DrawTextLayout(widget->text_layout, UI_Vec2(widget->rect.x + UI_TEXT_MARGIN, widget->rect.y));
+    } else {
+        FontAtlas *font = UI_GetFont(widget->font);
+        UI_TextRun *run = widget->text_run ? widget->text_run : UI_ShapeText(widget->label, (int)strlen(widget->label), font);
+        UI_DrawTextRun(widget->label, run, font, UI_Vec2(widget->rect.x + widget->pref_size[UI_Axis_X].value / 2.0f, widget->rect.y));
+    }
+}
+
+// NOTE: Draws one widget without its children
+static void UI_DrawWidget(UI_Widget *widget) {
+    if (widget->flags & UI_WidgetFlags_DrawBackground) {
+        UI_DrawRect(widget->rect, widget->bg_color);
+    }
+    if (widget->flags & UI_WidgetFlags_DrawBorder) {
+        UI_DrawRectOutline(widget->rect, widget->border_color);
+    }
+    if (widget->flags & UI_WidgetFlags_DrawText) {
+        if (widget->content_prepared) {
+            UI_Draw_Data *prepass = &ui_context->draw_prepass;
+            UI_Vertex *vertices = UI_ReserveVertices(UI_GetDrawList(), widget->content_count);
+            memcpy(vertices, prepass->vertex_list + widget->content_first, widget->content_count * sizeof(UI_Vertex));
+        } else {
+            UI_DrawWidgetContent(widget);
+        }
+    }
+    if (widget->flags & UI_WidgetFlags_DrawHotEffects) {
+        UI_DrawRect(widget->rect, UI_Vec4(0.25f, 0.75f, 1.0f, 0.15f));
+    }
+    if (widget->flags & UI_WidgetFlags_DrawActiveEffects) {
+        UI_DrawRect(widget->rect, UI_Vec4(0.25f, 0.75f, 1.0f, 0.15f));
+    }
+    if (widget->flags & UI_WidgetFlags_DrawFocusEffects) {
+        UI_DrawRectOutline(widget->rect, UI_Vec4(0.25f, 0.5f, 1.0f, 1.0f));
+    }
+}
+
+void UI_DrawLayoutRoot(UI_Widget *widget) {
+    UI_DrawWidget(widget);
+    for (UI_Widget *child = widget->first; child != nullptr; child = child->next) {
+        UI_DrawLayoutRoot(child);
+    }
+}
+
+// NOTE: Serial pass before a parallel draw. Content that shapes text, rasterizes glyphs or
+// asks for frames is tessellated into draw_prepass here, and labels layout didn't measure
+// are shaped, so the threads only read the text caches.
+static void UI_DrawPrepare(UI_Widget *widget) {
+    if (widget->flags & UI_WidgetFlags_DrawText) {
+        if (widget->text_document || widget->text_file || widget->text_edit || widget->log) {
+            UI_Draw_Data *prepass = &ui_context->draw_prepass;
+            widget->content_first = prepass->vertex_count;
+            ui_draw_list = prepass;
+            UI_DrawWidgetContent(widget);
+            ui_draw_list = nullptr;
+            widget->content_count = prepass->vertex_count - widget->content_first;
+            widget->content_prepared = true;
+        } else if (!widget->text_layout && !widget->text_run && !widget->image) {
+            widget->text_run = UI_ShapeText(widget->label, (int)strlen(widget->label), UI_GetFont(widget->font));
+        }
+    }
+    for (UI_Widget *child = widget->first; child != nullptr; child = child->next) {
+        UI_DrawPrepare(child);
+    }
+}
+
+static void UI_DrawTessellateChunk(void *data, int index) {
+    UI_DrawSplit *split = (UI_DrawSplit *)data;
+    UI_DrawChunk *chunk = &split->chunks[index];
+    chunk->draw_data.vertex_count = 0;
+    ui_draw_list = &chunk->draw_data;
+    for (int i = chunk->first; i < chunk->last; i++) {
+        UI_DrawItem *item = &split->items[i];
+        if (item->self_only) {
+            UI_DrawWidget(item->widget);
+        } else {
+            UI_DrawLayoutRoot(item->widget);
+        }
+    }
+    ui_draw_list = nullptr;
+}
+
+static void UI_DrawCopyChunk(void *data, int index) {
+    UI_DrawSplit *split = (UI_DrawSplit *)data;
+    UI_DrawChunk *chunk = &split->chunks[index];
+    UI_Vertex *vertices = ui_context->viewport->draw_data.vertex_list + chunk->offset;
+    memcpy(vertices, chunk->draw_data.vertex_list, chunk->draw_data.vertex_count * sizeof(UI_Vertex));
+}
+
+void UI_SetDrawThreads(int count) {
+    ui_context->draw_threads = count;
+}
+
+static void UI_DrawSplitFree(UI_DrawSplit *split) {
+    for (int i = 0; i < (int)split->chunks.size(); i++) {
+        free(split->chunks[i].draw_data.vertex_list);
+    }
+    split->chunks.clear();
+}
+
+// NOTE: Tessellates the tree into draw_data, splitting it across the job system when it is
+// large enough. Subtrees are expanded level by level into an in-order list of items until
+// there are enough to balance, then consecutive items are grouped into chunks.
+static void UI_DrawTree(UI_Widget *root) {
+    int thread_count = ui_context->draw_threads;
+    if (thread_count <= 0) {
+        thread_count = UI_JobThreadCount();
+    }
+    if (thread_count == 1 || (int)ui_context->widget_list.size() < UI_PARALLEL_DRAW_MIN_WIDGETS) {
+        UI_DrawLayoutRoot(root);
+        return;
     }
 
-    widget->actual_size[axis] = size;
+    ui_context->draw_prepass.vertex_count = 0;
+    UI_DrawPrepare(root);
+
+    UI_DrawSplit *split = &ui_context->draw_split;
+    int chunk_target = thread_count * UI_DRAW_CHUNKS_PER_THREAD;
+    std::vector<UI_DrawItem> &items = split->items;
+    std::vector<UI_DrawItem> expanded;
+    items.clear();
+    items.push_back({root, false});
+    while ((int)items.size() < chunk_target) {
+        expanded.clear();
+        bool expanded_any = false;
+        for (int i = 0; i < (int)items.size(); i++) {
+            UI_DrawItem item = items[i];
+            if (item.self_only || !item.widget->first) {
+                expanded.push_back(item);
+                continue;
+            }
+            expanded.push_back({item.widget, true});
+            for (UI_Widget *child = item.widget->first; child; child = child->next) {
+                expanded.push_back({child, false});
+            }
+            expanded_any = true;
+        }
+        items.swap(expanded);
+        if (!expanded_any) break;
+    }
 
-    for (UI_Widget *child = widget->first; child != nullptr; child = child->next) {
-        UI_LayoutCalcSizesRigid(child, axis);
+    int chunk_count = UI_MIN(chunk_target, (int)items.size());
+    if ((int)split->chunks.size() < chunk_count) {
+        split->chunks.resize(chunk_count, UI_DrawChunk{});
+    }
+    for (int i = (int)split->chunks.size() - 1; i >= chunk_count; i--) {
+        free(split->chunks[i].draw_data.vertex_list);
+        split->chunks.pop_back();
+    }
+    for (int i = 0; i < chunk_count; i++) {
+        split->chunks[i].first = (int)((int64_t)items.size() * i / chunk_count);
+        split->chunks[i].last = (int)((int64_t)items.size() * (i + 1) / chunk_count);
+    }
+    UI_ParallelFor(chunk_count, UI_DrawTessellateChunk, split);
+
+    // NOTE: Chunks are copied into place in parallel too, the copy is as large as the draw list
+    UI_Draw_Data *draw_data = &ui_context->viewport->draw_data;
+    int offset = draw_data->vertex_count;
+    for (int i = 0; i < chunk_count; i++) {
+        split->chunks[i].offset = offset;
+        offset += split->chunks[i].draw_data.vertex_count;
     }
+    UI_ReserveVertices(draw_data, offset - draw_data->vertex_count);
+    UI_ParallelFor(chunk_count, UI_DrawCopyChunk, split);
 }
 
-void UI_LayoutCalcSizesUpwardDependent(UI_Widget *widget, UI_Axis axis) {
-    switch (widget->pref_size[axis].type) {
-    case UI_Size_ParentPercent: {
-        UI_Widget *rigid = nullptr;
-        for (UI_Widget *p = widget->parent; p != nullptr; p = p->parent) {
-            UI_Size size = p->pref_size[axis];
-            if (size.type == UI_Size_Pixels || size.type == UI_Size_TextBounds) {
-                rigid = p;
-                break;
+static void UI_DX11ReleaseDeviceObjects(DX11_Backend_Data *bd) {
+    if (bd->rasterizer_state) bd->rasterizer_state->Release();
+    if (bd->blend_state) bd->blend_state->Release();
+    if (bd->depth_stencil_state) bd->depth_stencil_state->Release();
+    if (bd->vertex_buffer) bd->vertex_buffer->Release();
+    if (bd->constant_buffer) bd->constant_buffer->Release();
+    if (bd->input_layout) bd->input_layout->Release();
+    if (bd->vertex_shader) bd->vertex_shader->Release();
+    if (bd->pixel_shader) bd->pixel_shader->Release();
+    if (bd->font_texture_view) bd->font_texture_view->Release();
+    if (bd->font_texture) bd->font_texture->Release();
+    if (bd->font_sampler) bd->font_sampler->Release();
+    if (bd->image_texture_view) bd->image_texture_view->Release();
+    if (bd->image_texture) bd->image_texture->Release();
+    if (bd->image_sampler) bd->image_sampler->Release();
+}
+
+// NOTE: Render thread
+
+static void UI_RenderWorker(UI_RenderQueue *queue) {
+    ui_context = queue->context;
+    DX11_Backend_Data *backend = &queue->context->backend_data;
+    for (;;) {
+        uint64_t rendered = queue->rendered.load(std::memory_order_relaxed);
+        if (rendered == queue->submitted.load(std::memory_order_acquire)) {
+            if (queue->quit.load()) {
+                return;
             }
+            WaitForSingleObject(queue->submit_event, INFINITE);
+            continue;
         }
-        widget->actual_size[axis] = widget->pref_size[axis].value * rigid->actual_size[axis];
-        break;
-    }
-    default:
-        break;
+
+        UI_RenderFrame *frame = &queue->frames[rendered % UI_RENDER_QUEUE_SIZE];
+        if (frame->atlas_dirty && backend->device) {
+            UI_DX11UploadAtlas(backend, frame->atlas_bitmap);
+        }
+        if (frame->image_dirty.x0 < frame->image_dirty.x1 && backend->device) {
+            UI_DX11UploadImageAtlas(backend, frame->image_bitmap, frame->image_dirty);
+        }
+        for (int i = 0; i < UI_MAX_VIEWPORTS; i++) {
+            if (frame->viewports[i]) {
+                queue->render_frame(frame->viewports[i], &frame->draw_data[i], queue->user);
+            }
+        }
+
+        queue->rendered.store(rendered + 1, std::memory_order_release);
+        SetEvent(queue->release_event);
     }
+}
 
-    for (UI_Widget *child = widget->first; child != nullptr; child = child->next) {
-        UI_LayoutCalcSizesUpwardDependent(child, axis);
+static void UI_MarkAtlasesDirty() {
+    UI_Resources *resources = ui_context->resources;
+    {
+        std::lock_guard<std::mutex> lock(resources->atlas_mutex);
+        ui_context->atlas_dirty = true;
+    }
+    std::lock_guard<std::mutex> lock(resources->image_mutex);
+    if (resources->image_atlas.bitmap) {
+        ui_context->image_dirty = UI_DirtyRect{0, 0, UI_IMAGE_ATLAS_SIZE, UI_IMAGE_ATLAS_SIZE};
     }
 }
 
-void UI_LayoutCalcSizesDownwardDependent(UI_Widget *widget, UI_Axis axis) {
-    float children_sum = 0;
-    for (UI_Widget *child = widget->first; child != nullptr; child = child->next) {
-        UI_LayoutCalcSizesDownwardDependent(child, axis);
-        children_sum += child->actual_size[axis];
+// NOTE: From here on UI_EndFrame hands frames to render_frame on a thread of their own, so
+// building the next frame overlaps drawing this one. The device context belongs to the render
+// thread until UI_StopRenderThread.
+void UI_StartRenderThread(UI_RenderFunc *render_frame, void *user) {
+    assert(!ui_context->render_queue);
+    UI_RenderQueue *queue = new UI_RenderQueue();
+    queue->context = ui_context;
+    queue->render_frame = render_frame;
+    queue->user = user;
+    queue->submit_event = CreateEventA(NULL, FALSE, FALSE, NULL);
+    queue->release_event = CreateEventA(NULL, FALSE, FALSE, NULL);
+    // NOTE: The first frame on the thread uploads the whole atlases
+    UI_MarkAtlasesDirty();
+    queue->thread = std::thread(UI_RenderWorker, queue);
+    ui_context->render_queue = queue;
+}
+
+// NOTE: Renders every submitted frame before returning
+void UI_StopRenderThread() {
+    UI_RenderQueue *queue = ui_context->render_queue;
+    if (!queue) {
+        return;
     }
-        
-    switch (widget->pref_size[axis].type) {
-    case UI_Size_ChildrenSum:
-        widget->actual_size[axis] = children_sum;
-        break;
+    queue->quit = true;
+    SetEvent(queue->submit_event);
+    queue->thread.join();
+    for (int i = 0; i < UI_RENDER_QUEUE_SIZE; i++) {
+        for (int j = 0; j < UI_MAX_VIEWPORTS; j++) {
+            free(queue->frames[i].draw_data[j].vertex_list);
+        }
+        free(queue->frames[i].atlas_bitmap);
+        free(queue->frames[i].image_bitmap);
     }
+    CloseHandle(queue->submit_event);
+    CloseHandle(queue->release_event);
+    delete queue;
+    ui_context->render_queue = nullptr;
+    UI_MarkAtlasesDirty();
 }
 
-void UI_LayoutResolveSize(UI_Widget *widget, UI_Axis axis) {
-    UI_Widget *parent = widget->parent;
-    if (parent) {
-        widget->actual_size[axis] = UI_CLAMP(widget->actual_size[axis], 0, parent->actual_size[axis]);
+// NOTE: Waits until the render thread is done with every submitted frame
+static void UI_RenderQueueFlush(UI_RenderQueue *queue) {
+    uint64_t submitted = queue->submitted.load(std::memory_order_relaxed);
+    while (queue->rendered.load(std::memory_order_acquire) != submitted) {
+        WaitForSingleObject(queue->release_event, INFINITE);
     }
+}
 
-    for (UI_Widget *child = widget->first; child != nullptr; child = child->next) {
-        UI_LayoutResolveSize(child, axis);
+// NOTE: The device context and the swap chain are free on the calling thread until the next
+// UI_EndFrame, e.g. to resize the swap chain's buffers. Does nothing without a render thread,
+// or from window messages sent before there is a context.
+void UI_FlushRenderThread() {
+    if (ui_context && ui_context->render_queue) {
+        UI_RenderQueueFlush(ui_context->render_queue);
     }
 }
 
-void UI_LayoutPlaceWidgets(UI_Widget *widget, UI_Axis axis) {
-    float current_pos = 0;
-    for (UI_Widget *child = widget->first; child != nullptr; child = child->next) {
-        child->relative_pos[axis] = current_pos;
+// NOTE: Waits for a free slot, then swaps the finished draw lists into it
+static void UI_SubmitFrame(UI_RenderQueue *queue) {
+    uint64_t submitted = queue->submitted.load(std::memory_order_relaxed);
+    while (submitted - queue->rendered.load(std::memory_order_acquire) >= UI_RENDER_QUEUE_SIZE) {
+        WaitForSingleObject(queue->release_event, INFINITE);
+    }
 
-        // NOTE: Move relative position in the layout axis for children
-        if (axis == widget->child_layout_axis) {
-            current_pos += child->actual_size[axis]; 
+    UI_RenderFrame *frame = &queue->frames[submitted % UI_RENDER_QUEUE_SIZE];
+    for (int i = 0; i < UI_MAX_VIEWPORTS; i++) {
+        UI_Viewport *viewport = ui_context->viewports[i];
+        frame->viewports[i] = nullptr;
+        if (viewport && viewport->built) {
+            UI_Draw_Data draw_data = frame->draw_data[i];
+            frame->draw_data[i] = viewport->draw_data;
+            viewport->draw_data = draw_data;
+            frame->viewports[i] = viewport;
         }
     }
 
-    float absolute_pos = 0;
-    for (UI_Widget *p = widget; p != nullptr; p = p->parent) {
-        absolute_pos += p->relative_pos[axis];
+    // NOTE: The atlases are copied under their locks, other contexts of the resources may be
+    // packing into them
+    UI_Resources *resources = ui_context->resources;
+    {
+        std::lock_guard<std::mutex> lock(resources->atlas_mutex);
+        UI_TextureAtlas *atlas = &resources->atlas;
+        frame->atlas_dirty = ui_context->atlas_dirty;
+        if (ui_context->atlas_dirty) {
+            if (!frame->atlas_bitmap) {
+                frame->atlas_bitmap = (unsigned char *)malloc(atlas->width * atlas->height);
+            }
+            memcpy(frame->atlas_bitmap, atlas->bitmap, atlas->width * atlas->height);
+            ui_context->atlas_dirty = false;
+        }
     }
 
-    widget->rect.p[axis] = absolute_pos;
-    widget->rect.width = widget->actual_size[UI_Axis_X];
-    widget->rect.height = widget->actual_size[UI_Axis_Y];
-
-    for (UI_Widget *child = widget->first; child != nullptr; child = child->next) {
-        UI_LayoutPlaceWidgets(child, axis);
+    // NOTE: Only the texels that changed are copied, the slot holds the rest from earlier frames
+    // or zeros where nothing was written yet
+    {
+        std::lock_guard<std::mutex> lock(resources->image_mutex);
+        UI_ImageAtlas *images = &resources->image_atlas;
+        UI_DirtyRect dirty = ui_context->image_dirty;
+        frame->image_dirty = dirty;
+        if (dirty.x0 < dirty.x1) {
+            if (!frame->image_bitmap) {
+                frame->image_bitmap = (uint32_t *)calloc((size_t)UI_IMAGE_ATLAS_SIZE * UI_IMAGE_ATLAS_SIZE, sizeof(uint32_t));
+            }
+            for (int y = dirty.y0; y < dirty.y1; y++) {
+                size_t offset = (size_t)y * UI_IMAGE_ATLAS_SIZE + dirty.x0;
+                memcpy(frame->image_bitmap + offset, images->bitmap + offset, (dirty.x1 - dirty.x0) * sizeof(uint32_t));
+            }
+            ui_context->image_dirty = UI_DirtyRect{};
+        }
     }
-}
 
-void UI_LayoutRoot(UI_Widget *root, UI_Axis axis) {
-    UI_LayoutCalcSizesRigid(root, axis);
-    UI_LayoutCalcSizesUpwardDependent(root, axis);
-    UI_LayoutCalcSizesDownwardDependent(root, axis);
-    UI_LayoutResolveSize(root, axis);
-    UI_LayoutPlaceWidgets(root, axis);
+    queue->submitted.store(submitted + 1, std::memory_order_release);
+    SetEvent(queue->submit_event);
 }
 
-void UI_NewFrame(HWND window) {
-    RECT client_rect;
-    GetClientRect(window, &client_rect);
-    UI_Vec2 dim = {(float)(client_rect.right - client_rect.left), (float)(client_rect.bottom - client_rect.top)};
-    ui_state.draw_data.target_size = dim;
-    ui_state.draw_data.target_pos = {0.0f, 0.0f};
-    ui_state.draw_data.vertex_count = 0;
-
-    // Clear layout stacks
-    STACK_CLEAR(ui_state.parent_stack);
-    STACK_CLEAR(ui_state.bg_color_stack);
-    STACK_CLEAR(ui_state.pref_width_stack);
-    STACK_CLEAR(ui_state.pref_height_stack);
+// NOTE: Viewports
+
+// NOTE: Returns null if every viewport is in use
+UI_Viewport *UI_CreateViewport(HWND window) {
+    for (int i = 1; i < UI_MAX_VIEWPORTS; i++) {
+        if (!ui_context->viewports[i]) {
+            UI_Viewport *viewport = new UI_Viewport();
+            viewport->index = i;
+            viewport->window = window;
+            ui_context->viewports[i] = viewport;
+            return viewport;
+        }
+    }
+    printf("Out of viewports\n");
+    return nullptr;
+}
 
-    ui_state.bg_color_stack.push(WHITE);
-    ui_state.border_color_stack.push(GRAY);
-    ui_state.text_color_stack.push(BLACK);
+static void UI_ViewportFree(UI_Viewport *viewport) {
+    free(viewport->draw_data.vertex_list);
+    delete viewport;
+}
 
-    UI_Widget *root = UI_WidgetBuild("~Root", (UI_WidgetFlags)(UI_WidgetFlags_DrawBackground | UI_WidgetFlags_DrawBorder));
-    root->child_layout_axis = UI_Axis_Y;
-    root->rect = {0, 0, dim.x, dim.y};
-    root->pref_size[UI_Axis_X] = UI_SIZE_FIXED(dim.x);
-    root->pref_size[UI_Axis_Y] = UI_SIZE_FIXED(dim.y);
-    root->bg_color = WHITE;
-    root->border_color = WHITE;
+// NOTE: Not while building a frame
+void UI_DestroyViewport(UI_Viewport *viewport) {
+    assert(viewport->index != 0);
+    if (ui_context->render_queue) {
+        UI_RenderQueueFlush(ui_context->render_queue);
+    }
+    if (ui_context->mouse_viewport == viewport) {
+        ui_context->mouse_viewport = ui_context->viewports[0];
+    }
+    ui_context->viewports[viewport->index] = nullptr;
+    UI_ViewportFree(viewport);
+}
 
-    ui_state.parent_stack.push(root);
+// NOTE: Widgets built until UI_EndViewport go into viewport, called between UI_BeginFrame and
+// UI_EndFrame from the main viewport
+void UI_BeginViewport(UI_Viewport *viewport, float width, float height) {
+    assert(ui_context->viewport == ui_context->viewports[0]);
+    ui_context->main_parent_stack.swap(ui_context->parent_stack);
+    char label[16];
+    snprintf(label, sizeof(label), "~Root%d", viewport->index);
+    UI_ViewportBegin(viewport, label, UI_Vec2(width, height));
+}
 
-    // DX11
-    UI_DX11NewFrame();
+void UI_EndViewport() {
+    STACK_CLEAR(ui_context->parent_stack);
+    ui_context->parent_stack.swap(ui_context->main_parent_stack);
+    ui_context->viewport = ui_context->viewports[0];
 }
 
-void UI_DrawLayoutRoot(UI_Widget *widget) {
-    if (widget->flags & UI_WidgetFlags_DrawBackground) {
-        UI_DrawRect(widget->rect, widget->bg_color);
+// NOTE: Text files, documents and images belong to the application and must be closed first
+void UI_DestroyContext(UI_Context *context) {
+    UI_Context *previous = ui_context;
+    ui_context = context;
+
+    UI_StopRecording();
+    UI_StopRenderThread();
+    for (int i = 0; i < (int)context->widget_list.size(); i++) {
+        UI_WidgetDestroy(context->widget_list[i]);
     }
-    if (widget->flags & UI_WidgetFlags_DrawBorder) {
-        UI_DrawRectOutline(widget->rect, widget->border_color);
+    for (int i = 0; i < (int)context->old_list.size(); i++) {
+        UI_WidgetDestroy(context->old_list[i]);
     }
-    if (widget->flags & UI_WidgetFlags_DrawText) {
-        UI_DrawText(widget->label, &ui_state.font_atlas, UI_Vec2(widget->rect.x + widget->pref_size[UI_Axis_X].value / 2.0f, widget->rect.y));
+    for (auto &it : context->text_runs) {
+        UI_TextRun *run = it.second;
+        while (run) {
+            UI_TextRun *next = run->next;
+            UI_TextRunDestroy(run);
+            run = next;
+        }
     }
-    if (widget->flags & UI_WidgetFlags_DrawHotEffects) {
-        UI_DrawRect(widget->rect, UI_Vec4(0.25f, 0.75f, 1.0f, 0.15f));
+    for (auto &it : context->text_layouts) {
+        UI_TextLayout *layout = it.second;
+        while (layout) {
+            UI_TextLayout *next = layout->next;
+            UI_TextLayoutDestroy(layout);
+            layout = next;
+        }
     }
-    if (widget->flags & UI_WidgetFlags_DrawActiveEffects) {
-        UI_DrawRect(widget->rect, UI_Vec4(0.25f, 0.75f, 1.0f, 0.15f));
+    for (auto &it : context->text_edits) UI_TextEditDestroy(it.second);
+    UI_Resources *resources = context->resources;
+    for (auto &it : context->image_cache.images) {
+        UI_Image *image = it.second;
+        if (image->block >= 0) {
+            std::lock_guard<std::mutex> lock(resources->image_mutex);
+            UI_ImageBlockFree(&resources->image_atlas, image->block);
+        }
+        UI_ImageDestroy(image);
     }
-
-    for (UI_Widget *child = widget->first; child != nullptr; child = child->next) {
-        UI_DrawLayoutRoot(child);
+    // NOTE: Jobs spawned from this context run with it current, so they finish before it detaches
+    UI_JobWait(&context->image_jobs);
+    UI_JobWait(&context->frame_jobs);
+    {
+        std::lock_guard<std::mutex> lock(resources->mutex);
+        std::lock_guard<std::mutex> atlas_lock(resources->atlas_mutex);
+        std::lock_guard<std::mutex> image_lock(resources->image_mutex);
+        std::vector<UI_Context*> &contexts = resources->contexts;
+        for (int i = 0; i < (int)contexts.size(); i++) {
+            if (contexts[i] == context) {
+                contexts.erase(contexts.begin() + i);
+                break;
+            }
+        }
+    }
+    UI_ReleaseResources(resources);
+    for (int i = 0; i < UI_MAX_VIEWPORTS; i++) {
+        if (context->viewports[i]) {
+            UI_ViewportFree(context->viewports[i]);
+        }
     }
+    free(context->draw_prepass.vertex_list);
+    UI_DrawSplitFree(&context->draw_split);
+    UI_DX11ReleaseDeviceObjects(&context->backend_data);
+    CloseHandle(context->wake_event);
+    delete context;
+
+    ui_context = previous == context ? nullptr : previous;
 }
 
 void UI_EndFrame() {
-    ui_state.mouse_pressed = false;
-    ui_state.key_down = false;
+    UI_JobWait(&ui_context->frame_jobs);
+
+    double layout_start = UI_GetTime();
+    ui_context->timings.build = layout_start - ui_context->build_start;
+
+    for (int i = 0; i < UI_MAX_VIEWPORTS; i++) {
+        UI_Viewport *viewport = ui_context->viewports[i];
+        if (viewport && viewport->built) {
+            UI_LayoutRoot(viewport->root, UI_Axis_X);
+            UI_LayoutRoot(viewport->root, UI_Axis_Y);
+            UI_HitIndexBuild(&viewport->hit_index, viewport->root);
+        }
+    }
+
+    double tessellate_start = UI_GetTime();
+    ui_context->timings.layout = tessellate_start - layout_start;
 
-    UI_Widget *root = ui_state.root;
-    UI_LayoutRoot(root, UI_Axis_X);
-    UI_LayoutRoot(root, UI_Axis_Y);
+    for (int i = 0; i < UI_MAX_VIEWPORTS; i++) {
+        UI_Viewport *viewport = ui_context->viewports[i];
+        if (viewport && viewport->built) {
+            ui_context->viewport = viewport;
+            UI_DrawTree(viewport->root);
+        }
+    }
+    ui_context->viewport = ui_context->viewports[0];
+    ui_context->timings.tessellate = UI_GetTime() - tessellate_start;
 
-    UI_DrawLayoutRoot(root);
+    UI_EvictTextCache();
+    ui_context->frame_index++;
 
     // Free old list
-    for (int i = 0; i < ui_state.old_list.size(); i++) {
-        UI_Widget *w = ui_state.old_list[i];
-        free(w);
+    for (int i = 0; i < ui_context->old_list.size(); i++) {
+        UI_Widget *w = ui_context->old_list[i];
+        UI_WidgetDestroy(w);
     }
 
     // Swap current build data to old
-    ui_state.old_root = ui_state.root;
-    ui_state.root = nullptr;
-    ui_state.old_list.swap(ui_state.widget_list);
-    ui_state.widget_list.clear();
+    ui_context->old_list.swap(ui_context->widget_list);
+    ui_context->widget_list.clear();
+    ui_context->old_widgets.clear();
+    for (int i = 0; i < ui_context->old_list.size(); i++) {
+        ui_context->old_widgets.emplace(ui_context->old_list[i]->key, ui_context->old_list[i]);
+    }
 
     // NOTE: If active widget wasn't built this frame then no longer active
-    if (UI_AnyActive()) {
-        UI_Widget *active = UI_FindWidget(active_widget->label);
-        if (active == nullptr) {
-            active_widget = nullptr;
-        }    
+    if (UI_AnyActive() && ui_context->old_widgets.find(ui_context->active_key) == ui_context->old_widgets.end()) {
+        UI_WidgetDeactivate();
     }
 
-    UI_Render();
+    UI_FocusNavigate();
+    UI_EndEvents();
+
+    double render_start = UI_GetTime();
+    if (ui_context->render_queue) {
+        UI_SubmitFrame(ui_context->render_queue);
+    } else {
+        UI_Render();
+    }
+    ui_context->timings.render = UI_GetTime() - render_start;
 }
 
 
@@ -985,18 +5119,25 @@ bool UI_ButtonBehavior(UI_Widget *widget, bool *hover) {
     bool clicked = false;
     bool inside = false;
     if (widget) {
-        UI_Rect rect = widget->rect;
-        inside = UI_InRect(ui_state.mouse_x, ui_state.mouse_y, rect);
+        inside = UI_IsHot(widget);
 
         if (UI_IsActive(widget)) {
-            if (ui_state.mouse_pressed) {
+            if (ui_context->mouse_pressed) {
                 if (inside) clicked = true;
                 UI_WidgetDeactivate();
             }
         } else if (inside) {
-            if (ui_state.mouse_down) UI_WidgetActivate(widget);
+            if (ui_context->mouse_down) UI_WidgetActivate(widget);
         }
 
+        if (UI_IsFocused(widget)) {
+            for (UI_Event *event = UI_FirstEvent(); event; event = UI_NextEvent(event)) {
+                if (event->type == UI_EventType_KeyDown && (event->key == VK_RETURN || event->key == VK_SPACE)) {
+                    clicked = true;
+                    UI_ConsumeEvent(event);
+                }
+            }
+        }
     }
     if (hover) {
         *hover = inside;
@@ -1008,15 +5149,15 @@ bool UI_ButtonBehavior(UI_Widget *widget, bool *hover) {
 void UI_RowBegin(char *label) {
     UI_Widget *widget = UI_WidgetBuild(label, (UI_WidgetFlags)(UI_WidgetFlags_DrawBackground | UI_WidgetFlags_DrawBorder));
     widget->pref_size[UI_Axis_X] = UI_SIZE_PARENT(1.0f);
-    widget->pref_size[UI_Axis_Y] = UI_SIZE_FIXED(ui_state.font_atlas.glyph_height);
+    widget->pref_size[UI_Axis_Y] = UI_SIZE_FIXED(UI_GetFont(widget->font)->glyph_height);
     widget->child_layout_axis = UI_Axis_X;
     // UI_PushPrefSize(UI_Axis_X, UI_SIZE_TEXT(1.0f));
     // UI_PushPrefSize(UI_Axis_Y, UI_SIZE_TEXT(1.0f));
-    ui_state.parent_stack.push(widget);
+    ui_context->parent_stack.push(widget);
 }
 
 void UI_RowEnd() {
-    ui_state.parent_stack.pop();
+    ui_context->parent_stack.pop();
     UI_PopPrefSize(UI_Axis_X);
     UI_PopPrefSize(UI_Axis_Y);
 }
@@ -1026,7 +5167,7 @@ bool UI_Button(char *label) {
     bool hover = false;
     bool clicked = UI_ButtonBehavior(widget, &hover);
 
-    UI_Widget *new_widget = UI_WidgetBuild(label, (UI_WidgetFlags)(UI_WidgetFlags_DrawText | UI_WidgetFlags_DrawBorder | UI_WidgetFlags_DrawBackground));
+    UI_Widget *new_widget = UI_WidgetBuild(label, (UI_WidgetFlags)(UI_WidgetFlags_DrawText | UI_WidgetFlags_DrawBorder | UI_WidgetFlags_DrawBackground | UI_WidgetFlags_Clickable | UI_WidgetFlags_Focusable));
     new_widget->pref_size[UI_Axis_X] = UI_SIZE_TEXT(20.0f);
     new_widget->pref_size[UI_Axis_Y] = UI_SIZE_TEXT(0.0f);
 
@@ -1040,16 +5181,346 @@ bool UI_Button(char *label) {
     return clicked;
 }
 
+void UI_TextWrapped(char *label, char *text) {
+    UI_Widget *widget = UI_WidgetBuild(label, (UI_WidgetFlags)(UI_WidgetFlags_DrawText | UI_WidgetFlags_DrawBackground));
+    widget->pref_size[UI_Axis_X] = UI_SIZE_PARENT(1.0f);
+    widget->pref_size[UI_Axis_Y] = UI_SIZE_TEXT(0.0f);
+    widget->text_layout = UI_GetTextLayout(text, (int)strlen(text), UI_GetFont(widget->font));
+}
+
+bool UI_Field(char *label, char *input, int input_length) {
+    bool result = false;
+    UI_Widget *widget = UI_FindWidget(label);
+    bool hover = UI_IsHot(widget);
+
+    UI_Widget *new_widget = UI_WidgetBuild(label, (UI_WidgetFlags)(UI_WidgetFlags_DrawText | UI_WidgetFlags_DrawBorder | UI_WidgetFlags_DrawBackground | UI_WidgetFlags_Clickable | UI_WidgetFlags_Focusable));
+    FontAtlas *font = UI_GetFont(new_widget->font);
+    new_widget->pref_size[UI_Axis_X] = UI_SIZE_FIXED(400.0f);
+    new_widget->pref_size[UI_Axis_Y] = UI_SIZE_FIXED(font->glyph_height + 4.0f);
+
+    UI_TextEdit *edit = UI_GetTextEdit(label, input, input_length, new_widget->font);
+    new_widget->text_edit = edit;
+
+    // NOTE: Keyboard focus edits the field the same as clicking into it
+    if (UI_IsFocused(new_widget) && !UI_IsActive(new_widget)) {
+        UI_WidgetActivate(new_widget);
+    }
+
+    // NOTE: Pressing places the caret and anchor, holding the button drags the caret to select
+    if (ui_context->mouse_down) {
+        if (hover && !edit->dragging) {
+            if (!UI_IsActive(new_widget)) {
+                UI_WidgetActivate(new_widget);
+            }
+            edit->cursor = UI_TextEditHitTest(edit, ui_context->mouse_x - widget->rect.x - UI_TEXT_MARGIN + edit->scroll);
+            edit->anchor = edit->cursor;
+            edit->dragging = true;
+        } else if (edit->dragging && widget) {
+            edit->cursor = UI_TextEditHitTest(edit, ui_context->mouse_x - widget->rect.x - UI_TEXT_MARGIN + edit->scroll);
+        } else if (!widget) {
+            // NOTE: The field wasn't built last frame, there is no rect left to drag the caret in
+            edit->dragging = false;
+        }
+    } else {
+        edit->dragging = false;
+    }
+
+    if (UI_IsActive(new_widget)) {
+        for (UI_Event *event = UI_FirstEvent(); event; event = UI_NextEvent(event)) {
+            if (event->type == UI_EventType_Char) {
+                uint32_t c = event->character;
+                if (c == '\r') {
+                    result = true;
+                } else if (c == '\b') {
+                    if (!UI_TextEditDeleteSelection(edit)) {
+                        UI_TextEditDelete(edit, UI_TextEditPrev(edit, edit->cursor), edit->cursor);
+                    }
+                } else if (c >= 32 && c != 127) {
+                    char bytes[4];
+                    int count = UI_Utf8Encode(c, bytes);
+                    UI_TextEditDeleteSelection(edit);
+                    UI_TextEditInsert(edit, bytes, count);
+                }
+                edit->anchor = edit->cursor;
+                UI_ConsumeEvent(event);
+            } else if (event->type == UI_EventType_KeyDown) {
+                switch (event->key) {
+                case VK_LEFT:
+                    edit->cursor = UI_TextEditPrev(edit, edit->cursor);
+                    break;
+                case VK_RIGHT:
+                    edit->cursor = UI_TextEditNext(edit, edit->cursor);
+                    break;
+                case VK_HOME:
+                    edit->cursor = 0;
+                    break;
+                case VK_END:
+                    edit->cursor = UI_TextEditLength(edit);
+                    break;
+                case VK_DELETE:
+                    if (!UI_TextEditDeleteSelection(edit)) {
+                        UI_TextEditDelete(edit, edit->cursor, UI_TextEditNext(edit, edit->cursor));
+                    }
+                    break;
+                default:
+                    continue;
+                }
+                if (!(event->modifiers & UI_Modifier_Shift)) {
+                    edit->anchor = edit->cursor;
+                }
+                UI_ConsumeEvent(event);
+            }
+        }
+
+        if (ui_context->mouse_down && !hover && !edit->dragging) {
+            UI_WidgetDeactivate();
+            if (UI_IsFocused(new_widget)) UI_SetFocus(nullptr);
+        }
+    }
+
+    // NOTE: Write back on Enter or once the field is no longer being edited
+    if (result || (edit->dirty && !UI_IsActive(new_widget))) {
+        UI_TextEditCopy(edit, input, input_length);
+        edit->dirty = false;
+    }
+
+    return result;
+}
+
+void UI_TextView(char *label, UI_TextFile *file) {
+    UI_Widget *widget = UI_FindWidget(label);
+    bool hover = UI_IsHot(widget);
+
+    UI_Widget *new_widget = UI_WidgetBuild(label, (UI_WidgetFlags)(UI_WidgetFlags_DrawText | UI_WidgetFlags_DrawBorder | UI_WidgetFlags_DrawBackground | UI_WidgetFlags_Clickable | UI_WidgetFlags_Focusable));
+    new_widget->pref_size[UI_Axis_X] = UI_SIZE_PARENT(1.0f);
+    new_widget->pref_size[UI_Axis_Y] = UI_SIZE_PARENT(1.0f);
+    if (!ui_context->pref_width_stack.empty()) new_widget->pref_size[UI_Axis_X] = UI_GetNextPrefSize(UI_Axis_X);
+    if (!ui_context->pref_height_stack.empty()) new_widget->pref_size[UI_Axis_Y] = UI_GetNextPrefSize(UI_Axis_Y);
+    new_widget->text_file = file;
+
+    if (hover && ui_context->mouse_down) {
+        UI_SetFocus(new_widget);
+    }
+
+    if (hover || UI_IsFocused(new_widget)) {
+        double page = widget->rect.height / UI_GetFont(new_widget->font)->glyph_height;
+        for (UI_Event *event = UI_FirstEvent(); event; event = UI_NextEvent(event)) {
+            if (event->type == UI_EventType_MouseWheel && hover) {
+                file->scroll -= UI_TEXT_VIEW_WHEEL_LINES * event->wheel;
+                UI_ConsumeEvent(event);
+            } else if (event->type == UI_EventType_KeyDown) {
+                switch (event->key) {
+                case VK_UP:
+                    file->scroll -= 1.0;
+                    break;
+                case VK_DOWN:
+                    file->scroll += 1.0;
+                    break;
+                case VK_PRIOR:
+                    file->scroll -= page;
+                    break;
+                case VK_NEXT:
+                    file->scroll += page;
+                    break;
+                case VK_HOME:
+                    file->scroll = 0.0;
+                    break;
+                case VK_END:
+                    file->scroll = (double)file->line_count.load(std::memory_order_acquire);
+                    break;
+                default:
+                    continue;
+                }
+                UI_ConsumeEvent(event);
+            }
+        }
+    }
+}
+
+void UI_LogView(char *label, UI_Log *log) {
+    UI_Widget *widget = UI_FindWidget(label);
+    bool hover = UI_IsHot(widget);
+
+    UI_Widget *new_widget = UI_WidgetBuild(label, (UI_WidgetFlags)(UI_WidgetFlags_DrawText | UI_WidgetFlags_DrawBorder | UI_WidgetFlags_DrawBackground | UI_WidgetFlags_Clickable | UI_WidgetFlags_Focusable));
+    new_widget->pref_size[UI_Axis_X] = UI_SIZE_PARENT(1.0f);
+    new_widget->pref_size[UI_Axis_Y] = UI_SIZE_PARENT(1.0f);
+    if (!ui_context->pref_width_stack.empty()) new_widget->pref_size[UI_Axis_X] = UI_GetNextPrefSize(UI_Axis_X);
+    if (!ui_context->pref_height_stack.empty()) new_widget->pref_size[UI_Axis_Y] = UI_GetNextPrefSize(UI_Axis_Y);
+    new_widget->log = log;
+
+    if (hover && ui_context->mouse_down) {
+        UI_SetFocus(new_widget);
+    }
+
+    if (hover || UI_IsFocused(new_widget)) {
+        double page = widget->rect.height / UI_GetFont(new_widget->font)->glyph_height;
+        for (UI_Event *event = UI_FirstEvent(); event; event = UI_NextEvent(event)) {
+            if (event->type == UI_EventType_MouseWheel && hover) {
+                log->scroll -= UI_TEXT_VIEW_WHEEL_LINES * event->wheel;
+                log->follow = false;
+                UI_ConsumeEvent(event);
+            } else if (event->type == UI_EventType_KeyDown) {
+                switch (event->key) {
+                case VK_UP:
+                    log->scroll -= 1.0;
+                    break;
+                case VK_DOWN:
+                    log->scroll += 1.0;
+                    break;
+                case VK_PRIOR:
+                    log->scroll -= page;
+                    break;
+                case VK_NEXT:
+                    log->scroll += page;
+                    break;
+                case VK_HOME:
+                    log->scroll = 0.0;
+                    break;
+                case VK_END:
+                    log->scroll = (double)log->line_count;
+                    break;
+                default:
+                    continue;
+                }
+                log->follow = false;
+                UI_ConsumeEvent(event);
+            }
+        }
+    }
+}
+
+// NOTE: Stretches the image over width x height
+void UI_ImageView(char *label, UI_Image *image, float width, float height) {
+    UI_Widget *widget = UI_WidgetBuild(label, UI_WidgetFlags_DrawText);
+    widget->pref_size[UI_Axis_X] = UI_SIZE_FIXED(width);
+    widget->pref_size[UI_Axis_Y] = UI_SIZE_FIXED(height);
+    widget->image = image;
+    UI_ImageTouch(image);
+}
+
+// NOTE: Moves the cursor by whole lines, keeping its x position
+static void UI_TextDocumentMoveLines(UI_TextDocument *doc, FontAtlas *font, int64_t lines) {
+    UI_LineRef ref = UI_TextDocumentLineAt(doc, doc->cursor);
+    int length;
+    char *text = UI_TextDocumentLineText(doc, ref, &length);
+    float x = UI_TextRunCaretX(UI_ShapeText(text, length, font), (int)UI_MIN(doc->cursor - ref.start, (uint64_t)length));
+
+    int64_t target = UI_CLAMP((int64_t)ref.line + lines, (int64_t)0, (int64_t)doc->line_count - 1);
+    ref = UI_TextDocumentLine(doc, (uint64_t)target);
+    text = UI_TextDocumentLineText(doc, ref, &length);
+    UI_TextRun *run = UI_ShapeText(text, length, font);
+    doc->cursor = ref.start + UI_TextRunHitTest(run, 0, run->glyph_count, x);
+}
+
+void UI_TextEditor(char *label, UI_TextDocument *doc) {
+    UI_Widget *widget = UI_FindWidget(label);
+    bool hover = UI_IsHot(widget);
+
+    UI_Widget *new_widget = UI_WidgetBuild(label, (UI_WidgetFlags)(UI_WidgetFlags_DrawText | UI_WidgetFlags_DrawBorder | UI_WidgetFlags_DrawBackground | UI_WidgetFlags_Clickable | UI_WidgetFlags_Focusable));
+    new_widget->pref_size[UI_Axis_X] = UI_SIZE_PARENT(1.0f);
+    new_widget->pref_size[UI_Axis_Y] = UI_SIZE_PARENT(1.0f);
+    if (!ui_context->pref_width_stack.empty()) new_widget->pref_size[UI_Axis_X] = UI_GetNextPrefSize(UI_Axis_X);
+    if (!ui_context->pref_height_stack.empty()) new_widget->pref_size[UI_Axis_Y] = UI_GetNextPrefSize(UI_Axis_Y);
+    new_widget->text_document = doc;
+    FontAtlas *font = UI_GetFont(new_widget->font);
+
+    if (UI_IsFocused(new_widget) && !UI_IsActive(new_widget)) {
+        UI_WidgetActivate(new_widget);
+    }
+
+    if (hover && ui_context->mouse_down) {
+        if (!UI_IsActive(new_widget)) {
+            UI_WidgetActivate(new_widget);
+        }
+        doc->cursor = UI_TextDocumentHitTest(doc, widget->rect, font, (float)ui_context->mouse_x, (float)ui_context->mouse_y);
+    }
+
+    if (hover) {
+        for (UI_Event *event = UI_FirstEvent(); event; event = UI_NextEvent(event)) {
+            if (event->type == UI_EventType_MouseWheel) {
+                doc->scroll -= UI_TEXT_VIEW_WHEEL_LINES * event->wheel;
+                UI_ConsumeEvent(event);
+            }
+        }
+    }
+
+    if (UI_IsActive(new_widget)) {
+        uint64_t cursor = doc->cursor;
+        int page = UI_MAX((int)(widget->rect.height / font->glyph_height), 1);
+        for (UI_Event *event = UI_FirstEvent(); event; event = UI_NextEvent(event)) {
+            if (event->type == UI_EventType_Char) {
+                uint32_t c = event->character;
+                if (c == '\r') {
+                    UI_TextDocumentInsert(doc, doc->cursor, "\n", 1);
+                    doc->cursor++;
+                } else if (c == '\b') {
+                    uint64_t prev = UI_TextDocumentPrev(doc, doc->cursor);
+                    UI_TextDocumentDelete(doc, prev, doc->cursor);
+                    doc->cursor = prev;
+                } else if (c >= 32 && c != 127) {
+                    char bytes[4];
+                    int count = UI_Utf8Encode(c, bytes);
+                    UI_TextDocumentInsert(doc, doc->cursor, bytes, count);
+                    doc->cursor += count;
+                }
+                UI_ConsumeEvent(event);
+            } else if (event->type == UI_EventType_KeyDown) {
+                UI_LineRef ref = UI_TextDocumentLineAt(doc, doc->cursor);
+                int length;
+                switch (event->key) {
+                case VK_LEFT:
+                    doc->cursor = UI_TextDocumentPrev(doc, doc->cursor);
+                    break;
+                case VK_RIGHT:
+                    doc->cursor = UI_TextDocumentNext(doc, doc->cursor);
+                    break;
+                case VK_UP:
+                    UI_TextDocumentMoveLines(doc, font, -1);
+                    break;
+                case VK_DOWN:
+                    UI_TextDocumentMoveLines(doc, font, 1);
+                    break;
+                case VK_PRIOR:
+                    UI_TextDocumentMoveLines(doc, font, -page);
+                    break;
+                case VK_NEXT:
+                    UI_TextDocumentMoveLines(doc, font, page);
+                    break;
+                case VK_HOME:
+                    doc->cursor = ref.start;
+                    break;
+                case VK_END:
+                    UI_TextDocumentLineText(doc, ref, &length);
+                    doc->cursor = ref.start + length;
+                    break;
+                case VK_DELETE:
+                    UI_TextDocumentDelete(doc, doc->cursor, UI_TextDocumentNext(doc, doc->cursor));
+                    break;
+                default:
+                    continue;
+                }
+                UI_ConsumeEvent(event);
+            }
+        }
+        doc->cursor_moved |= doc->cursor != cursor;
+
+        if (ui_context->mouse_down && !hover) {
+            UI_WidgetDeactivate();
+            if (UI_IsFocused(new_widget)) UI_SetFocus(nullptr);
+        }
+    }
+}
+
 #if 0
 void UI_Label(char *label) {
-    float width = UI_GetTextWidth(label, &ui_state.font_atlas) + 10.0f;
+    float width = UI_GetTextWidth(label, UI_GetFont(ui_context->font_stack.top())) + 10.0f;
     float height = 20.0f;
     UI_Rect rect = {position.x, position.y, width, height};
 
     // UI_DrawRectOutline(rect, WHITE);
-    UI_DrawText(label, &ui_state.font_atlas, UI_Vec2(position.x + 4.0f, position.y));
+    UI_DrawText(label, UI_GetFont(ui_context->font_stack.top()), UI_Vec2(position.x + 4.0f, position.y));
 
-    ui_state.next_position = UI_Vec2(NEXT_PX, rect.y + rect.height + 20.0f);
+    ui_context->next_position = UI_Vec2(NEXT_PX, rect.y + rect.height + 20.0f);
 }
 
 void UI_Labelf(char *fmt, ...) {
@@ -1070,14 +5541,14 @@ void UI_Slider(char *label, float *f, float min, float max) {
     widget = UI_WidgetCreate(label);
     UI_WidgetPush(widget);
     
-    UI_Vec2 position = ui_state.next_position;
-    float text_width = UI_GetTextWidth(label, &ui_state.font_atlas);
+    UI_Vec2 position = ui_context->next_position;
+    float text_width = UI_GetTextWidth(label, UI_GetFont(ui_context->font_stack.top()));
     UI_Rect bar_rect = {position.x, position.y, 200, 5};
 
-    bool hover = UI_InRect(ui_state.mouse_x, ui_state.mouse_y, bar_rect);
+    bool hover = UI_InRect(ui_context->mouse_x, ui_context->mouse_y, bar_rect);
 
     if (!UI_AnyActive()) {
-        if (hover && ui_state.mouse_down) {
+        if (hover && ui_context->mouse_down) {
             UI_WidgetActivate(widget);
         }
     }
@@ -1087,13 +5558,13 @@ void UI_Slider(char *label, float *f, float min, float max) {
     slider_position.x += offset * bar_rect.width;
 
     if (UI_IsActive(widget)) {
-        if (ui_state.mouse_down) {
-            slider_position.x = (float)ui_state.mouse_x;
+        if (ui_context->mouse_down) {
+            slider_position.x = (float)ui_context->mouse_x;
             slider_position.x = UI_CLAMP(slider_position.x, bar_rect.x, bar_rect.x + bar_rect.width);
             float r = (slider_position.x - bar_rect.x) / (float)(bar_rect.width);
             float new_f =  min + d * r;
             *f = new_f;
-        } else if (ui_state.mouse_pressed || !ui_state.mouse_down) {
+        } else if (ui_context->mouse_pressed || !ui_context->mouse_down) {
             UI_WidgetDeactivate();
         }
 
@@ -1106,31 +5577,31 @@ void UI_Slider(char *label, float *f, float min, float max) {
     UI_DrawRectOutline(bar_rect, color);
     UI_DrawRectOutline(slider_rect, GRAY);
 
-    ui_state.next_position = UI_Vec2(NEXT_PX, slider_rect.y + slider_rect.height + 20.0f);
+    ui_context->next_position = UI_Vec2(NEXT_PX, slider_rect.y + slider_rect.height + 20.0f);
 }
 
 bool UI_Checkbox(char *label, bool *b) {
     bool result = false;
     float height = 12;
     float button_width = 12;
-    float width = UI_GetTextWidth(label, &ui_state.font_atlas) + button_width;
-    UI_Rect button_rect = {ui_state.next_position.x, ui_state.next_position.y, button_width, height};
+    float width = UI_GetTextWidth(label, UI_GetFont(ui_context->font_stack.top())) + button_width;
+    UI_Rect button_rect = {ui_context->next_position.x, ui_context->next_position.y, button_width, height};
 
-    bool hover = UI_InRect(ui_state.mouse_x, ui_state.mouse_y, button_rect);
+    bool hover = UI_InRect(ui_context->mouse_x, ui_context->mouse_y, button_rect);
 
     UI_Widget *widget = UI_FindWidget(label);
     widget = UI_WidgetCreate(label);
     UI_WidgetPush(widget);
 
     if (UI_IsActive(widget)) {
-        if (ui_state.mouse_pressed) {
+        if (ui_context->mouse_pressed) {
             if (hover) {
                 result = true;
             }
             UI_WidgetDeactivate();
         }
     } else if (hover) {
-        if (ui_state.mouse_down) {
+        if (ui_context->mouse_down) {
             UI_WidgetActivate(widget);
         }
     }
@@ -1155,71 +5626,9 @@ bool UI_Checkbox(char *label, bool *b) {
         UI_DrawCheckMark({(float)button_rect.x, (float)button_rect.y}, {button_rect.x + (float)button_rect.width, button_rect.y + (float)button_rect.height}, DARKGRAY);
     }
 
-    UI_DrawText(label, &ui_state.font_atlas, {button_rect.x + (float)button_rect.width, (float)button_rect.y - 2});
-
-    ui_state.next_position = UI_Vec2(NEXT_PX, button_rect.y + button_rect.height + 20.0f);
-
-    return result;
-}
-
-bool UI_Field(char *label, char *input, int input_length) {
-    bool result = false;
-    
-    UI_Rect rect = {ui_state.next_position.x, ui_state.next_position.y, 400, 20};
-
-    UI_Widget *widget = UI_FindWidget(label);
-    if (widget == nullptr) {
-        widget = UI_WidgetCreate(label);
-    } else {
-        widget = UI_WidgetCopy(widget);
-    }
-    UI_WidgetPush(widget);
-    
-    bool hover = UI_InRect(ui_state.mouse_x, ui_state.mouse_y, rect);
-    if (hover && ui_state.mouse_down) {
-        UI_WidgetActivate(widget);
-    }
-
-    // NOTE: View offset needed to view current position in text and clip the rest
-
-    if (UI_IsActive(widget)) {
-        if (ui_state.key_down) {
-            if (ui_state.key == VK_RETURN) {
-                result = true; 
-            } else if (ui_state.key == VK_BACK) {
-                widget->cursor--;
-                widget->cursor = UI_Clamp(widget->cursor, 0, input_length - 1);
-            } else {
-                strncat(input, &ui_state.key, input_length);
-                widget->cursor++;
-                widget->cursor = UI_Clamp(widget->cursor, 0, input_length - 1);
-            }
-        }
-        if (ui_state.mouse_down && !UI_InRect(ui_state.mouse_x, ui_state.mouse_y, rect)) {
-            UI_WidgetDeactivate();
-        }
-    }
-
-    float c = UI_GetTextWidthRanged(input, 0, widget->cursor, &ui_state.font_atlas) - widget->text_offset;
-    if (c > rect.width) {
-        widget->text_offset += (c - rect.width);
-    } else if (c < widget->text_offset) {
-        widget->text_offset -= (widget->text_offset - c);
-    }
-
-    float margin = 2.0f;
-    UI_DrawRectOutline(rect, WHITE);
-
-    UI_DrawTextOffset(input, &ui_state.font_atlas, {(float)rect.x + margin, (float)rect.y}, widget->text_offset);
-    // draw cursor
-    if (UI_IsActive(widget)) {
-        UI_Vec2 cursor_position = {(float)rect.x + margin, (float)rect.y};
-        cursor_position.x += UI_GetTextWidthRanged(input, 0, widget->cursor, &ui_state.font_atlas);
-        cursor_position.x -= widget->text_offset;
-        UI_DrawSolidRect({cursor_position.x, cursor_position.y + 1, 1, rect.height - 2}, BLACK);
-    }
+    UI_DrawText(label, UI_GetFont(ui_context->font_stack.top()), {button_rect.x + (float)button_rect.width, (float)button_rect.y - 2});
 
-    ui_state.next_position = UI_Vec2(NEXT_PX, rect.y + rect.height + 20.0f);
+    ui_context->next_position = UI_Vec2(NEXT_PX, button_rect.y + button_rect.height + 20.0f);
 
     return result;
 }
@@ -1235,21 +5644,21 @@ bool UI_RadioButton(char *label, int *out, int value) {
     UI_WidgetPush(widget);
 
     float radio_width = 20;
-    float width = UI_GetTextWidth(label, &ui_state.font_atlas) + radio_width;
+    float width = UI_GetTextWidth(label, UI_GetFont(ui_context->font_stack.top())) + radio_width;
     float height = 20;
-    UI_Rect rect = {ui_state.next_position.x, ui_state.next_position.y, width, height};
+    UI_Rect rect = {ui_context->next_position.x, ui_context->next_position.y, width, height};
 
-    bool hover = UI_InRect(ui_state.mouse_x, ui_state.mouse_y, rect);
+    bool hover = UI_InRect(ui_context->mouse_x, ui_context->mouse_y, rect);
 
     if (UI_IsActive(widget)) {
-        if (ui_state.mouse_pressed) {
+        if (ui_context->mouse_pressed) {
             if (hover) {
                 *out = value;
             }
             UI_WidgetDeactivate();
         }
     } else if (hover) {
-        if (ui_state.mouse_down) UI_WidgetActivate(widget);
+        if (ui_context->mouse_down) UI_WidgetActivate(widget);
     }
 
     UI_Vec4 button_color = LIGHTGRAY;
@@ -1260,9 +5669,9 @@ bool UI_RadioButton(char *label, int *out, int value) {
         button_color = DARKGRAY;
     }
     UI_DrawRectOutline({rect.x, rect.y, radio_width, height}, button_color);
-    UI_DrawText(label, &ui_state.font_atlas, {rect.x + radio_width, rect.y});
+    UI_DrawText(label, UI_GetFont(ui_context->font_stack.top()), {rect.x + radio_width, rect.y});
 
-    ui_state.next_position = UI_Vec2(NEXT_PX, rect.y + rect.height + 20.0f);
+    ui_context->next_position = UI_Vec2(NEXT_PX, rect.y + rect.height + 20.0f);
     return result;
 }
 #endif
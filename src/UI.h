@@ -13,11 +13,21 @@
 #pragma comment(lib, "d3d11.lib")
 #endif // _WIN32
 
+#include <stdint.h>
+#include <stdio.h>
 #include <vector>
 #include <stack>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
 
-struct UI_State;
-extern UI_State ui_state;
+// NOTE: All UI state lives in a UI_Context. Every UI_ call works on the calling thread's
+// current context, so independent contexts can build frames on different threads.
+struct UI_Context;
+extern thread_local UI_Context *ui_context;
 
 #define UI_CLAMP(V, MIN, MAX) (V < MIN ? MIN: V > MAX ? MAX : V)
 #define UI_MIN(A, B) ((A) < (B) ? (A) : (B))
@@ -32,6 +42,11 @@ extern UI_State ui_state;
 void UI_BorderColor(float r, float g, float b, float a);
 void UI_BorderColorPop();
 
+#define UI_ATLAS_SIZE 1024
+
+#define UI_DEFAULT_FONT_PATH "fonts/arial.ttf"
+#define UI_DEFAULT_FONT_SIZE 16
+
 struct FontGlyph {
     float ax;
     float ay;
@@ -39,13 +54,76 @@ struct FontGlyph {
     float by;
     float bt;
     float bl;
-    float to;
+    // NOTE: FreeType glyph index, used for kerning lookups
+    unsigned int index;
+    // NOTE: Normalized offset of the glyph bitmap in the shared atlas
+    float tx;
+    float ty;
+};
+
+// NOTE: Open addressing hash map read without locks while one writer at a time, holding the
+// owner's lock, inserts. A slot's value is stored before its key is released, so a reader that
+// sees the key sees the value, and entries are never changed or removed. Growing copies the
+// entries into a new table and publishes it, readers still probing the old one can only miss
+// and retry under the lock. Retired tables are freed with the map. Keys and values are nonzero,
+// 0 is an empty slot and a miss.
+struct UI_SharedMapSlot {
+    std::atomic<uint64_t> key;
+    std::atomic<uint64_t> value;
+};
+
+struct UI_SharedMapTable {
+    UI_SharedMapSlot *slots;
+    // NOTE: Power of two, kept at most half full
+    int capacity;
 };
 
+struct UI_SharedMap {
+    std::atomic<UI_SharedMapTable*> table;
+    std::vector<UI_SharedMapTable*> retired;
+    int count;
+};
+
+// NOTE: Glyphs in fixed pages, so a glyph never moves once it is appended and readers index
+// it while another thread appends. Pages are allocated by the writer before the ids in them
+// are published.
+#define UI_GLYPH_PAGE_SIZE 256
+#define UI_GLYPH_MAX_PAGES 256
+
+struct UI_GlyphArray {
+    std::atomic<FontGlyph*> pages[UI_GLYPH_MAX_PAGES];
+    int count;
+
+    FontGlyph &operator[](int id) {
+        return pages[id / UI_GLYPH_PAGE_SIZE].load(std::memory_order_relaxed)[id % UI_GLYPH_PAGE_SIZE];
+    }
+};
+
+struct UI_Resources;
+
+// NOTE: Glyph ids index into glyphs. ASCII glyphs live at their codepoint, any
+// other codepoint is rasterized on first use and appended, see glyph_lookup.
+// Fonts belong to a UI_Resources and may be used by several contexts at once.
 struct FontAtlas {
-    FontGlyph glyphs[128];
+    UI_GlyphArray glyphs;
+    // NOTE: Codepoint to glyph id
+    UI_SharedMap glyph_lookup;
+    // NOTE: Taken to rasterize a glyph and append it
+    std::mutex mutex;
+    UI_Resources *resources;
+    int id;
+    char *path;
+    int size;
+    // NOTE: FT_Face kept open for kerning, which only reads it, and a second face of the same
+    // file that glyphs are rasterized with under the mutex
+    void *face;
+    void *raster_face;
+    bool has_kerning;
+    // NOTE: Dimensions of the shared atlas the glyphs are packed into
     int width;
     int height;
+    float inv_width;
+    float inv_height;
     int max_bmp_height;
     float ascend;
     float descend;
@@ -54,6 +132,122 @@ struct FontAtlas {
     float glyph_height;
 };
 
+struct UI_ShapedGlyph {
+    int glyph;
+    // NOTE: Byte offset of the codepoint in the text
+    int offset;
+    // NOTE: Pen position relative to the start of the run, kerning applied
+    float x;
+};
+
+// NOTE: A string shaped once with a font and cached by hash, reused for
+// measuring, drawing and hit-testing until it goes unused for a while.
+// Cached runs keep a copy of their text, runs of strings whose hashes collide
+// are chained through next.
+struct UI_TextRun {
+    uint64_t hash;
+    int font;
+    char *text;
+    int length;
+    float width;
+    int glyph_count;
+    UI_ShapedGlyph *glyphs;
+    uint64_t last_used_frame;
+    UI_TextRun *next;
+};
+
+#define UI_TEXT_RUN_MAX_AGE 120
+
+struct UI_TextLine {
+    // NOTE: Byte range in the text
+    int start;
+    int end;
+    // NOTE: Glyph range in the shaped run, trailing spaces and newline excluded
+    int first_glyph;
+    int last_glyph;
+    float width;
+};
+
+struct UI_TextLayout {
+    uint64_t hash;
+    int font;
+    char *text;
+    int length;
+    UI_TextRun *run;
+    float wrap_width;
+    std::vector<UI_TextLine> lines;
+    uint64_t last_used_frame;
+    // NOTE: Layouts of strings whose hashes collide, like UI_TextRun
+    UI_TextLayout *next;
+};
+
+#define UI_TEXT_MARGIN 4.0f
+
+// NOTE: Persistent state of an editable field. Text is UTF-8 in a gap buffer kept
+// at the cursor, caret_x mirrors the buffer layout and caches the caret position
+// of every byte, valid for logical offsets up to valid_to. The selection runs
+// between anchor and cursor and is empty when they are equal.
+struct UI_TextEdit {
+    char *buffer;
+    float *caret_x;
+    int capacity;
+    int gap_start;
+    int gap_end;
+    int valid_to;
+
+    int cursor;
+    int anchor;
+    bool dragging;
+    int max_length;
+    float scroll;
+    int font;
+    bool dirty;
+    std::vector<UI_ShapedGlyph> visible;
+    uint64_t last_used_frame;
+};
+
+// NOTE: Single channel atlas shared by every loaded font, packed in shelves.
+// Texel (0, 0) is white so untextured quads can sample it.
+struct UI_TextureAtlas {
+    unsigned char *bitmap;
+    int width;
+    int height;
+    int shelf_x;
+    int shelf_y;
+    int shelf_height;
+};
+
+// NOTE: Texels [x0, x1) x [y0, y1), empty when x0 >= x1
+struct UI_DirtyRect {
+    int x0, y0, x1, y1;
+};
+
+// NOTE: Premultiplied RGBA atlas shared by every loaded image. Space is handed out as square
+// blocks of a quadtree, from the whole atlas down to UI_IMAGE_BLOCK_MIN, so a freed block
+// merges back with its free siblings. Images are stored with their edge texels repeated
+// around them, which keeps linear filtering from reaching into the neighboring block.
+// Image vertices have UI_IMAGE_UV_OFFSET added to u, so the pixel shader can tell them from
+// glyphs in the same draw.
+#define UI_IMAGE_ATLAS_SIZE 2048
+#define UI_IMAGE_BLOCK_MIN 32
+#define UI_IMAGE_BLOCK_MAX 512
+// NOTE: Larger images are scaled down to fit, leaving room for the border
+#define UI_IMAGE_MAX_SIZE (UI_IMAGE_BLOCK_MAX - 2)
+#define UI_IMAGE_UV_OFFSET 2.0f
+
+enum UI_ImageBlockState {
+    UI_ImageBlock_Free,
+    UI_ImageBlock_Split,
+    UI_ImageBlock_Used,
+};
+
+struct UI_ImageAtlas {
+    // NOTE: RGBA8 with red in the lowest byte
+    uint32_t *bitmap;
+    // NOTE: UI_ImageBlockState of every quadtree node, the children of node n are 4n + 1 to 4n + 4
+    unsigned char *nodes;
+};
+
 union UI_Vec2 {
     struct {
         float x, y;
@@ -141,8 +335,323 @@ struct DX11_Backend_Data {
     ID3D11VertexShader *vertex_shader;
     ID3D11PixelShader *pixel_shader;
 
+    ID3D11Texture2D *font_texture;
     ID3D11ShaderResourceView *font_texture_view;
     ID3D11SamplerState *font_sampler;
+
+    ID3D11Texture2D *image_texture;
+    ID3D11ShaderResourceView *image_texture_view;
+    ID3D11SamplerState *image_sampler;
+};
+
+// NOTE: Software backend for headless rendering. Triangles are set up once, binned into
+// UI_RASTER_TILE_SIZE square tiles by their bounds, and every tile is cleared and filled as a
+// job of its own, so a tile's pixels stay in cache while its triangles are drawn and tiles
+// need no synchronization. Within a tile triangles are drawn in submission order as spans of
+// pixel rows. The output matches the D3D11 pipeline: the pixel shader's premultiplied color
+// blended with ONE / INV_SRC_ALPHA, except that images are point-sampled.
+#define UI_RASTER_TILE_SIZE 64
+
+struct UI_RasterTriangle {
+    // NOTE: Pixels [x0, x1) x [y0, y1) the triangle can cover
+    int x0, y0, x1, y1;
+    // NOTE: Non-horizontal edges as x = edge_x + (y - edge_y) * edge_dxdy, from their upper
+    // endpoint so triangles sharing an edge compute the same x. edge_side is 1 if the edge
+    // bounds the span from the left, -1 from the right, 0 if it is horizontal.
+    float edge_x[3];
+    float edge_y[3];
+    float edge_dxdy[3];
+    int edge_side[3];
+    // NOTE: Attribute planes, value = base + dx * x + dy * y. Lanes 0-3 are the color, 4-5 the uv.
+    float base[6];
+    float dx[6];
+    float dy[6];
+    // NOTE: Color and texel are the same for every pixel
+    bool constant;
+};
+
+struct UI_RasterTarget {
+    int width;
+    int height;
+    // NOTE: RGBA8 with red in the lowest byte, rows of width pixels
+    uint32_t *pixels;
+
+    // NOTE: Per frame state, see UI_RasterizeDrawData
+    UI_Vec4 clear_color;
+    unsigned char *atlas;
+    int atlas_width;
+    int atlas_height;
+    uint32_t *image_atlas;
+    int tiles_x;
+    int tiles_y;
+    std::vector<UI_RasterTriangle> triangles;
+    // NOTE: Triangles of tile t are tile_items[tile_start[t]..tile_start[t + 1]) in draw order
+    std::vector<int> tile_start;
+    std::vector<int> tile_fill;
+    std::vector<int> tile_items;
+};
+
+// NOTE: Work-stealing scheduler shared by the contexts of a UI_Resources, so contexts building
+// frames side by side don't each start a thread per core. Jobs run with the context that
+// spawned them current. Every worker thread has its own
+// deque, pushing and popping at the back and stealing from the front of the others when
+// it runs dry. Threads outside the pool, like the UI thread, push to a shared deque.
+// Waiting on a group runs queued jobs, so fork/join can nest, and sleeps like an idle worker
+// once there are none until the group finishes. Groups are waited on from the context that
+// spawned their jobs.
+typedef void UI_JobFunc(void *data, int index);
+
+struct UI_JobGroup {
+    std::atomic<int> pending;
+};
+
+struct UI_Job {
+    UI_Context *context;
+    UI_JobFunc *func;
+    void *data;
+    int index;
+    UI_JobGroup *group;
+};
+
+struct UI_JobQueue {
+    std::mutex mutex;
+    std::deque<UI_Job> jobs;
+};
+
+struct UI_JobSystem {
+    // NOTE: Hardware threads the UI may use. There is always at least one worker so
+    // background jobs make progress while the UI thread is busy.
+    int thread_count;
+    // NOTE: queues[0] is shared by threads outside the pool, queues[i] belongs to threads[i - 1]
+    UI_JobQueue *queues;
+    int queue_count;
+    std::vector<std::thread> threads;
+    std::atomic<int> queued;
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    bool quit;
+};
+
+// NOTE: Bounded lock-free queue of fixed-size elements for feeding data from other threads.
+// Any number of threads push and the UI thread pops. Every cell has a sequence number: a
+// producer claims a position with one CAS on tail and publishes the cell by advancing its
+// sequence, so producers never wait on each other or on the UI, and pushing to a full ring
+// fails instead of blocking. The first push after the UI drained the ring wakes its context.
+struct UI_Ring {
+    UI_Context *context;
+    int element_size;
+    // NOTE: Power of two
+    uint32_t capacity;
+    std::atomic<uint64_t> *sequences;
+    char *elements;
+    // NOTE: Producers and the consumer touch different cache lines
+    char pad0[64];
+    std::atomic<uint64_t> tail;
+    char pad1[64];
+    uint64_t head;
+    std::atomic<bool> wake_pending;
+    std::atomic<uint64_t> dropped;
+};
+
+// NOTE: Read-only view of a memory-mapped file. A background pass records a checkpoint at
+// every UI_TEXT_FILE_LINE_STRIDE-th line, and at the first line starting
+// UI_TEXT_FILE_CHECKPOINT_BYTES or more past the previous checkpoint. Jumping to a line is a
+// bisection plus a scan over less than a stride of lines and less than that many bytes, and
+// the index holds at most one checkpoint per stride of lines plus one per that many bytes.
+#define UI_TEXT_FILE_LINE_STRIDE 256
+#define UI_TEXT_FILE_CHECKPOINT_BYTES (64 << 10)
+#define UI_TEXT_FILE_CHUNK_SIZE (1 << 20)
+#define UI_TEXT_VIEW_OVERSCAN 2
+#define UI_TEXT_VIEW_MAX_LINE_BYTES 1024
+#define UI_TEXT_VIEW_WHEEL_LINES 3.0
+
+struct UI_TextFileCheckpoint {
+    uint64_t line;
+    uint64_t offset;
+};
+
+struct UI_TextFile {
+    char *data;
+    uint64_t size;
+    HANDLE file_handle;
+    HANDLE mapping;
+    // NOTE: Context that opened the file, woken when indexing finishes
+    UI_Context *context;
+
+    // NOTE: Indexing runs as a chain of jobs, one chunk each
+    UI_JobGroup index_jobs;
+    uint64_t index_lines;
+    uint64_t index_checkpoint;
+    std::atomic<bool> cancel;
+    std::atomic<bool> indexed;
+    std::atomic<uint64_t> indexed_bytes;
+    std::atomic<uint64_t> line_count;
+    std::mutex index_mutex;
+    // NOTE: In line order, the first is line 0 at offset 0
+    std::vector<UI_TextFileCheckpoint> checkpoints;
+
+    // NOTE: First visible line
+    double scroll;
+};
+
+enum UI_ImageState {
+    UI_ImageState_Loading,
+    // NOTE: Pixels are waiting to be copied into the atlas
+    UI_ImageState_Decoded,
+    UI_ImageState_Ready,
+    UI_ImageState_Failed,
+    // NOTE: Dropped from the atlas to stay within the cache budget, decoded again when next used
+    UI_ImageState_Evicted,
+};
+
+// NOTE: Images are decoded by a job into premultiplied RGBA and copied into the image atlas
+// on the UI thread at the start of the next frame, so loading never stalls a frame. Widgets
+// showing an image draw a placeholder until then.
+struct UI_Image {
+    // NOTE: Context that loaded the image, woken when decoding finishes
+    UI_Context *context;
+    // NOTE: Set for images of a resource set, see UI_GetSharedImage
+    UI_Resources *shared;
+    char *path;
+    // NOTE: Encoded image owned by the caller, for images from memory
+    unsigned char *data;
+    int data_size;
+    std::atomic<int> state;
+    UI_JobGroup decode_jobs;
+    // NOTE: Size after decoding, without the border
+    int width;
+    int height;
+    // NOTE: Written by the decode job, freed once copied into the atlas
+    uint32_t *pixels;
+    // NOTE: Atlas block, -1 while the image isn't in the atlas
+    int block;
+    int block_size;
+    UI_Vec2 uv0;
+    UI_Vec2 uv1;
+
+    // NOTE: Owned by the image cache, see UI_GetImage
+    bool cached;
+    uint64_t key;
+    uint64_t last_used_frame;
+    // NOTE: Earliest frame a failed load is tried again
+    uint64_t retry_frame;
+    UI_Image *lru_prev;
+    UI_Image *lru_next;
+};
+
+// NOTE: Images looked up by path or by a key of the caller's, usually a hash of the encoded
+// data. Cached images in the atlas are kept in a list from most to least recently used, and
+// when a decoded image doesn't fit the budget or the atlas, the least recently used ones that
+// weren't shown in the last frame are evicted until it does. An evicted image keeps its
+// handle and entry and is decoded again the next time it is asked for, until then it draws
+// the placeholder. Images that can't be placed yet wait decoded for the next frame. An image
+// that failed to load is tried again when it is asked for UI_IMAGE_RETRY_FRAMES or more
+// frames after its last attempt started.
+#define UI_IMAGE_CACHE_BUDGET ((size_t)UI_IMAGE_ATLAS_SIZE * UI_IMAGE_ATLAS_SIZE * sizeof(uint32_t))
+#define UI_IMAGE_RETRY_FRAMES 60
+
+struct UI_ImageCacheStats {
+    // NOTE: Lookups that found the image in the atlas or on its way there
+    uint64_t hits;
+    // NOTE: Decodes started for cached images, first loads, after an eviction and retries
+    uint64_t misses;
+    // NOTE: Lookups that found an image that failed to load, neither hits nor misses
+    uint64_t failures;
+    uint64_t evictions;
+    // NOTE: Bytes of the atlas blocks held by every image, cached or not
+    size_t bytes;
+    size_t budget;
+};
+
+struct UI_ImageCache {
+    std::unordered_map<uint64_t, UI_Image*> images;
+    UI_Image *lru_first;
+    UI_Image *lru_last;
+    UI_ImageCacheStats stats;
+};
+
+// NOTE: Scrollback of lines pushed from any thread through a ring. Lines are moved out of
+// the ring at the start of every frame in batches into a circular buffer of the newest
+// line_capacity lines, so a frame only copies what arrived since the last one, and the
+// view only shapes the lines on screen.
+#define UI_LOG_LINE_LENGTH 124
+
+struct UI_LogLine {
+    int length;
+    char text[UI_LOG_LINE_LENGTH];
+};
+
+struct UI_Log {
+    UI_Ring *ring;
+    // NOTE: Line n is lines[n % line_capacity] while n >= line_count - line_capacity
+    UI_LogLine *lines;
+    int line_capacity;
+    uint64_t line_count;
+    // NOTE: First visible line
+    double scroll;
+    // NOTE: Keeps the newest line in view until scrolled away from the bottom
+    bool follow;
+};
+
+// NOTE: Editable document stored as a piece table over the original text and an
+// append-only buffer of added text. Pieces are kept in blocks of up to
+// 2 * UI_TEXT_DOCUMENT_BLOCK_PIECES and line lengths (including the newline) in
+// blocks of up to 2 * UI_TEXT_DOCUMENT_BLOCK_LINES, so an edit only rewrites one
+// block of each. Every block knows where it starts, and pieces and lines are found
+// by bisecting the blocks.
+#define UI_TEXT_DOCUMENT_BLOCK_LINES 256
+#define UI_TEXT_DOCUMENT_BLOCK_PIECES 64
+
+struct UI_TextPiece {
+    bool added;
+    uint64_t start;
+    uint64_t length;
+};
+
+struct UI_PieceBlock {
+    std::vector<UI_TextPiece> pieces;
+    uint64_t bytes;
+    // NOTE: Byte offset of the first piece
+    uint64_t start;
+};
+
+struct UI_PieceRef {
+    int block;
+    int index;
+    // NOTE: Byte offset of the piece
+    uint64_t start;
+};
+
+struct UI_LineBlock {
+    std::vector<uint32_t> lines;
+    uint64_t bytes;
+    // NOTE: Byte offset and number of the first line
+    uint64_t start;
+    uint64_t line;
+};
+
+struct UI_LineRef {
+    int block;
+    int index;
+    uint64_t line;
+    uint64_t start;
+};
+
+struct UI_TextDocument {
+    char *original;
+    std::vector<char> added;
+    std::vector<UI_PieceBlock> piece_blocks;
+    std::vector<UI_LineBlock> blocks;
+    uint64_t length;
+    uint64_t line_count;
+    // NOTE: Piece the last read ended in, reading the next line continues from there
+    UI_PieceRef read_at;
+
+    uint64_t cursor;
+    bool cursor_moved;
+    // NOTE: First visible line
+    double scroll;
+    std::vector<char> scratch;
 };
 
 struct UI_Draw_Data {
@@ -175,6 +684,9 @@ enum UI_WidgetFlags {
     UI_WidgetFlags_DrawBackground     = 0x20,
     UI_WidgetFlags_DrawHotEffects     = 0x40,
     UI_WidgetFlags_DrawActiveEffects  = 0x80,
+    UI_WidgetFlags_Clickable          = 0x100,
+    UI_WidgetFlags_Focusable          = 0x200,
+    UI_WidgetFlags_DrawFocusEffects   = 0x400,
 };
 
 enum UI_Axis {
@@ -186,7 +698,10 @@ enum UI_Axis {
 struct UI_Widget {
     UI_WidgetFlags flags;
     char *label;
+    uint64_t key;
     bool active;
+    // NOTE: Position in this frame's focus order, -1 if not focusable
+    int focus_index;
     
     UI_Rect rect;
     UI_Size pref_size[2];
@@ -194,8 +709,19 @@ struct UI_Widget {
     UI_Vec2 relative_pos;
     UI_Vec2 actual_size;
 
-    float text_offset;
-    int cursor;
+    int font;
+    UI_TextLayout *text_layout;
+    UI_TextEdit *text_edit;
+    UI_TextFile *text_file;
+    UI_TextDocument *text_document;
+    UI_Log *log;
+    UI_Image *image;
+    // NOTE: Shaped label, set when layout measures it
+    UI_TextRun *text_run;
+    // NOTE: Text content tessellated ahead of a parallel draw, see UI_DrawPrepare
+    bool content_prepared;
+    int content_first;
+    int content_count;
 
     UI_Vec4 bg_color;
     UI_Vec4 border_color;
@@ -212,25 +738,318 @@ struct UI_Widget {
     UI_Widget *parent;
 };
 
-struct UI_State {
+enum UI_EventType {
+    UI_EventType_None,
+    UI_EventType_KeyDown,
+    UI_EventType_KeyUp,
+    UI_EventType_Char,
+    UI_EventType_MouseMove,
+    UI_EventType_MouseDown,
+    UI_EventType_MouseUp,
+    UI_EventType_MouseWheel,
+};
+
+enum UI_Modifier {
+    UI_Modifier_Shift = (1<<0),
+    UI_Modifier_Ctrl = (1<<1),
+    UI_Modifier_Alt = (1<<2),
+};
+
+enum UI_MouseButton {
+    UI_MouseButton_Left,
+    UI_MouseButton_Right,
+    UI_MouseButton_Middle,
+};
+
+struct UI_Event {
+    UI_EventType type;
+    // NOTE: Milliseconds on the platform's message clock
+    uint32_t time;
+    int modifiers;
+    // NOTE: Virtual key for key events, UI_MouseButton for mouse buttons
+    int key;
+    uint32_t character;
+    int x;
+    int y;
+    float wheel;
+    // NOTE: Viewport whose window received the event, 0 for the main one
+    int viewport;
+    bool consumed;
+};
+
+// NOTE: Fixed-capacity ring of input events filled by the platform layer. head and
+// tail only grow and index slots modulo the capacity, which must be a power of two.
+// A frame sees the events queued before it began, up to frame_end.
+#define UI_EVENT_QUEUE_SIZE 1024
+
+struct UI_EventQueue {
+    UI_Event events[UI_EVENT_QUEUE_SIZE];
+    uint32_t head;
+    uint32_t tail;
+    uint32_t frame_end;
+    // NOTE: Events refused because the queue was full, for the app or a debug view to show
+    uint64_t dropped;
+};
+
+struct UI_MouseSample {
+    int x;
+    int y;
+    uint32_t time;
+};
+
+// NOTE: Mouse moves are coalesced as they arrive. The queue holds at most one move
+// between other events, while the frame's total delta, path length and, if
+// keep_samples is set, every sample are accumulated into preallocated buffers that
+// are swapped when a frame begins.
+#define UI_MOUSE_SAMPLE_CAPACITY 512
+
+struct UI_MouseMotion {
+    UI_MouseSample samples[2][UI_MOUSE_SAMPLE_CAPACITY];
+    int sample_count[2];
+    int pending;
+    bool keep_samples;
+    int last_x = -1;
+    int last_y = -1;
+    UI_Vec2 delta;
+    float path_length;
+};
+
+// NOTE: Uniform grid over the clickable rects of the last frame, clipped to their
+// parents. Each cell lists the rects touching it in draw order, so the topmost one
+// under a point is the last one in its cell that contains it.
+#define UI_HIT_CELL_SIZE 64.0f
+
+struct UI_HitRect {
+    UI_Rect rect;
+    uint64_t key;
+    int focus_index;
+};
+
+struct UI_HitIndex {
+    std::vector<UI_HitRect> rects;
+    std::vector<int> cell_start;
+    std::vector<int> cell_fill;
+    std::vector<int> cell_items;
+    float origin_x;
+    float origin_y;
+    int columns;
+    int rows;
+    // NOTE: Rect of each focus order entry, -1 if it was clipped away
+    std::vector<int> focus_rects;
+};
+
+// NOTE: An output surface with its own root widget, draw list and hit index. The viewports of
+// a context share its widgets, text caches, atlas and backend resources, so every display
+// draws from one copy of the fonts. Viewport 0 is the main one, begun by UI_BeginFrame, the
+// others are begun while building a frame and take part in layout and drawing of that frame.
+// Labels are unique across all viewports of a context.
+#define UI_MAX_VIEWPORTS 8
+
+struct UI_Viewport {
+    int index;
+    HWND window;
+    UI_Widget *root;
+    UI_Draw_Data draw_data;
+    UI_HitIndex hit_index;
+    // NOTE: Begun this frame, the others keep their last draw list
+    bool built;
+};
+
+// NOTE: Large trees are split into runs of whole subtrees and tessellated as jobs into
+// per-chunk vertex buffers, then concatenated in tree order, so the draw
+// list is identical to a serial walk. Widget content that touches the shared text caches
+// is tessellated serially before the split.
+#define UI_PARALLEL_DRAW_MIN_WIDGETS 4096
+#define UI_DRAW_CHUNKS_PER_THREAD 4
+
+struct UI_DrawItem {
+    UI_Widget *widget;
+    // NOTE: Only the widget itself, its children are items of their own
+    bool self_only;
+};
+
+struct UI_DrawChunk {
+    int first;
+    int last;
+    UI_Draw_Data draw_data;
+    // NOTE: Where the chunk's vertices go in the final draw list
+    int offset;
+};
+
+struct UI_DrawSplit {
+    std::vector<UI_DrawItem> items;
+    std::vector<UI_DrawChunk> chunks;
+};
+
+// NOTE: Everything besides input that a frame depends on, so a recorded frame can be rebuilt
+struct UI_FrameDesc {
+    float width;
+    float height;
+    double time;
+};
+
+// NOTE: Seconds spent in each phase of the last frame
+struct UI_FrameTimings {
+    double build;
+    double layout;
+    double tessellate;
+    // NOTE: With a render thread, the time spent handing the frame off
+    double render;
+};
+
+// NOTE: Finished frames are handed to the render thread through a ring of
+// UI_RENDER_QUEUE_SIZE slots. The UI thread only advances submitted and the render thread
+// only advances rendered, so the handoff needs no locks, and a slot can be reused once
+// rendered has passed it. A submitted frame's draw data is swapped with the slot's, so
+// together with the one being built there are UI_RENDER_QUEUE_SIZE + 1 draw lists.
+#define UI_RENDER_QUEUE_SIZE 2
+
+// NOTE: Called on the render thread for every viewport built in a frame, usually binds and
+// clears the viewport window's target, calls UI_RenderDrawData and presents
+typedef void UI_RenderFunc(UI_Viewport *viewport, UI_Draw_Data *draw_data, void *user);
+
+struct UI_RenderFrame {
+    // NOTE: Indexed like the context's viewports, null where a viewport wasn't built
+    UI_Viewport *viewports[UI_MAX_VIEWPORTS];
+    UI_Draw_Data draw_data[UI_MAX_VIEWPORTS];
+    // NOTE: Copy of the atlas if it changed since the last submitted frame
+    unsigned char *atlas_bitmap;
+    bool atlas_dirty;
+    // NOTE: Copy of the image atlas where image_dirty says it changed
+    uint32_t *image_bitmap;
+    UI_DirtyRect image_dirty;
+};
+
+struct UI_RenderQueue {
+    UI_Context *context;
+    UI_RenderFunc *render_frame;
+    void *user;
+    UI_RenderFrame frames[UI_RENDER_QUEUE_SIZE];
+    std::atomic<uint64_t> submitted;
+    std::atomic<uint64_t> rendered;
+    // NOTE: Auto-reset events, set after submitted or rendered advances
+    HANDLE submit_event;
+    HANDLE release_event;
+    std::atomic<bool> quit;
+    std::thread thread;
+};
+
+// NOTE: Fonts, their glyphs and the atlases they are packed into, loaded once and used by
+// every context attached to the set. Contexts on different threads read fonts, glyphs and
+// shared images without locks, see UI_SharedMap, and a miss is filled in under the lock of
+// the font or the image atlas. The set is reference counted, every attached context holds a
+// reference. GPU textures stay with each context's backend, the atlases are uploaded from
+// the set where the context's dirty state says they changed.
+// NOTE: Locks are taken in the order mutex, atlas_mutex, image_mutex. contexts changes under
+// all three, so any of them is enough to walk it.
+#define UI_MAX_FONTS 64
+
+struct UI_Resources {
+    std::atomic<int> refs;
+    // NOTE: Taken to load a font
+    std::mutex mutex;
+    void *ft_library;
+    // NOTE: The first font_count are published and never change
+    FontAtlas *fonts[UI_MAX_FONTS];
+    std::atomic<int> font_count;
+    // NOTE: Taken to pack glyphs into the atlas and to copy it
+    std::mutex atlas_mutex;
+    UI_TextureAtlas atlas;
+    // NOTE: Taken to place or free image blocks and to copy the image atlas
+    std::mutex image_mutex;
+    UI_ImageAtlas image_atlas;
+    // NOTE: Hash of the path to UI_Image, inserted under image_mutex
+    UI_SharedMap images;
+    std::vector<UI_Context*> contexts;
+    // NOTE: Created under mutex on first use, destroyed with the resources
+    UI_JobSystem *jobs;
+};
+
+// NOTE: Recordings start with the magic and version, then every frame is its UI_FrameDesc
+// and event count followed by that many packed events, all little endian.
+#define UI_RECORD_MAGIC 0x43524955
+#define UI_RECORD_VERSION 2
+
+struct UI_Context {
     // Input
+    UI_EventQueue events;
+    UI_MouseMotion mouse_motion;
+    // NOTE: Mouse state at the end of the frame's events
     int mouse_x = -1;
     int mouse_y = -1;
     bool mouse_down;
     bool mouse_pressed;
     bool dragging;
+    // NOTE: Motion since the last frame
     UI_Vec2 mouse_delta;
-    bool key_down;
-    char key;
+    float mouse_path_length;
+    UI_MouseSample *mouse_samples;
+    int mouse_sample_count;
+    // NOTE: Key of the topmost clickable widget under the mouse
+    uint64_t hot_key;
+    uint64_t active_key;
+
+    // Focus
+    // NOTE: Focusable widgets are appended to focus_order as they are built, so tab order is
+    // build order and next/prev is an index step from the focused widget's focus_index.
+    uint64_t focus_key;
+    std::vector<uint64_t> focus_order;
+
+    // Scheduling
+    // NOTE: Seconds on the UI_GetTime clock. next_frame_time is the earliest time a frame
+    // was asked for, the host can block in UI_WaitForEvents until then.
+    double time;
+    double next_frame_time;
+    double caret_blink_start;
+    HANDLE wake_event;
+
+    // Profiling
+    UI_FrameTimings timings;
+    double build_start;
+    FILE *record_file;
 
     // Internal
-    UI_Widget *old_root;
-    UI_Widget *root;
+    uint64_t frame_index;
+
+    // Viewports
+    UI_Viewport *viewports[UI_MAX_VIEWPORTS];
+    // NOTE: Viewport being built, a widget without a parent becomes its root
+    UI_Viewport *viewport;
+    // NOTE: Viewport last under the mouse, mouse_x and mouse_y are in its window's coordinates
+    UI_Viewport *mouse_viewport;
+    // NOTE: Parents of the main viewport while another one is being built
+    std::stack<UI_Widget*> main_parent_stack;
+
+    // Jobs
+    // NOTE: The resources' job system, created by the first context that spawns a job with its
+    // job_threads threads, 0 picks one per hardware thread
+    UI_JobSystem *jobs;
+    int job_threads;
+    UI_JobGroup frame_jobs;
 
     // Rendering Data
-    FontAtlas font_atlas;
-    UI_Draw_Data draw_data;
+    UI_Resources *resources;
+    // NOTE: The font atlas changed since it was last uploaded, under the resources' atlas_mutex
+    bool atlas_dirty;
+    // NOTE: Image atlas texels changed since the last upload, under the resources' image_mutex
+    UI_DirtyRect image_dirty;
+    // NOTE: Decodes of shared images started from this context, they run on its job system
+    UI_JobGroup image_jobs;
+    std::unordered_map<uint64_t, UI_TextRun*> text_runs;
+    std::unordered_map<uint64_t, UI_TextLayout*> text_layouts;
+    std::unordered_map<uint64_t, UI_TextEdit*> text_edits;
+    UI_ImageCache image_cache;
+    // NOTE: Checked in UI_BeginFrame for images that finished decoding
+    std::vector<UI_Image*> loading_images;
+    // NOTE: 0 splits for every thread of the job system, 1 always draws serially
+    int draw_threads;
+    UI_DrawSplit draw_split;
+    // NOTE: Drained in UI_BeginFrame
+    std::vector<UI_Log*> logs;
+    UI_Draw_Data draw_prepass;
     DX11_Backend_Data backend_data;
+    // NOTE: Frames are rendered by UI_EndFrame unless there is a render thread
+    UI_RenderQueue *render_queue;
 
     // Layout stacks
     std::stack<UI_Widget*> parent_stack;
@@ -239,22 +1058,155 @@ struct UI_State {
     std::stack<UI_Vec4> bg_color_stack;
     std::stack<UI_Vec4> border_color_stack;
     std::stack<UI_Vec4> text_color_stack;
+    std::stack<int> font_stack;
 
-    // TODO: Hash list
     std::vector<UI_Widget*> old_list;
     std::vector<UI_Widget*> widget_list;
+    std::unordered_map<uint64_t, UI_Widget*> old_widgets;
 };
 
+// NOTE: The first context created becomes current on the creating thread. UI_CreateContext
+// gives the context resources of its own, UI_CreateSharedContext attaches it to a set that
+// other contexts may use at the same time.
+UI_Context *UI_CreateContext();
+UI_Context *UI_CreateSharedContext(UI_Resources *resources);
+UI_Resources *UI_CreateResources();
+void UI_AcquireResources(UI_Resources *resources);
+// NOTE: The set is freed with its last reference
+void UI_ReleaseResources(UI_Resources *resources);
+void UI_DestroyContext(UI_Context *context);
+void UI_SetCurrentContext(UI_Context *context);
+UI_Context *UI_GetCurrentContext();
+
+void UI_SetDrawThreads(int count);
+
+void UI_SetJobThreads(int count);
+int UI_JobThreadCount();
+void UI_JobSpawn(UI_JobGroup *group, UI_JobFunc *func, void *data, int index);
+void UI_JobWait(UI_JobGroup *group);
+void UI_ParallelFor(int count, UI_JobFunc *func, void *data);
+// NOTE: Jobs spawned into this group while building a frame finish before its layout
+UI_JobGroup *UI_FrameJobs();
+
 void UI_DX11BackendInit(ID3D11Device *device, ID3D11DeviceContext *device_context);
 void UI_Render();
+void UI_RenderViewport(UI_Viewport *viewport);
+void UI_RenderDrawData(UI_Draw_Data *draw_data);
+UI_RasterTarget *UI_RasterTargetCreate(int width, int height);
+void UI_RasterTargetDestroy(UI_RasterTarget *target);
+void UI_RasterizeDrawData(UI_RasterTarget *target, UI_Draw_Data *draw_data, UI_Vec4 clear_color);
+void UI_StartRenderThread(UI_RenderFunc *render_frame, void *user);
+void UI_StopRenderThread();
+void UI_FlushRenderThread();
 void UI_NewFrame(HWND window);
+void UI_BeginFrame(UI_FrameDesc desc);
 void UI_EndFrame();
 
+UI_Viewport *UI_CreateViewport(HWND window);
+void UI_DestroyViewport(UI_Viewport *viewport);
+void UI_BeginViewport(UI_Viewport *viewport, float width, float height);
+void UI_EndViewport();
+
+bool UI_StartRecording(char *path);
+void UI_StopRecording();
+bool UI_Replay(char *path, void (*build_frame)(void *user), void *user, FILE *report);
+
+// NOTE: Fonts are identified by their index in the context's resources, the first font loaded
+// is the default. Loading the same path and size twice returns the existing id, -1 on failure.
+int UI_LoadFont(char *path, int pixel_height);
+FontAtlas *UI_GetFont(int font);
+uint64_t UI_HitTest(float x, float y);
+bool UI_IsHot(UI_Widget *widget);
+bool UI_IsFocused(UI_Widget *widget);
+void UI_SetFocus(UI_Widget *widget);
+
+#define UI_CARET_BLINK_PERIOD 0.5
+
+double UI_GetTime();
+void UI_RequestFrame(double delay);
+void UI_PostWakeup(UI_Context *context);
+void UI_WaitForEvents();
+
+bool UI_PushEvent(UI_Event event);
+UI_Event *UI_FirstEvent();
+UI_Event *UI_NextEvent(UI_Event *event);
+void UI_ConsumeEvent(UI_Event *event);
+
+void UI_PushFont(int font);
+void UI_PopFont();
+void UI_PushPrefSize(UI_Axis axis, UI_Size size);
+UI_Size UI_PopPrefSize(UI_Axis axis);
+
+#define UI_UTF8_REPLACEMENT 0xFFFD
+
+struct UI_Utf8Iter {
+    char *text;
+    int length;
+    int offset;
+    // NOTE: Bytes before this offset are known to be ASCII
+    int ascii_end;
+};
+
+uint32_t UI_Utf8Decode(char *text, int length, int *advance);
+int UI_Utf8Encode(uint32_t codepoint, char *out);
+int UI_Utf8AsciiPrefix(char *text, int length);
+int UI_Utf8Prev(char *text, int offset);
+int UI_Utf8NextOffset(char *text, int length, int offset);
+UI_Utf8Iter UI_Utf8Begin(char *text, int length);
+bool UI_Utf8Next(UI_Utf8Iter *it, uint32_t *codepoint, int *offset);
+int UI_FindGlyph(FontAtlas *font, uint32_t codepoint);
+
+uint64_t UI_HashString(char *text, int length, uint64_t seed);
+UI_TextRun *UI_ShapeText(char *text, int length, FontAtlas *font);
+// NOTE: Measuring and hit-testing work on a shaped run, which widgets keep in text_run, so a
+// query doesn't hash the text again
+float UI_TextRunCaretX(UI_TextRun *run, int offset);
+int UI_TextRunHitTest(UI_TextRun *run, int first, int last, float x);
+UI_TextLayout *UI_GetTextLayout(char *text, int length, FontAtlas *font);
+void UI_TextLayoutWrap(UI_TextLayout *layout, float wrap_width);
+
 UI_Widget *UI_WidgetBuild(char *string, UI_WidgetFlags flags);
 
 void UI_RowBegin(char *label);
 void UI_RowEnd();
 
 bool UI_Button(char *label);
+void UI_TextWrapped(char *label, char *text);
+// NOTE: input is loaded when the field is first built and written back when the
+// field loses focus or Enter is pressed, which is also when it returns true.
+bool UI_Field(char *label, char *input, int input_length);
+
+UI_TextFile *UI_OpenTextFile(char *path);
+void UI_CloseTextFile(UI_TextFile *file);
+float UI_TextFileProgress(UI_TextFile *file);
+void UI_TextFileScrollTo(UI_TextFile *file, uint64_t line);
+void UI_TextView(char *label, UI_TextFile *file);
+
+UI_Ring *UI_RingCreate(int element_size, int capacity);
+void UI_RingDestroy(UI_Ring *ring);
+bool UI_RingPush(UI_Ring *ring, void *element);
+int UI_RingPop(UI_Ring *ring, void *out, int max_count);
+
+UI_Log *UI_LogCreate(int line_capacity, int queue_capacity);
+void UI_LogDestroy(UI_Log *log);
+bool UI_LogPush(UI_Log *log, char *text, int length);
+void UI_LogView(char *label, UI_Log *log);
+
+UI_Image *UI_LoadImage(char *path);
+void UI_FreeImage(UI_Image *image);
+bool UI_ImageReady(UI_Image *image);
+UI_Image *UI_GetImage(char *path);
+UI_Image *UI_GetImageFromMemory(unsigned char *data, int size, uint64_t key);
+void UI_SetImageCacheBudget(size_t bytes);
+UI_ImageCacheStats UI_GetImageCacheStats();
+UI_Image *UI_GetSharedImage(char *path);
+void UI_ImageView(char *label, UI_Image *image, float width, float height);
+
+UI_TextDocument *UI_TextDocumentCreate(char *text, uint64_t length);
+void UI_TextDocumentDestroy(UI_TextDocument *doc);
+void UI_TextDocumentRead(UI_TextDocument *doc, uint64_t offset, uint64_t length, char *out);
+void UI_TextDocumentInsert(UI_TextDocument *doc, uint64_t offset, char *text, uint64_t length);
+void UI_TextDocumentDelete(UI_TextDocument *doc, uint64_t start, uint64_t end);
+void UI_TextEditor(char *label, UI_TextDocument *doc);
 
 #endif // UI_H
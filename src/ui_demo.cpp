@@ -8,7 +8,6 @@
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
-#include <timeapi.h>
 #include <windowsx.h>
 #include <d3d11.h>
 #include <d3dcompiler.h>
@@ -20,6 +19,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 // #include <ft2build.h>
 // #include FT_FREETYPE_H
@@ -44,8 +44,10 @@ LRESULT CALLBACK WindowProc(HWND window, UINT message, WPARAM wparam, LPARAM lpa
     LRESULT result = 0;
     switch (message) {
     case WM_SIZE: {
-        // NOTE: Resize render target view
+        // NOTE: Resize render target view. The render thread shares the device context and the
+        // swap chain, it has to finish its frames before they are touched here.
         if (swapchain) {
+            UI_FlushRenderThread();
             d3d_context->OMSetRenderTargets(0, 0, 0);
 
             // Release all outstanding references to the swap chain's buffers.
@@ -92,13 +94,197 @@ LARGE_INTEGER win32_get_wall_clock() {
     return result;
 }
 
-int main() {
+#define DEMO_SAMPLE_LEN 128
+
+// NOTE: Set with --image
+char *demo_image_path;
+
+struct Demo_State {
+    int ui_font;
+    int mono_font;
+    char sample_field[DEMO_SAMPLE_LEN];
+    UI_TextFile *source_file;
+    UI_TextDocument *query_doc;
+};
+
+void demo_init(Demo_State *demo) {
+    demo->ui_font = UI_LoadFont("fonts/arial.ttf", 16);
+    demo->mono_font = UI_LoadFont("fonts/ProggyClean.ttf", 13);
+    demo->source_file = UI_OpenTextFile("src/UI.cpp");
+
+    char *query = "SELECT first_name, last_name, id\nFROM people\nWHERE id < 2000\nORDER BY last_name;\n";
+    demo->query_doc = UI_TextDocumentCreate(query, strlen(query));
+}
+
+void demo_shutdown(Demo_State *demo) {
+    if (demo->source_file) {
+        UI_CloseTextFile(demo->source_file);
+    }
+    UI_TextDocumentDestroy(demo->query_doc);
+}
+
+// NOTE: The widget code for one frame, shared by the window loop and --replay
+void demo_build_ui(void *user) {
+    Demo_State *demo = (Demo_State *)user;
+
+    UI_RowBegin("Menu");
+        if (UI_Button("File")) {
+            printf("File\n");
+        }
+        if (UI_Button("Edit")) {
+            printf("Edit\n");
+        }
+        if (UI_Button("Help")) {
+            printf("Help\n");
+        }
+        // UI_BorderColorPop();
+    UI_RowEnd();
+
+    UI_Widget *widget = UI_WidgetBuild("Table", (UI_WidgetFlags)(UI_WidgetFlags_DrawBorder | UI_WidgetFlags_DrawBackground));
+    widget->pref_size[UI_Axis_X] = UI_SIZE_PARENT(0.5f);
+    widget->pref_size[UI_Axis_Y] = UI_SIZE_PARENT(1.0f);
+
+    ui_context->parent_stack.push(widget);
+
+    UI_RowBegin("TableHeader");
+        UI_Button("First Name");
+        UI_Button("Last Name");
+        UI_Button("ID");
+    UI_RowEnd();
+
+    UI_RowBegin("TableRow0");
+        UI_Button("Ada");
+        UI_Button("Lovelace");
+        UI_PushFont(demo->mono_font);
+        UI_Button("00001815");
+        UI_PopFont();
+    UI_RowEnd();
+
+    UI_TextWrapped("Description", "Immediate mode UI test table. Rows are rebuilt every frame, while "
+                   "shaped runs and wrapped layouts are cached and only recomputed when the text or "
+                   "the available width changes.\nResize the window to rewrap this paragraph.");
+
+    // UI_Slider("Slider", &slider, 0.0f, 1.0f);
+
+    UI_Field("Field", demo->sample_field, DEMO_SAMPLE_LEN);
+    // if (UI_Field("Field", demo->sample_field, DEMO_SAMPLE_LEN)) {
+    //     printf("%s\n", demo->sample_field);
+    // }
+
+    if (demo_image_path) {
+        UI_ImageView("Image", UI_GetImage(demo_image_path), 128.0f, 128.0f);
+    }
+
+    UI_PushFont(demo->mono_font);
+    UI_PushPrefSize(UI_Axis_Y, UI_SIZE_PARENT(0.3f));
+    if (demo->source_file) {
+        UI_TextView("Source", demo->source_file);
+    }
+    UI_TextEditor("Query", demo->query_doc);
+    UI_PopPrefSize(UI_Axis_Y);
+    UI_PopFont();
+
+    // UI_Checkbox("Display FPS", &display_fps);
+
+    // if (display_fps) {
+    //     UI_Labelf("FPS:  %d", (int)frames_per_second);
+    // }
+}
+
+// NOTE: Each replay runs in its own context, so several can run on separate threads. Given
+// resources, the context shares their fonts and glyphs with the other replays.
+void demo_replay(char *path, FILE *report, bool *ok, UI_Resources *resources) {
+    UI_Context *context = resources ? UI_CreateSharedContext(resources) : UI_CreateContext();
+    UI_SetCurrentContext(context);
+    Demo_State demo{};
+    demo_init(&demo);
+    *ok = UI_Replay(path, demo_build_ui, &demo, report);
+    demo_shutdown(&demo);
+    UI_DestroyContext(context);
+}
+
+// NOTE: render_target points at the global, WM_SIZE replaces the view
+struct Demo_Target {
+    ID3D11DeviceContext *d3d_context;
+    ID3D11RenderTargetView **render_target;
+    ID3D11DepthStencilView *depth_stencil_view;
+    IDXGISwapChain *swapchain;
+};
+
+void demo_begin_target(Demo_Target *target, float width, float height) {
+    ID3D11DeviceContext *device_context = target->d3d_context;
+    float bg_color[4] = {1, 1, 1, 1};
+    device_context->ClearRenderTargetView(*target->render_target, bg_color);
+    device_context->ClearDepthStencilView(target->depth_stencil_view, D3D11_CLEAR_DEPTH|D3D11_CLEAR_STENCIL, 1.0f, 0);
+    device_context->OMSetRenderTargets(1, target->render_target, target->depth_stencil_view);
+
+    D3D11_VIEWPORT viewport{};
+    viewport.TopLeftX = 0.0f;
+    viewport.TopLeftY = 0.0f;
+    viewport.Width = width;
+    viewport.Height = height;
+    viewport.MinDepth = 0.0f;
+    viewport.MaxDepth = 1.0f;
+    device_context->RSSetViewports(1, &viewport);
+
+    device_context->OMSetBlendState(nullptr, NULL, 0xffffffff);
+}
+
+// NOTE: Runs on the render thread with --render-thread
+void demo_render_frame(UI_Viewport *viewport, UI_Draw_Data *draw_data, void *user) {
+    Demo_Target *target = (Demo_Target *)user;
+    demo_begin_target(target, draw_data->target_size.x, draw_data->target_size.y);
+    UI_RenderDrawData(draw_data);
+    target->swapchain->Present(0, 0);
+}
+
+int main(int argc, char **argv) {
+    char *record_path = nullptr;
+    char *replay_path = nullptr;
+    int replay_contexts = 1;
+    bool render_thread = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--render-thread") == 0) {
+            render_thread = true;
+        } else if (i + 1 == argc) {
+            break;
+        } else if (strcmp(argv[i], "--record") == 0) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0) {
+            replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--contexts") == 0) {
+            replay_contexts = UI_MAX(atoi(argv[++i]), 1);
+        } else if (strcmp(argv[i], "--image") == 0) {
+            demo_image_path = argv[++i];
+        }
+    }
+
+    // NOTE: Replay headlessly, without a window or device, as fast as possible. With
+    // --contexts N the recording is replayed by N contexts in parallel, sharing one set of
+    // fonts, and only the summaries are printed.
+    if (replay_path) {
+        if (replay_contexts == 1) {
+            bool ok = false;
+            demo_replay(replay_path, stdout, &ok, nullptr);
+            return ok ? 0 : 1;
+        }
+        std::vector<std::thread> threads;
+        bool *ok = (bool *)calloc(replay_contexts, sizeof(bool));
+        UI_Resources *resources = UI_CreateResources();
+        for (int i = 0; i < replay_contexts; i++) {
+            threads.push_back(std::thread(demo_replay, replay_path, (FILE *)nullptr, &ok[i], resources));
+        }
+        bool all_ok = true;
+        for (int i = 0; i < replay_contexts; i++) {
+            threads[i].join();
+            all_ok &= ok[i];
+        }
+        UI_ReleaseResources(resources);
+        free(ok);
+        return all_ok ? 0 : 1;
+    }
+
     QueryPerformanceFrequency(&performance_frequency);
-    timeBeginPeriod(1);
-    UINT desired_scheduler_ms = 1;
-    timeBeginPeriod(desired_scheduler_ms);
-    DWORD target_frames_per_second = 60;
-    DWORD target_ms_per_frame = (int)(1000.0f / target_frames_per_second);
 
     HRESULT hr = 0;
 #define CLASSNAME "imgui_hwnd_class"
@@ -192,21 +378,34 @@ int main() {
         d3d_device->CreateRasterizerState(&desc, &rasterizer_state);
     }
 
+    UI_CreateContext();
     UI_DX11BackendInit(d3d_device, d3d_context);
-    
+
+    Demo_State demo{};
+    demo_init(&demo);
+    if (record_path) {
+        UI_StartRecording(record_path);
+    }
+
+    Demo_Target target = {d3d_context, &render_target, depth_stencil_view, swapchain};
+    // NOTE: Builds the next frame while the render thread draws and presents this one
+    if (render_thread) {
+        UI_StartRenderThread(demo_render_frame, &target);
+    }
+
     bool display_fps = true;
     int radio = 0;
     float slider = 1.0f;
     float frames_per_second = 0.0f;
 
-    const int sample_len = 128;
-    char sample_field[sample_len];
-
     LARGE_INTEGER start_counter = win32_get_wall_clock();
     LARGE_INTEGER last_counter = start_counter;
 
     bool window_should_close = false;
     while (!window_should_close) {
+        // NOTE: Sleep until there is input or the UI asked for a frame, this is the only pacing
+        UI_WaitForEvents();
+
         MSG message{};
         while (PeekMessageA(&message, NULL, 0, 0, PM_REMOVE)) {
             if (message.message == WM_QUIT) {
@@ -226,68 +425,14 @@ int main() {
 
         UI_NewFrame(window);
 
-        UI_RowBegin("Menu");
-            if (UI_Button("File")) {
-                printf("File\n");
-            }
-            if (UI_Button("Edit")) {
-                printf("Edit\n");
-            }
-            if (UI_Button("Help")) {
-                printf("Help\n");
-            }
-            // UI_BorderColorPop();
-        UI_RowEnd();
-
-        UI_Widget *widget = UI_WidgetBuild("Table", (UI_WidgetFlags)(UI_WidgetFlags_DrawBorder | UI_WidgetFlags_DrawBackground));
-        widget->pref_size[UI_Axis_X] = UI_SIZE_PARENT(0.5f);
-        widget->pref_size[UI_Axis_Y] = UI_SIZE_PARENT(1.0f);
-
-        ui_state.parent_stack.push(widget);
-
-        UI_RowBegin("TableHeader");
-            UI_Button("First Name");
-            UI_Button("Last Name");
-            UI_Button("ID");
-        UI_RowEnd();
-
-        // UI_Slider("Slider", &slider, 0.0f, 1.0f);
-
-        // if (UI_Field("Field", sample_field, sample_len)) {
-        //     printf("%s\n", sample_field);
-        // }
-
-        // UI_Checkbox("Display FPS", &display_fps);
+        demo_build_ui(&demo);
 
-        // if (display_fps) {
-        //     UI_Labelf("FPS:  %d", (int)frames_per_second);
-        // }
-
-        float bg_color[4] = {1, 1, 1, 1};
-        d3d_context->ClearRenderTargetView(render_target, bg_color);
-        d3d_context->ClearDepthStencilView(depth_stencil_view, D3D11_CLEAR_DEPTH|D3D11_CLEAR_STENCIL, 1.0f, 0);
-        d3d_context->OMSetRenderTargets(1, &render_target, depth_stencil_view);
-
-        D3D11_VIEWPORT viewport{};
-        viewport.TopLeftX = 0.0f;
-        viewport.TopLeftY = 0.0f;
-        viewport.Width = (float)width;
-        viewport.Height = (float)height;
-        viewport.MinDepth = 0.0f;
-        viewport.MaxDepth = 1.0f;
-        d3d_context->RSSetViewports(1, &viewport);
-
-        d3d_context->OMSetBlendState(nullptr, NULL, 0xffffffff);
-
-        UI_EndFrame();
-
-        swapchain->Present(0, 0);
-
-        float work_seconds_elapsed = win32_get_seconds_elapsed(last_counter, win32_get_wall_clock());
-        DWORD work_ms = (DWORD)(1000.0f * work_seconds_elapsed);
-        if (work_ms < target_ms_per_frame) {
-            DWORD sleep_ms = target_ms_per_frame - work_ms;
-            Sleep(sleep_ms);
+        if (render_thread) {
+            UI_EndFrame();
+        } else {
+            demo_begin_target(&target, (float)width, (float)height);
+            UI_EndFrame();
+            swapchain->Present(0, 0);
         }
 
         LARGE_INTEGER end_counter = win32_get_wall_clock();
@@ -296,6 +441,10 @@ int main() {
         // printf("seconds: %f\n", seconds_elapsed);
         last_counter = end_counter;}
     
+    UI_StopRecording();
+    UI_StopRenderThread();
+    demo_shutdown(&demo);
+    UI_DestroyContext(UI_GetCurrentContext());
 
     return 0;
 }